@@ -106,6 +106,24 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
   __o;									\
  })
 
+/*
+ * Double-width CAS on an aligned 16-byte unit. Old and new values are
+ * _u128, low word first in memory, and the unit's old contents are
+ * returned, as with the others.
+ */
+#define CAS128(_a, _o, _n)                                               \
+({ _u128 __o = (_o), __n = (_n);                                         \
+   unsigned long __lo = (unsigned long)__o, __hi = (unsigned long)(__o >> 64); \
+   __asm__ __volatile__ ("lock cmpxchg16b %2"                            \
+                         : "=a" (__lo), "=d" (__hi),                     \
+                           "+m" (*(volatile _u128 *)(_a))                \
+                         : "0" (__lo), "1" (__hi),                       \
+                           "b" ((unsigned long)__n),                     \
+                           "c" ((unsigned long)(__n >> 64))              \
+                         : "memory");                                    \
+   ((_u128)__hi << 64) | __lo;                                           \
+})
+
 #define CAS(_x,_o,_n) ((sizeof (*_x) == 4)?CAS32(_x,_o,_n):CAS64(_x,_o,_n))
 #define FAS(_x,_n)    ((sizeof (*_x) == 4)?FAS32(_x,_n)   :FAS64(_x,_n))
 
@@ -139,6 +157,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define WMB_NEAR_CAS() WMB()
 #define MB_NEAR_CAS()  WMB()
 
+/* Spin-wait hint, so that a waiting thread yields to its sibling. */
+#define CPU_RELAX() __asm__ __volatile__ ("rep; nop" : : : "memory")
+
 
 /*
  * III. Cycle counter access.
@@ -161,5 +182,6 @@ typedef unsigned char _u8;
 typedef unsigned short _u16;
 typedef unsigned int _u32;
 typedef unsigned long long _u64;
+typedef unsigned __int128 _u128;
 
 #endif /* __INTEL_DEFNS_H__ */
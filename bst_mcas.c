@@ -35,17 +35,18 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define __SET_IMPLEMENTATION__
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include "portable_defns.h"
+#include "random.h"
 #include "gc.h"
+#include "ptst.h"
+#include "osi_mcas.h"
 #include "set.h"
 
-/* Allow MCAS marks to be detected using a single bitop (see IS_MCAS_OWNED). */
-#define MARK_IN_PROGRESS 2
-#define MARK_PTR_TO_CD   3
-
+/* MCAS leaves bit 0 free, and its marks have bit 1 set (see IS_MCAS_OWNED). */
 #define MARK_THREAD      1
 #define MARK_GARBAGE     4
 
@@ -54,14 +55,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define UNTHREAD(_p) ((node_t *)((int_addr_t)(_p)&~MARK_THREAD))
 #define UNGARBAGE(_p) ((node_t *)((int_addr_t)(_p)&~MARK_GARBAGE))
 /* Following only matches 2 and 3 (mod 4). Those happen to be MCAS marks :) */
-#define IS_MCAS_OWNED(_p)   ((int)((int_addr_t)(_p)&2))
+#define IS_MCAS_OWNED(_p)   ((int)MCAS_IS_OWNED(_p))
 /* Matches 1 and 3 (mod 4). So only use if the ref is *not* owned by MCAS!! */
 #define IS_THREAD(_p)       ((int)((int_addr_t)(_p)&MARK_THREAD))
 /* Only use if the ref is *not* owned by MCAS (which may use bit 2)!! */
 #define IS_GARBAGE(_p)      ((int)((int_addr_t)(_p)&MARK_GARBAGE))
 
-#include "mcas.c"
-
 typedef struct node_st node_t;
 typedef struct set_st set_t;
 
@@ -79,6 +78,7 @@ struct set_st
 };
 
 static int gc_id;
+static gc_global_t *gc_global;
 
 #define READ_LINK(_var, _link)                              \
     do {                                                    \
@@ -154,15 +154,10 @@ set_t *set_alloc(void)
 {
     set_t *s;
 
-    static int mcas_inited = 0;
-    if ( !CASIO(&mcas_inited, 0, 1) )
+    if ( (sizeof(node_t) % 8) != 0 )
     {
-        if ( (sizeof(node_t) % 8) != 0 )
-        {
-            fprintf(stderr, "FATAL: node_t must be multiple of 8 bytes\n");
-            *((int*)0)=0;
-        }
-        mcas_init();
+        fprintf(stderr, "FATAL: node_t must be multiple of 8 bytes\n");
+        *((int*)0)=0;
     }
 
     s = malloc(sizeof(*s));
@@ -185,7 +180,7 @@ setval_t set_update(set_t *s, setkey_t k, setval_t v, int overwrite)
 
     k = CALLER_TO_INTERNAL_KEY(k);
 
-    ptst = critical_enter();
+    ptst = critical_enter(gc_global);
 
     do {
     retry:
@@ -371,7 +366,7 @@ setval_t set_remove(set_t *s, setkey_t k)
 
     k = CALLER_TO_INTERNAL_KEY(k);
 
-    ptst = critical_enter();
+    ptst = critical_enter(gc_global);
 
     do
     {
@@ -419,7 +414,7 @@ setval_t set_lookup(set_t *s, setkey_t k)
 
     k = CALLER_TO_INTERNAL_KEY(k);
 
-    ptst = critical_enter();
+    ptst = critical_enter(gc_global);
 
     n = search(s, k, NULL);
     v = (!IS_THREAD(n)) ? n->v : NULL;
@@ -430,7 +425,8 @@ setval_t set_lookup(set_t *s, setkey_t k)
 }
 
 
-void _init_set_subsystem(void)
+void _init_set_subsystem(gc_global_t *g)
 {
-    gc_id = gc_add_allocator(sizeof(node_t));
+    gc_global = g;
+    gc_id = gc_add_allocator(gc_global, sizeof(node_t), "bst_mcas");
 }
@@ -35,11 +35,26 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+/*
+ * Per-CPU allocation caches use restartable sequences, which glibc 2.35
+ * and later register for every thread.
+ */
+#if defined(X86_64) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define GC_RSEQ
+#endif
+#endif
 #include "portable_defns.h"
 #include "random.h"
 #include "gc.h"
@@ -59,14 +74,46 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define MEM_FAIL(_s) \
 do { \
-    fprintf(stderr, "OUT OF MEMORY: %d bytes at line %d\n", (_s), __LINE__); \
+    fprintf(stderr, "OUT OF MEMORY: %lu bytes at line %d\n",           \
+            (unsigned long)(_s), __LINE__);                               \
     abort(); \
 } while ( 0 )
 #endif
 
-/* Allocate more empty chunks from the heap. */
+/* Is the heap close to its soft limit? */
+#define HEAP_PRESSURE(_g) \
+    (((_g)->heap_pressure != 0) && ((_g)->total_size >= (_g)->heap_pressure))
+
+/*
+ * Allocate cache-aligned memory for the domain. A shared domain carves it
+ * from its own mapping, and never gets it back; nor does a private one,
+ * which takes it from the heap. Returns NULL on failure.
+ */
+static void *domain_alloc(gc_global_t *gc_global, unsigned long bytes)
+{
+    char *p, *new_p;
+
+    if ( !IS_SHARED(gc_global) ) return(ALIGNED_ALLOC(bytes));
+
+    bytes  = (bytes + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1UL);
+    new_p  = gc_global->shared_next;
+    do {
+        p = new_p;
+        if ( (unsigned long)(gc_global->shared_end - p) < bytes )
+            return(NULL);
+    }
+    while ( (new_p = CASPO(&gc_global->shared_next, p, p + bytes)) != p );
+
+    return(p);
+}
+
+
+/*
+ * Allocate more empty chunks from the heap. Failure is fatal unless
+ * @may_fail is set, in which case NULL is returned.
+ */
 #define CHUNKS_PER_ALLOC 1000
-static chunk_t *alloc_more_chunks(void)
+static chunk_t *alloc_more_chunks(gc_global_t *gc_global, int may_fail)
 {
     int i;
     chunk_t *h, *p;
@@ -74,8 +121,12 @@ static chunk_t *alloc_more_chunks(void)
     SUBSYS_LOG_MACRO(11, ("GC: alloc_more_chunks alloc %lu chunks\n",
         CHUNKS_PER_ALLOC));
 
-    h = p = ALIGNED_ALLOC(CHUNKS_PER_ALLOC * sizeof(*h));
-    if ( h == NULL ) MEM_FAIL(CHUNKS_PER_ALLOC * sizeof(*h));
+    h = p = domain_alloc(gc_global, CHUNKS_PER_ALLOC * sizeof(*h));
+    if ( h == NULL )
+    {
+        if ( may_fail ) return(NULL);
+        MEM_FAIL(CHUNKS_PER_ALLOC * sizeof(*h));
+    }
 
     for ( i = 1; i < CHUNKS_PER_ALLOC; i++ )
     {
@@ -101,10 +152,10 @@ static void add_chunks_to_list(chunk_t *ch, chunk_t *head)
 
 
 /* Allocate a chain of @n empty chunks. Pointers may be garbage. */
-static chunk_t *get_empty_chunks(gc_global_t *gc_global, int n)
+static chunk_t *get_empty_chunks(gc_global_t *gc_global, int n, int may_fail)
 {
     int i;
-    chunk_t *new_rh, *rh, *rt, *head;
+    chunk_t *new_rh, *rh, *rt, *head, *more;
 
  retry:
     head = gc_global->free_chunks;
@@ -118,7 +169,9 @@ static chunk_t *get_empty_chunks(gc_global_t *gc_global, int n)
             if ( (rt = rt->next) == head )
             {
                 /* Allocate some more chunks. */
-                add_chunks_to_list(alloc_more_chunks(), head);
+                if ( (more = alloc_more_chunks(gc_global, may_fail)) == NULL )
+                    return(NULL);
+                add_chunks_to_list(more, head);
                 goto retry;
             }
         }
@@ -130,35 +183,70 @@ static chunk_t *get_empty_chunks(gc_global_t *gc_global, int n)
 }
 
 
-/* Get @n filled chunks, pointing at blocks of @sz bytes each. */
-static chunk_t *get_filled_chunks(gc_global_t *gc_global, int n, int sz)
+/*
+ * Get @n filled chunks, pointing at blocks for allocator @gs. Each block
+ * is preceded by the domain's per-block header, if it has one. With
+ * @may_fail set, NULL is returned rather than exceed the soft heap limit
+ * or abort when memory is exhausted.
+ */
+static chunk_t *get_filled_chunks(gc_global_t *gc_global, gc_size_t *gs,
+                                  int n, int may_fail)
 {
     chunk_t *h, *p;
+    gc_slab_t *slab, *next, *new_next;
+    gc_ctor_t *ctor;
     char *node;
-    int i;
+    unsigned long bytes;
+    int i, hsz = gc_global->hdr_size, sz = gs->blk_size + hsz;
 
-#ifdef PROFILE_GC
-    ADD_TO(gc_global->total_size, n * BLKS_PER_CHUNK * sz);
-    ADD_TO(gc_global->allocations, 1);
-#endif
+    bytes = (unsigned long)n * BLKS_PER_CHUNK * sz + SLAB_HDR_SIZE;
+
+    if ( may_fail && (gc_global->heap_soft_limit != 0) &&
+         ((gc_global->total_size + bytes) > gc_global->heap_soft_limit) )
+        return(NULL);
 
-    node = ALIGNED_ALLOC(n * BLKS_PER_CHUNK * sz);
-    if ( node == NULL ) MEM_FAIL(n * BLKS_PER_CHUNK * sz);
+    if ( (h = get_empty_chunks(gc_global, n, may_fail)) == NULL )
+        return(NULL);
+
+    node = domain_alloc(gc_global, bytes);
+    if ( node == NULL )
+    {
+        if ( !may_fail ) MEM_FAIL(bytes);
+        add_chunks_to_list(h, gc_global->free_chunks);
+        return(NULL);
+    }
 #ifdef WEAK_MEM_ORDER
-    INITIALISE_NODES(node, n * BLKS_PER_CHUNK * sz);
+    INITIALISE_NODES(node, bytes);
 #endif
 
-    h = p = get_empty_chunks(gc_global, n);
+    ADD_TO(gc_global->total_size, bytes);
+    ADD_TO(gc_global->allocations, 1);
+    ADD_TO(gs->reserved, bytes);
+
+    slab = (gc_slab_t *)node;
+    slab->nr_blks = (unsigned long)n * BLKS_PER_CHUNK;
+    node += SLAB_HDR_SIZE;
+
+    ctor = gs->ctor;
+    p = h;
     do {
         p->i = BLKS_PER_CHUNK;
         for ( i = 0; i < BLKS_PER_CHUNK; i++ )
         {
-            p->blk[i] = node;
+            p->blk[i] = node + hsz;
+            if ( ctor != NULL ) ctor->fn(p->blk[i], ctor->arg);
             node += sz;
         }
     }
     while ( (p = p->next) != h );
 
+    new_next = gs->slabs;
+    do {
+        slab->next = next = new_next;
+        WMB_NEAR_CAS();
+    }
+    while ( (new_next = CASPO(&gs->slabs, next, slab)) != next );
+
     return(h);
 }
 
@@ -183,23 +271,120 @@ static void gc_async_barrier(gc_t *gc)
 #endif
 
 
+/* Allocate a table of @size entries, copying those of @prev. */
+static gc_table_t *table_alloc(gc_global_t *gc_global, int size,
+                               gc_table_t *prev)
+{
+    size_t bytes = sizeof(gc_table_t) + (size - 1) * sizeof(void *);
+    gc_table_t *t = domain_alloc(gc_global, bytes);
+
+    if ( t == NULL ) MEM_FAIL(bytes);
+    memset(t, 0, bytes);
+    t->size = size;
+    t->prev = prev;
+    if ( prev != NULL )
+        memcpy((void *)t->ent, (void *)prev->ent, prev->size * sizeof(void *));
+
+    return(t);
+}
+
+
+/*
+ * Make sure the table at @pt has room for entry @i. The caller must be
+ * the only thread which may modify the table.
+ */
+static gc_table_t *table_reserve(gc_global_t *gc_global,
+                                 gc_table_t * VOLATILE *pt, int i)
+{
+    gc_table_t *t = *pt;
+    int size;
+
+    if ( i < t->size ) return(t);
+    for ( size = t->size << 1; size <= i; size <<= 1 ) continue;
+    t = table_alloc(gc_global, size, t);
+    WMB();
+    *pt = t;
+
+    return(t);
+}
+
+
+#define GC_SIZE(_g,_i) ((gc_size_t *)(_g)->sizes->ent[_i])
+#define GC_HOOK(_g,_i) ((gc_hook_t *)(_g)->hooks->ent[_i])
+
+static chunk_t *chunk_from_cache(gc_t *gc);
+
+static gc_tsize_t *tsize_create(gc_t *gc, int id)
+{
+    gc_tsize_t *ts = domain_alloc(gc->global, sizeof(*ts));
+
+    if ( ts == NULL ) MEM_FAIL(sizeof(*ts));
+    memset(ts, 0, sizeof(*ts));
+    ts->alloc = chunk_from_cache(gc);
+    WMB();
+    table_reserve(gc->global, &gc->sizes, id)->ent[id] = ts;
+
+    return(ts);
+}
+
+/* This thread's state for allocator @id. */
+static inline gc_tsize_t *gc_tsize(gc_t *gc, int id)
+{
+    gc_tsize_t *ts = TABLE_ENT(gc->sizes, id);
+    return((ts != NULL) ? ts : tsize_create(gc, id));
+}
+
+static gc_thook_t *thook_create(gc_t *gc, int id)
+{
+    gc_thook_t *th = domain_alloc(gc->global, sizeof(*th));
+
+    if ( th == NULL ) MEM_FAIL(sizeof(*th));
+    memset(th, 0, sizeof(*th));
+    WMB();
+    table_reserve(gc->global, &gc->hooks, id)->ent[id] = th;
+
+    return(th);
+}
+
+/* This thread's state for hook @id. */
+static inline gc_thook_t *gc_thook(gc_t *gc, int id)
+{
+    gc_thook_t *th = TABLE_ENT(gc->hooks, id);
+    return((th != NULL) ? th : thook_create(gc, id));
+}
+
+
 /* Grab a level @i allocation chunk from main chain. */
-static chunk_t *get_alloc_chunk(gc_t *gc, int i)
+static chunk_t *get_alloc_chunk(gc_t *gc, int i, int may_fail)
 {
     chunk_t *alloc, *p, *new_p, *nh;
     unsigned int sz;
     gc_global_t *gc_global = gc->global;
+    gc_size_t *gs = GC_SIZE(gc_global, i);
 
-    alloc = gc_global->alloc[i];
+    alloc = gs->alloc;
     new_p = alloc->next;
 
     do {
         p = new_p;
         while ( p == alloc )
         {
-            sz = gc_global->alloc_size[i];
-            nh = get_filled_chunks(gc_global, sz, gc_global->blk_sizes[i]);
-            ADD_TO(gc_global->alloc_size[i], sz >> 3);
+            sz = gs->alloc_size;
+            if ( (nh = get_filled_chunks(gc_global, gs, sz,
+                                         may_fail)) != NULL )
+            {
+                ADD_TO(gs->alloc_size, sz >> 3);
+            }
+            else if ( (nh = get_filled_chunks(gc_global, gs, 1, 1)) != NULL )
+            {
+                sz = 1;
+            }
+            else
+            {
+                /* Not even a single chunk fits. */
+                return(NULL);
+            }
+            ADD_TO(gs->nr_alloc_chunks, sz);
             gc_async_barrier(gc);
             add_chunks_to_list(nh, alloc);
             p = alloc->next;
@@ -208,13 +393,216 @@ static chunk_t *get_alloc_chunk(gc_t *gc, int i)
     }
     while ( (new_p = CASPO(&alloc->next, p, p->next)) != p );
 
+    SUB_FROM(gs->nr_alloc_chunks, 1);
     p->next = p;
-    assert(p->i == BLKS_PER_CHUNK);
+    /* Chunks flushed by exiting threads may be partially used. */
+    assert(p->i != 0);
     return(p);
 }
 
 
+/* Join chunk rings @a and @b, either of which may be NULL. */
+static chunk_t *splice_chunks(chunk_t *a, chunk_t *b)
+{
+    chunk_t *t;
+
+    if ( a == NULL ) return(b);
+    if ( b == NULL ) return(a);
+    t = a->next;
+    a->next = b->next;
+    b->next = t;
+    return(a);
+}
+
+
+/* Remove @ch from its ring. Returns the rest of the ring, or NULL. */
+static chunk_t *unlink_chunk(chunk_t *ch)
+{
+    chunk_t *p, *rest = ch->next;
+
+    if ( rest == ch ) return(NULL);
+    for ( p = rest; p->next != ch; p = p->next ) continue;
+    p->next  = rest;
+    ch->next = ch;
+    return(rest);
+}
+
+
+#ifdef WEAK_MEM_ORDER
+/* Initialise every block on garbage ring @head, of @sz-byte blocks. */
+static void initialise_garbage(chunk_t *head, int sz)
+{
+    chunk_t *ch = head;
+    int j;
+
+    if ( ch == NULL ) return;
+    do {
+        for ( j = 0; j < ch->i; j++ )
+            INITIALISE_NODES(ch->blk[j], sz);
+    }
+    while ( (ch = ch->next) != head );
+}
+#endif
+
+
 #ifndef MINIMAL_GC
+/* Run the deferred callbacks in ring @ch, and free its chunks. */
+static void run_deferred(gc_global_t *gc_global, chunk_t *ch, ptst_t *our_ptst)
+{
+    chunk_t *t = ch;
+    int j;
+
+    do {
+        for ( j = 0; j < t->i; j += 2 )
+            ((hook_fn_t)t->blk[j])(our_ptst, t->blk[j+1]);
+    }
+    while ( (t = t->next) != ch );
+
+    add_chunks_to_list(ch, gc_global->free_chunks);
+}
+
+
+/*
+ * Move the three-epoch-old garbage of @ptst to the allocation lists, clean
+ * out its two-epoch-old garbage, and run its three-epoch-old hooks.
+ */
+static void reclaim_ptst(gc_global_t *gc_global, ptst_t *ptst,
+                         int two_ago, int three_ago, ptst_t *our_ptst)
+{
+    gc_t       *gc = ptst->gc;
+    gc_table_t *sizes = gc->sizes, *hooks = gc->hooks;
+    gc_tsize_t *ts;
+    gc_thook_t *th;
+    gc_size_t  *gs;
+    chunk_t    *ch, *t;
+    int         i, j;
+
+#ifndef WEAK_MEM_ORDER
+    (void)two_ago; /* Only scrubbed on weakly-ordered machines. */
+#endif
+
+    for ( i = 0; i < gc_global->nr_sizes; i++ )
+    {
+        /* Allocators this thread has never used have no state. */
+        if ( (ts = TABLE_ENT(sizes, i)) == NULL ) continue;
+        gs = GC_SIZE(gc_global, i);
+
+#ifdef WEAK_MEM_ORDER
+        initialise_garbage(ts->garbage[two_ago], gs->blk_size);
+#endif
+
+        /* NB. Leave one chunk behind, as it is probably not yet full. */
+        t = ts->garbage[three_ago];
+        if ( (t == NULL) || ((ch = t->next) == t) ) continue;
+        ts->garbage_tail[three_ago]->next = ch;
+        ts->garbage_tail[three_ago] = t;
+        t->next = t;
+
+        SUBSYS_LOG_MACRO(11, ("GC: return %lu blocks of size %d to "
+                              "allocator %d\n",
+                              ts->nr_garbage[three_ago] - t->i,
+                              gs->blk_size, i));
+        ADD_TO(gs->nr_alloc_chunks,
+               (ts->nr_garbage[three_ago] - t->i) / BLKS_PER_CHUNK);
+        ts->nr_garbage[three_ago] = t->i;
+        add_chunks_to_list(ch, gs->alloc);
+    }
+
+    for ( i = 0; i < gc_global->nr_hooks; i++ )
+    {
+        hook_fn_t fn = GC_HOOK(gc_global, i)->fn;
+        if ( (th = TABLE_ENT(hooks, i)) == NULL ) continue;
+        ch = th->list[three_ago];
+        if ( ch == NULL ) continue;
+        th->list[three_ago] = NULL;
+
+	    if (fn) {
+		t = ch;
+		do { for ( j = 0; j < t->i; j++ ) fn(our_ptst, t->blk[j]); }
+		while ( (t = t->next) != ch );
+	    }
+
+        add_chunks_to_list(ch, gc_global->free_chunks);
+    }
+
+    if ( (ch = gc->defer[three_ago]) != NULL )
+    {
+        gc->defer[three_ago] = NULL;
+        run_deferred(gc_global, ch, our_ptst);
+    }
+}
+
+
+/*
+ * As reclaim_ptst(), for the lists left behind by exited threads. These
+ * move in their entirety, as nothing will add to them in the meantime.
+ */
+static void reclaim_orphans(gc_global_t *gc_global,
+                            int two_ago, int three_ago, ptst_t *our_ptst)
+{
+    gc_size_t *gs;
+    gc_hook_t *gh;
+    chunk_t *ch, *t;
+    int i, j;
+
+#ifndef WEAK_MEM_ORDER
+    (void)two_ago; /* Only scrubbed on weakly-ordered machines. */
+#endif
+
+    for ( i = 0; i < gc_global->nr_sizes; i++ )
+    {
+        gs = GC_SIZE(gc_global, i);
+#ifdef WEAK_MEM_ORDER
+        initialise_garbage(gs->orphan_garbage[two_ago], gs->blk_size);
+#endif
+        if ( (ch = gs->orphan_garbage[three_ago]) == NULL ) continue;
+        gs->orphan_garbage[three_ago] = NULL;
+        ADD_TO(gs->nr_alloc_chunks, gs->orphan_chunks[three_ago]);
+        gs->orphan_chunks[three_ago] = 0;
+        gs->orphan_blks[three_ago]   = 0;
+        add_chunks_to_list(ch, gs->alloc);
+    }
+
+    for ( i = 0; i < gc_global->nr_hooks; i++ )
+    {
+        gh = GC_HOOK(gc_global, i);
+        if ( (ch = gh->orphan[three_ago]) == NULL ) continue;
+        gh->orphan[three_ago] = NULL;
+        if ( gh->fn != NULL )
+        {
+            t = ch;
+            do { for ( j = 0; j < t->i; j++ ) gh->fn(our_ptst, t->blk[j]); }
+            while ( (t = t->next) != ch );
+        }
+        add_chunks_to_list(ch, gc_global->free_chunks);
+    }
+
+    if ( (ch = gc_global->orphan_defer[three_ago]) != NULL )
+    {
+        gc_global->orphan_defer[three_ago] = NULL;
+        run_deferred(gc_global, ch, our_ptst);
+    }
+}
+
+
+/*
+ * Has every thread inside a critical region seen the current epoch?
+ * @first_ptst must be read before the barrier preceding the read of
+ * @curr_epoch.
+ */
+static int all_seen_epoch(ptst_t *first_ptst, unsigned long curr_epoch)
+{
+    ptst_t *ptst;
+
+    for ( ptst = first_ptst; ptst != NULL; ptst = ptst_next(ptst) )
+    {
+        if ( (ptst->count > 1) && (ptst->gc->epoch != curr_epoch) ) return(0);
+    }
+
+    return(1);
+}
+
+
 /*
  * gc_reclaim: Scans the list of struct gc_perthread looking for the lowest
  * maximum epoch number seen by a thread that's in the list code. If it's the
@@ -224,15 +612,13 @@ static chunk_t *get_alloc_chunk(gc_t *gc, int i)
 static void gc_reclaim(gc_global_t *gc_global)
 {
     ptst_t       *ptst, *first_ptst, *our_ptst = NULL;
-    gc_t         *gc = NULL;
     unsigned long curr_epoch;
-    chunk_t      *ch, *t;
-    int           two_ago, three_ago, i, j;
+    int           two_ago, three_ago;
 
     SUBSYS_LOG_MACRO(11, ("GC: gc_reclaim enter\n"));
 
     /* Barrier to entering the reclaim critical section. */
-    if ( gc_global->inreclaim || CASIO(&gc_global->inreclaim, 0, 1) ) return;
+    if ( gc_global->inreclaim || CASIO(&gc_global->inreclaim, 0, gc_pid) ) return;
 
     SUBSYS_LOG_MACRO(11, ("GC: gc_reclaim after inreclaim barrier\n"));
 
@@ -245,12 +631,12 @@ static void gc_reclaim(gc_global_t *gc_global)
     curr_epoch = gc_global->current;
 
     /* Have all threads seen the current epoch, or not in mutator code? */
-    for ( ptst = first_ptst; ptst != NULL; ptst = ptst_next(ptst) )
+    if ( !all_seen_epoch(first_ptst, curr_epoch) )
     {
-        if ( (ptst->count > 1) && (ptst->gc->epoch != curr_epoch) ) goto out;
+        gc_global->nr_reclaim_failed++;
+        goto out;
     }
 
-
     SUBSYS_LOG_MACRO(11, ("GC: gc_reclaim all-threads see current epoch\n"));
 
     /*
@@ -259,373 +645,1548 @@ static void gc_reclaim(gc_global_t *gc_global)
      */
     two_ago   = (curr_epoch+2) % NR_EPOCHS;
     three_ago = (curr_epoch+1) % NR_EPOCHS;
-    if ( gc_global->nr_hooks != 0 )
-        our_ptst = (ptst_t *)pthread_getspecific(gc_global->ptst_key);
+    our_ptst  = ptst_self(gc_global);
     for ( ptst = first_ptst; ptst != NULL; ptst = ptst_next(ptst) )
-    {
-        gc = ptst->gc;
-
-        for ( i = 0; i < gc_global->nr_sizes; i++ )
-        {
-#ifdef WEAK_MEM_ORDER
-            int sz = gc_global->blk_sizes[i];
-            if ( gc->garbage[two_ago][i] != NULL )
-            {
-                chunk_t *head = gc->garbage[two_ago][i];
-                ch = head;
-                do {
-                    int j;
-                    for ( j = 0; j < ch->i; j++ )
-                        INITIALISE_NODES(ch->blk[j], sz);
-                }
-                while ( (ch = ch->next) != head );
-            }
-#endif
-
-            /* NB. Leave one chunk behind, as it is probably not yet full. */
-            t = gc->garbage[three_ago][i];
-            if ( (t == NULL) || ((ch = t->next) == t) ) continue;
-            gc->garbage_tail[three_ago][i]->next = ch;
-            gc->garbage_tail[three_ago][i] = t;
-            t->next = t;
-
-			/* gc inst: compute and log size of returned list */
-			{
-				chunk_t *ch_head, *ch_next;
-				int r_ix, r_len, r_size;
-				r_ix = 0;
-				r_len = 0;
-				r_size = 0;
-
-				/* XXX: nonfatal, may be missing multiplier */
-				ch_next = ch_head = ch;
-			    do {
-					r_len++;
-				} while ((ch_next = ch_next->next)
-					&& (ch_next != ch_head));
-
-				SUBSYS_LOG_MACRO(11, ("GC: return %d chunks of size %d to "
-							 "gc_global->alloc[%d]\n",
-							 r_len,
-							 gc_global->blk_sizes[i],
-							 i));
-			}
-
-
-            add_chunks_to_list(ch, gc_global->alloc[i]);
-        }
-
-        for ( i = 0; i < gc_global->nr_hooks; i++ )
-        {
-            hook_fn_t fn = gc_global->hook_fns[i];
-            ch = gc->hook[three_ago][i];
-            if ( ch == NULL ) continue;
-            gc->hook[three_ago][i] = NULL;
-
-	    if (fn) {
-		t = ch;
-		do { for ( j = 0; j < t->i; j++ ) fn(our_ptst, t->blk[j]); }
-		while ( (t = t->next) != ch );
-	    }
-
-			/* gc inst: compute and log size of returned list */
-			{
-				chunk_t *ch_head, *ch_next;
-				int r_ix, r_len, r_size;
-				r_ix = 0;
-				r_len = 0;
-
-				/* XXX: nonfatal, may be missing multiplier */
-				ch_head = ch;
-			    do {
-					r_len++;
-				} while (ch->next && (ch->next != ch_head)
-						 && (ch_next = ch->next));
-
-				SUBSYS_LOG_MACRO(11, ("GC: return %d chunks to gc_global->free_chunks\n",
-							 r_len));
-			}
-
-            add_chunks_to_list(ch, gc_global->free_chunks);
-        }
-    }
+        reclaim_ptst(gc_global, ptst, two_ago, three_ago, our_ptst);
+    reclaim_orphans(gc_global, two_ago, three_ago, our_ptst);
 
     /* Update current epoch. */
     SUBSYS_LOG_MACRO(11, ("GC: gc_reclaim epoch transition (leaving %lu)\n",
 				 curr_epoch));
 
+    gc_global->nr_epochs++;
     WMB();
     gc_global->current = (curr_epoch+1) % NR_EPOCHS;
 
  out:
     gc_global->inreclaim = 0;
 }
-#endif /* MINIMAL_GC */
 
 
-void *gc_alloc(ptst_t *ptst, int alloc_id)
+/*
+ * BACKGROUND RECLAIMER
+ *
+ * When the domain is configured with a reclaim interval, a dedicated thread
+ * performs all epoch transitions and mutators never call gc_reclaim(). Each
+ * pass is split into batches of at most reclaim_batch threads, so that no
+ * single step holds the reclaim barrier for long. The cursor persists
+ * between batches; the epoch advances only once the pass is complete, so
+ * the three-epoch-old lists stay put in the meantime.
+ */
+static void gc_reclaim_batch(gc_global_t *gc_global)
 {
-    gc_t *gc = ptst->gc;
-    chunk_t *ch;
-    gc_global_t *gc_global = gc->global;
+    ptst_t       *ptst, *our_ptst = NULL;
+    unsigned long curr_epoch;
+    unsigned int  n;
 
-    ch = gc->alloc[alloc_id];
-    if ( ch->i == 0 )
+    if ( gc_global->inreclaim || CASIO(&gc_global->inreclaim, 0, gc_pid) ) return;
+
+    if ( (ptst = gc_global->reclaim_cursor) == NULL )
     {
-        if ( gc->alloc_chunks[alloc_id]++ == 100 )
-        {
-            gc->alloc_chunks[alloc_id] = 0;
-            add_chunks_to_list(ch, gc_global->free_chunks);
-            gc->alloc[alloc_id] = ch = get_alloc_chunk(gc, alloc_id);
-        }
-        else
+        /* Start of a pass. */
+        ptst = ptst_first(gc_global);
+        MB();
+        if ( !all_seen_epoch(ptst, gc_global->current) )
         {
-            chunk_t *och = ch;
-            ch = get_alloc_chunk(gc, alloc_id);
-            ch->next  = och->next;
-            och->next = ch;
-            gc->alloc[alloc_id] = ch;
+            gc_global->nr_reclaim_failed++;
+            goto out;
         }
     }
 
-    return ch->blk[--ch->i];
-}
-
-int
-gc_get_blocksize(gc_global_t *gc_global, int alloc_id)
-{
-    return (gc_global->blk_sizes[alloc_id]);
-}
-
-const char *
-gc_get_tag(gc_global_t *gc_global, int alloc_id)
-{
-    return (gc_global->tags[alloc_id]);
-}
-
-static chunk_t *chunk_from_cache(gc_t *gc)
-{
-    chunk_t *ch = gc->chunk_cache, *p = ch->next;
-    gc_global_t *gc_global = gc->global;
-
-    if ( ch == p )
+    curr_epoch = gc_global->current;
+    our_ptst   = ptst_self(gc_global);
+    /*
+     * We are outside any critical region, so our epoch is stale. Bring it
+     * up to date, so that anything hooks and callbacks free or defer is
+     * filed under the current epoch.
+     */
+    our_ptst->gc->epoch = curr_epoch;
+    for ( n = 0;
+          (ptst != NULL) && ((gc_global->reclaim_batch == 0) ||
+                             (n < gc_global->reclaim_batch));
+          ptst = ptst_next(ptst), n++ )
     {
-        gc->chunk_cache = get_empty_chunks(gc_global, 100);
+        reclaim_ptst(gc_global, ptst, (curr_epoch+2) % NR_EPOCHS,
+                     (curr_epoch+1) % NR_EPOCHS, our_ptst);
     }
-    else
+
+    if ( (gc_global->reclaim_cursor = ptst) == NULL )
     {
-        ch->next = p->next;
-        p->next  = p;
+        reclaim_orphans(gc_global, (curr_epoch+2) % NR_EPOCHS,
+                        (curr_epoch+1) % NR_EPOCHS, our_ptst);
+        gc_global->nr_epochs++;
+        WMB();
+        gc_global->current = (curr_epoch+1) % NR_EPOCHS;
     }
 
-    p->i = 0;
-    return(p);
+ out:
+    gc_global->inreclaim = 0;
 }
 
 
-void gc_free(ptst_t *ptst, void *p, int alloc_id)
+static void *gc_reclaimer(void *arg)
 {
-#ifndef MINIMAL_GC
-    gc_t *gc = ptst->gc;
-    chunk_t *prev, *new, *ch = gc->garbage[gc->epoch][alloc_id];
-
-    if ( ch == NULL )
-    {
-        gc->garbage[gc->epoch][alloc_id] = ch = chunk_from_cache(gc);
-        gc->garbage_tail[gc->epoch][alloc_id] = ch;
-    }
-    else if ( ch->i == BLKS_PER_CHUNK )
+    gc_global_t *gc_global = arg;
+    unsigned int us = gc_global->reclaim_interval_us;
+    struct timespec ts;
+    ptst_t *ptst;
+
+    /* Hooks and deferred callbacks are handed the reclaiming thread's ptst. */
+    ptst = critical_enter(gc_global);
+    critical_exit(ptst);
+
+    ts.tv_sec  = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while ( !gc_global->reclaimer_stop )
     {
-        prev = gc->garbage_tail[gc->epoch][alloc_id];
-        new  = chunk_from_cache(gc);
-        gc->garbage[gc->epoch][alloc_id] = new;
-        new->next  = ch;
-        prev->next = new;
-        ch = new;
+        gc_reclaim_batch(gc_global);
+        /*
+         * Finish a partial pass promptly, and keep going while the heap is
+         * under pressure, but let others run first.
+         */
+        if ( (gc_global->reclaim_cursor != NULL) || HEAP_PRESSURE(gc_global) )
+            sched_yield();
+        else
+            nanosleep(&ts, NULL);
     }
 
-    ch->blk[ch->i++] = p;
-#endif
+    return(NULL);
 }
+#endif /* MINIMAL_GC */
 
 
-void gc_add_ptr_to_hook_list(ptst_t *ptst, void *ptr, int hook_id)
-{
-    gc_t *gc = ptst->gc;
-    chunk_t *och, *ch = gc->hook[gc->epoch][hook_id];
+#ifndef MINIMAL_GC
+static void ibr_on_alloc(gc_t *gc, void *p);
+static void ibr_scan(gc_t *gc);
+#endif
 
-    if ( ch == NULL )
-    {
-        gc->hook[gc->epoch][hook_id] = ch = chunk_from_cache(gc);
+#ifdef GC_RSEQ
+/*
+ * Per-CPU allocation caches. Each allocator has a chunk per CPU, which
+ * threads pop from and push to inside restartable sequences: if a thread
+ * is preempted, migrated or signalled before the single committing store,
+ * the kernel restarts the sequence, so no atomics are needed. An empty
+ * chunk is swapped for a full one from the main list; a full one sends
+ * frees back to the per-thread path.
+ */
+
+/* The slot arithmetic below assumes this. */
+typedef char pcpu_slot_size_check[(sizeof(pcpu_slot_t) == 64) ? 1 : -1];
+
+static inline struct rseq *rseq_area(void)
+{
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/* Is rseq registered for the calling thread? */
+static int rseq_available(void)
+{
+    return (__rseq_size != 0) && ((int)rseq_area()->cpu_id >= 0);
+}
+
+/*
+ * Open a restartable sequence, and leave this CPU's slot in %rax. Label 1
+ * starts the sequence, and the store at label 2 commits it. On abort the
+ * kernel clears rseq_cs, so the handler (label 4, preceded by the
+ * signature) re-arms it at label 6. A thread without rseq, or on an
+ * unexpected CPU, takes the failure exit.
+ */
+#define RSEQ_SIG_STR "0x53053053"
+#define RSEQ_START                                               \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                         \
+    ".balign 32\n\t"                                             \
+    "3:\n\t"                                                     \
+    ".long 0x0, 0x0\n\t"                                         \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                \
+    ".popsection\n\t"                                            \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                    \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                 \
+    ".long " RSEQ_SIG_STR "\n\t"                                 \
+    "4:\n\t"                                                     \
+    "jmp 6f\n\t"                                                 \
+    ".popsection\n\t"                                            \
+    "6:\n\t"                                                     \
+    "leaq 3b(%%rip), %%rax\n\t"                                  \
+    "movq %%rax, %c[rseq_cs](%[rseq])\n\t"                       \
+    "1:\n\t"                                                     \
+    "movl %c[cpu_id](%[rseq]), %%eax\n\t"                        \
+    "cmpl %[nr_cpus], %%eax\n\t"                                 \
+    "jae %l[fail]\n\t"                                           \
+    "shlq $6, %%rax\n\t"                                         \
+    "addq %[slots], %%rax\n\t"
+
+#define RSEQ_OPERANDS                                            \
+    [rseq_cs] "i" (offsetof(struct rseq, rseq_cs)),              \
+    [cpu_id]  "i" (offsetof(struct rseq, cpu_id)),               \
+    [i]       "i" (offsetof(chunk_t, i)),                        \
+    [blk]     "i" (offsetof(chunk_t, blk))
+
+/* Take a block from this CPU's chunk, or return NULL if it has none. */
+static inline void *pcpu_pop(pcpu_slot_t *slots, int nr_cpus)
+{
+    void *p;
+
+    __asm__ __volatile__ goto (
+        RSEQ_START
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[fail]\n\t"
+        "movl %c[i](%%rcx), %%edx\n\t"
+        "testl %%edx, %%edx\n\t"
+        "jz %l[fail]\n\t"
+        "subl $1, %%edx\n\t"
+        "movq %c[blk](%%rcx,%%rdx,8), %%rsi\n\t"
+        "movq %%rsi, (%[p])\n\t"
+        "movl %%edx, %c[i](%%rcx)\n\t"
+        "2:\n\t"
+        : /* no outputs */
+        : [rseq] "r" (rseq_area()), [slots] "r" (slots),
+          [nr_cpus] "r" (nr_cpus), [p] "r" (&p), RSEQ_OPERANDS
+        : "rax", "rcx", "rdx", "rsi", "memory", "cc"
+        : fail);
+    return(p);
+ fail:
+    return(NULL);
+}
+
+/* Put @p in this CPU's chunk. Fails if it has no room. */
+static inline int pcpu_push(pcpu_slot_t *slots, int nr_cpus, void *p)
+{
+    __asm__ __volatile__ goto (
+        RSEQ_START
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[fail]\n\t"
+        "movl %c[i](%%rcx), %%edx\n\t"
+        "cmpl %[max], %%edx\n\t"
+        "jae %l[fail]\n\t"
+        "movq %[blkp], %c[blk](%%rcx,%%rdx,8)\n\t"
+        "addl $1, %%edx\n\t"
+        "movl %%edx, %c[i](%%rcx)\n\t"
+        "2:\n\t"
+        : /* no outputs */
+        : [rseq] "r" (rseq_area()), [slots] "r" (slots),
+          [nr_cpus] "r" (nr_cpus), [blkp] "r" (p),
+          [max] "i" (BLKS_PER_CHUNK), RSEQ_OPERANDS
+        : "rax", "rcx", "rdx", "memory", "cc"
+        : fail);
+    return(1);
+ fail:
+    return(0);
+}
+
+/*
+ * Make @ch this CPU's chunk, provided the current one is absent or empty;
+ * that one is returned in *@old. Fails if another thread on this CPU has
+ * refilled the slot first.
+ */
+static inline int pcpu_install(pcpu_slot_t *slots, int nr_cpus,
+                               chunk_t *ch, chunk_t **old)
+{
+    __asm__ __volatile__ goto (
+        RSEQ_START
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz 5f\n\t"
+        "cmpl $0, %c[i](%%rcx)\n\t"
+        "jne %l[fail]\n\t"
+        "5:\n\t"
+        "movq %%rcx, (%[old])\n\t"
+        "movq %[ch], (%%rax)\n\t"
+        "2:\n\t"
+        : /* no outputs */
+        : [rseq] "r" (rseq_area()), [slots] "r" (slots),
+          [nr_cpus] "r" (nr_cpus), [ch] "r" (ch), [old] "r" (old),
+          RSEQ_OPERANDS
+        : "rax", "rcx", "memory", "cc"
+        : fail);
+    return(1);
+ fail:
+    return(0);
+}
+
+/*
+ * Allocate from this CPU's chunk of allocator @alloc_id, refilling it from
+ * the main list when empty. Returns NULL if the thread cannot use rseq,
+ * or (with @may_fail set) if no full chunk is to be had.
+ */
+static void *pcpu_alloc(gc_t *gc, int alloc_id, int may_fail)
+{
+    gc_global_t *gc_global = gc->global;
+    gc_size_t *gs = GC_SIZE(gc_global, alloc_id);
+    chunk_t *ch, *old;
+    void *p;
+    int tries;
+
+    for ( tries = 0; tries < 2; tries++ )
+    {
+        if ( (p = pcpu_pop(gs->pcpu, gc_global->nr_cpus)) != NULL )
+            return(p);
+        if ( !rseq_available() ) return(NULL);
+
+        if ( (ch = get_alloc_chunk(gc, alloc_id, may_fail)) == NULL )
+            return(NULL);
+        if ( pcpu_install(gs->pcpu, gc_global->nr_cpus, ch, &old) )
+        {
+            if ( old != NULL ) add_chunks_to_list(old, gc_global->free_chunks);
+        }
+        else
+        {
+            /* Another thread on this CPU got there first. */
+            ADD_TO(gs->nr_alloc_chunks, 1);
+            add_chunks_to_list(ch, gs->alloc);
+        }
+    }
+
+    /* Migrated onto a CPU whose chunk was just drained: give up. */
+    return(NULL);
+}
+
+/* Free @p into this CPU's chunk of allocator @alloc_id, if it has room. */
+static inline int pcpu_free(gc_global_t *gc_global, int alloc_id, void *p)
+{
+    return pcpu_push(GC_SIZE(gc_global, alloc_id)->pcpu,
+                     gc_global->nr_cpus, p);
+}
+#endif /* GC_RSEQ */
+
+/*
+ * Replace the exhausted allocation chunk @alloc_id with a full one. With
+ * @may_fail set, returns NULL if that would take the heap over its soft
+ * limit, even after an attempt to reclaim.
+ */
+static chunk_t *refill_alloc_chunk(gc_t *gc, gc_tsize_t *ts, int alloc_id,
+                                   int may_fail)
+{
+    chunk_t *och = ts->alloc, *ch;
+    gc_global_t *gc_global = gc->global;
+
+    if ( (ch = get_alloc_chunk(gc, alloc_id, may_fail)) == NULL )
+    {
+#ifndef MINIMAL_GC
+        if ( gc->ibr )
+            ibr_scan(gc);
+        else if ( !gc_global->bg_reclaim )
+            gc_reclaim(gc_global);
+#endif
+        if ( (ch = get_alloc_chunk(gc, alloc_id, may_fail)) == NULL )
+            return(NULL);
+    }
+
+    if ( ts->alloc_chunks++ == 100 )
+    {
+        ts->alloc_chunks = 0;
+        add_chunks_to_list(och, gc_global->free_chunks);
+    }
+    else
+    {
+        ch->next  = och->next;
+        och->next = ch;
+    }
+    ts->alloc = ch;
+
+    return(ch);
+}
+
+
+void *gc_alloc(ptst_t *ptst, int alloc_id)
+{
+    gc_t *gc = ptst->gc;
+    gc_tsize_t *ts = gc_tsize(gc, alloc_id);
+    chunk_t *ch;
+    void *p;
+
+#ifdef GC_RSEQ
+    if ( !gc->global->percpu || ((p = pcpu_alloc(gc, alloc_id, 0)) == NULL) )
+#endif
+    {
+        ch = ts->alloc;
+        if ( ch->i == 0 ) ch = refill_alloc_chunk(gc, ts, alloc_id, 0);
+        p = ch->blk[--ch->i];
+    }
+    ts->nr_alloc++;
+
+#ifndef MINIMAL_GC
+    if ( gc->ibr ) ibr_on_alloc(gc, p);
+#endif
+
+    return p;
+}
+
+
+void *gc_try_alloc(ptst_t *ptst, int alloc_id)
+{
+    gc_t *gc = ptst->gc;
+    gc_tsize_t *ts = gc_tsize(gc, alloc_id);
+    chunk_t *ch;
+    void *p;
+
+#ifdef GC_RSEQ
+    if ( !gc->global->percpu || ((p = pcpu_alloc(gc, alloc_id, 1)) == NULL) )
+#endif
+    {
+        ch = ts->alloc;
+        if ( (ch->i == 0) &&
+             ((ch = refill_alloc_chunk(gc, ts, alloc_id, 1)) == NULL) )
+            return(NULL);
+        p = ch->blk[--ch->i];
+    }
+    ts->nr_alloc++;
+
+#ifndef MINIMAL_GC
+    if ( gc->ibr ) ibr_on_alloc(gc, p);
+#endif
+
+    return p;
+}
+
+/*
+ * Allocate @n blocks into @out. Whole chunks are taken directly from the
+ * main allocation list while at least a chunk's worth is wanted.
+ */
+void gc_alloc_n(ptst_t *ptst, int alloc_id, void **out, int n)
+{
+    gc_t *gc = ptst->gc;
+    gc_tsize_t *ts = gc_tsize(gc, alloc_id);
+    chunk_t *ch;
+    int k;
+
+#ifndef MINIMAL_GC
+    /* Every block needs its birth era stamped. */
+    if ( gc->ibr )
+    {
+        while ( n-- > 0 ) *out++ = gc_alloc(ptst, alloc_id);
+        return;
+    }
+#endif
+
+    ts->nr_alloc += n;
+
+    while ( n > 0 )
+    {
+        ch = ts->alloc;
+        if ( ch->i == 0 )
+        {
+            if ( n >= BLKS_PER_CHUNK )
+            {
+                ch = get_alloc_chunk(gc, alloc_id, 0);
+                k  = ch->i;
+                memcpy(out, ch->blk, k * sizeof(void *));
+                out += k;
+                n   -= k;
+                ch->i = 0;
+                add_chunks_to_list(ch, gc->global->free_chunks);
+                continue;
+            }
+            ch = refill_alloc_chunk(gc, ts, alloc_id, 0);
+        }
+
+        k = (n < ch->i) ? n : ch->i;
+        ch->i -= k;
+        memcpy(out, &ch->blk[ch->i], k * sizeof(void *));
+        out += k;
+        n   -= k;
+    }
+}
+
+
+/*
+ * The thread's current chunk of each class serves as its magazine, so the
+ * common case is a table lookup and a pointer pop.
+ */
+void *gc_alloc_size(ptst_t *ptst, int bytes)
+{
+    gc_global_t *gc_global = ptst->gc->global;
+
+    assert((bytes > 0) && (bytes <= GC_SIZE_CLASS_MAX));
+    return gc_alloc(ptst,
+        gc_global->class_id[gc_global->size_class[(bytes + 7) >> 3]]);
+}
+
+
+void gc_free_size(ptst_t *ptst, void *p, int bytes)
+{
+    gc_global_t *gc_global = ptst->gc->global;
+
+    assert((bytes > 0) && (bytes <= GC_SIZE_CLASS_MAX));
+    gc_free(ptst, p,
+        gc_global->class_id[gc_global->size_class[(bytes + 7) >> 3]]);
+}
+
+
+int
+gc_get_blocksize(gc_global_t *gc_global, int alloc_id)
+{
+    return (GC_SIZE(gc_global, alloc_id)->blk_size);
+}
+
+const char *
+gc_get_tag(gc_global_t *gc_global, int alloc_id)
+{
+    return (GC_SIZE(gc_global, alloc_id)->tag);
+}
+
+static chunk_t *chunk_from_cache(gc_t *gc)
+{
+    chunk_t *ch = gc->chunk_cache, *p = ch->next;
+    gc_global_t *gc_global = gc->global;
+
+    if ( ch == p )
+    {
+        gc->chunk_cache = get_empty_chunks(gc_global, 100, 0);
+    }
+    else
+    {
+        ch->next = p->next;
+        p->next  = p;
+    }
+
+    p->i = 0;
+    return(p);
+}
+
+
+#ifndef MINIMAL_GC
+/*
+ * INTERVAL-BASED RECLAMATION
+ *
+ * As described in:
+ *  Interval-Based Memory Reclamation
+ *  Haosen Wen, Joseph Izraelevitz, Wentao Cai, H. Alan Beadle and
+ *  Michael L. Scott
+ *  Proceedings of PPoPP 2018
+ *
+ * Each block records the era of its allocation and of its retirement.
+ * Each thread inside a critical region reserves an interval of eras
+ * [ibr_lo, ibr_hi]: ibr_lo is fixed on entry, and ibr_hi is raised by
+ * gc_protect() as the thread follows pointers. A retired block may be
+ * reused once no reservation intersects its lifetime. A stalled thread
+ * therefore pins only blocks that were live during its own interval,
+ * rather than all garbage produced after it stalled.
+ */
+
+static void ibr_reserve(gc_t *gc)
+{
+    unsigned long era = gc->global->era;
+    gc->ibr_lo = era;
+    (void)FASPO(&gc->ibr_hi, era);
+    MB();
+}
+
+
+static void ibr_release(gc_t *gc)
+{
+    MB();
+    gc->ibr_lo = IBR_INACTIVE;
+}
+
+
+static void ibr_on_alloc(gc_t *gc, void *p)
+{
+    gc_global_t *gc_global = gc->global;
+
+    if ( ++gc->ibr_allocs >= gc_global->ibr_era_freq )
+    {
+        gc->ibr_allocs = 0;
+        ADD_TO(gc_global->era, 1);
+    }
+    IBR_HDR(p)->birth = gc_global->era;
+}
+
+
+/* Hand a block which no thread can reference back to the allocator. */
+static void ibr_reuse(gc_t *gc, gc_tsize_t *ts, void *p, int alloc_id)
+{
+    gc_global_t *gc_global = gc->global;
+    chunk_t *ch = ts->alloc;
+
+#ifdef WEAK_MEM_ORDER
+    INITIALISE_NODES(p, GC_SIZE(gc_global, alloc_id)->blk_size);
+#endif
+
+#ifdef GC_RSEQ
+    if ( gc_global->percpu && pcpu_free(gc_global, alloc_id, p) ) return;
+#endif
+
+    if ( ch->i < BLKS_PER_CHUNK )
+    {
+        ch->blk[ch->i++] = p;
+        return;
+    }
+
+    /* Local chunk is full: gather blocks into a chunk for the main list. */
+    if ( (ch = ts->ibr_spill) == NULL )
+        ts->ibr_spill = ch = chunk_from_cache(gc);
+    ch->blk[ch->i++] = p;
+    if ( ch->i == BLKS_PER_CHUNK )
+    {
+        ts->ibr_spill = NULL;
+        ADD_TO(GC_SIZE(gc_global, alloc_id)->nr_alloc_chunks, 1);
+        add_chunks_to_list(ch, GC_SIZE(gc_global, alloc_id)->alloc);
+    }
+}
+
+
+/* Can some reservation in @resv[0..@n) see block @p? */
+static int ibr_conflict(unsigned long *resv, int n, void *p)
+{
+    ibr_hdr_t *h = IBR_HDR(p);
+    int i;
+
+    for ( i = 0; i < n; i += 2 )
+    {
+        if ( (h->birth <= resv[i+1]) && (h->retire >= resv[i]) ) return(1);
+    }
+
+    return(0);
+}
+
+
+/*
+ * Compact retired list @alloc_id in place, reusing every block that no
+ * reservation conflicts with. Returns the number of blocks kept.
+ */
+static unsigned int ibr_scan_list(gc_t *gc, gc_tsize_t *ts, int alloc_id,
+                                  int n)
+{
+    chunk_t *head = ts->retired, *rc, *wc, *ch, *t;
+    unsigned int rj, wj = 0, kept = 0;
+    void *p;
+
+    if ( head == NULL ) return(0);
+
+    rc = wc = head;
+    do {
+        for ( rj = 0; rj < rc->i; rj++ )
+        {
+            p = rc->blk[rj];
+            if ( ibr_conflict(gc->ibr_resv, n, p) )
+            {
+                /* The write cursor never overtakes the read cursor. */
+                if ( wj == BLKS_PER_CHUNK ) { wc = wc->next; wj = 0; }
+                wc->blk[wj++] = p;
+                kept++;
+            }
+            else
+            {
+                ibr_reuse(gc, ts, p, alloc_id);
+            }
+        }
+    }
+    while ( (rc = rc->next) != head );
+
+    /* Fix up counts, and return chunks beyond the write cursor. */
+    for ( ch = head; ch != wc; ch = ch->next ) ch->i = BLKS_PER_CHUNK;
+    wc->i = wj;
+    if ( (t = wc->next) != head )
+    {
+        wc->next = head;
+        for ( ch = t; ch->next != head; ch = ch->next ) continue;
+        ch->next = t;
+        add_chunks_to_list(t, gc->global->free_chunks);
+    }
+    if ( kept == 0 )
+    {
+        ts->retired = NULL;
+        add_chunks_to_list(head, gc->global->free_chunks);
+    }
+    else
+    {
+        /* Further retirements fill the last partial chunk first. */
+        ts->retired = wc;
+    }
+
+    return(kept);
+}
+
+
+static void ibr_scan(gc_t *gc)
+{
+    gc_global_t *gc_global = gc->global;
+    gc_tsize_t *ts;
+    gc_size_t *gs;
+    ptst_t *ptst;
+    unsigned long lo, hi;
+    unsigned int kept = 0;
+    int i, n = 0;
+
+    /* Adopt the retired blocks of exited threads. */
+    if ( gc_global->nr_orphan_retired && !gc_global->inreclaim &&
+         (CASIO(&gc_global->inreclaim, 0, gc_pid) == 0) )
+    {
+        for ( i = 0; i < gc_global->nr_sizes; i++ )
+        {
+            gs = GC_SIZE(gc_global, i);
+            if ( gs->orphan_retired == NULL ) continue;
+            ts = gc_tsize(gc, i);
+            ts->retired = splice_chunks(ts->retired, gs->orphan_retired);
+            gs->orphan_retired = NULL;
+        }
+        gc_global->nr_orphan_retired = 0;
+        gc_global->inreclaim = 0;
+    }
+
+    /* Snapshot every active reservation. */
+    MB();
+    for ( ptst = ptst_first(gc_global); ptst != NULL; ptst = ptst_next(ptst) )
+    {
+        if ( (lo = ptst->gc->ibr_lo) == IBR_INACTIVE ) continue;
+        hi = ptst->gc->ibr_hi;
+        if ( n == gc->ibr_resv_size )
+        {
+            gc->ibr_resv_size = n ? (n << 1) : 64;
+            gc->ibr_resv = realloc(gc->ibr_resv,
+                                   gc->ibr_resv_size * sizeof(*gc->ibr_resv));
+            if ( gc->ibr_resv == NULL )
+                MEM_FAIL(gc->ibr_resv_size * sizeof(*gc->ibr_resv));
+        }
+        gc->ibr_resv[n++] = lo;
+        gc->ibr_resv[n++] = hi;
+    }
+
+    for ( i = 0; i < gc_global->nr_sizes; i++ )
+    {
+        if ( (ts = TABLE_ENT(gc->sizes, i)) != NULL )
+            kept += ibr_scan_list(gc, ts, i, n);
+    }
+
+    /* Blocks still pinned should not make every retirement rescan them. */
+    gc->ibr_nr_retired = kept;
+    gc->ibr_next_scan  = kept + gc_global->ibr_scan_freq;
+}
+
+
+static void ibr_retire(gc_t *gc, void *p, int alloc_id)
+{
+    gc_tsize_t *ts = gc_tsize(gc, alloc_id);
+    chunk_t *ch = ts->retired;
+
+    IBR_HDR(p)->retire = gc->global->era;
+    ts->nr_free++;
+
+    if ( ch == NULL )
+    {
+        ts->retired = ch = chunk_from_cache(gc);
+    }
+    else if ( ch->i == BLKS_PER_CHUNK )
+    {
+        chunk_t *new = chunk_from_cache(gc);
+        new->next = ch->next;
+        ch->next  = new;
+        ts->retired = ch = new;
+    }
+
+    ch->blk[ch->i++] = p;
+
+    if ( ++gc->ibr_nr_retired >= gc->ibr_next_scan ) ibr_scan(gc);
+}
+#endif /* MINIMAL_GC */
+
+
+void *gc_protect(ptst_t *ptst, void **pp)
+{
+    void *v = *(void * VOLATILE *)pp;
+#ifndef MINIMAL_GC
+    gc_t *gc = ptst->gc;
+    unsigned long era;
+
+    if ( !gc->ibr ) return(v);
+
+    /* Publish the era before trusting the value read. */
+    while ( (era = gc->global->era) != gc->ibr_hi )
+    {
+        (void)FASPO(&gc->ibr_hi, era);
+        MB();
+        v = *(void * VOLATILE *)pp;
+    }
+#endif
+    return(v);
+}
+
+
+void gc_free(ptst_t *ptst, void *p, int alloc_id)
+{
+#ifndef MINIMAL_GC
+    gc_t *gc = ptst->gc;
+    gc_tsize_t *ts;
+    chunk_t *prev, *new, *ch;
+
+    if ( gc->ibr )
+    {
+        ibr_retire(gc, p, alloc_id);
+        return;
+    }
+
+    ts = gc_tsize(gc, alloc_id);
+    ts->nr_free++;
+    ts->nr_garbage[gc->epoch]++;
+    ch = ts->garbage[gc->epoch];
+    if ( ch == NULL )
+    {
+        ts->garbage[gc->epoch] = ch = chunk_from_cache(gc);
+        ts->garbage_tail[gc->epoch] = ch;
+    }
+    else if ( ch->i == BLKS_PER_CHUNK )
+    {
+        prev = ts->garbage_tail[gc->epoch];
+        new  = chunk_from_cache(gc);
+        ts->garbage[gc->epoch] = new;
+        new->next  = ch;
+        prev->next = new;
+        ch = new;
+    }
+
+    ch->blk[ch->i++] = p;
+#endif
+}
+
+
+/*
+ * Free @n blocks from @p. Whole chunks' worth are copied into fresh chunks
+ * placed at the tail of the garbage list, leaving the partial head alone.
+ */
+void gc_free_n(ptst_t *ptst, void **p, int n, int alloc_id)
+{
+#ifndef MINIMAL_GC
+    gc_t *gc = ptst->gc;
+    gc_tsize_t *ts;
+    chunk_t *ch, *new;
+    int k, e;
+
+    if ( gc->ibr )
+    {
+        while ( n-- > 0 ) ibr_retire(gc, *p++, alloc_id);
+        return;
+    }
+
+    ts = gc_tsize(gc, alloc_id);
+    e  = gc->epoch;
+    while ( n >= BLKS_PER_CHUNK )
+    {
+        new = chunk_from_cache(gc);
+        memcpy(new->blk, p, BLKS_PER_CHUNK * sizeof(void *));
+        new->i = BLKS_PER_CHUNK;
+        p += BLKS_PER_CHUNK;
+        n -= BLKS_PER_CHUNK;
+        ts->nr_free       += BLKS_PER_CHUNK;
+        ts->nr_garbage[e] += BLKS_PER_CHUNK;
+
+        if ( (ch = ts->garbage[e]) == NULL )
+        {
+            ts->garbage[e] = ts->garbage_tail[e] = new;
+        }
+        else
+        {
+            new->next = ch;
+            ts->garbage_tail[e]->next = new;
+            ts->garbage_tail[e] = new;
+        }
+    }
+
+    while ( n > 0 )
+    {
+        ch = ts->garbage[e];
+        if ( (ch == NULL) || (ch->i == BLKS_PER_CHUNK) )
+        {
+            gc_free(ptst, *p++, alloc_id);
+            n--;
+            continue;
+        }
+        k = BLKS_PER_CHUNK - ch->i;
+        if ( k > n ) k = n;
+        memcpy(&ch->blk[ch->i], p, k * sizeof(void *));
+        ch->i += k;
+        ts->nr_free       += k;
+        ts->nr_garbage[e] += k;
+        p += k;
+        n -= k;
+    }
+#endif
+}
+
+
+void gc_add_ptr_to_hook_list(ptst_t *ptst, void *ptr, int hook_id)
+{
+    gc_t *gc = ptst->gc;
+    gc_thook_t *th = gc_thook(gc, hook_id);
+    chunk_t *och, *ch = th->list[gc->epoch];
+
+    if ( ch == NULL )
+    {
+        th->list[gc->epoch] = ch = chunk_from_cache(gc);
+    }
+    else
+    {
+        ch = ch->next;
+        if ( ch->i == BLKS_PER_CHUNK )
+        {
+            och       = th->list[gc->epoch];
+            ch        = chunk_from_cache(gc);
+            ch->next  = och->next;
+            och->next = ch;
+        }
+    }
+
+    ch->blk[ch->i++] = ptr;
+}
+
+
+void gc_defer(ptst_t *ptst, hook_fn_t fn, void *arg)
+{
+    gc_t *gc = ptst->gc;
+    chunk_t *och, *ch = gc->defer[gc->epoch];
+
+    if ( ch == NULL )
+    {
+        gc->defer[gc->epoch] = ch = chunk_from_cache(gc);
+    }
+    else
+    {
+        ch = ch->next;
+        if ( ch->i == BLKS_PER_CHUNK )
+        {
+            och       = gc->defer[gc->epoch];
+            ch        = chunk_from_cache(gc);
+            ch->next  = och->next;
+            och->next = ch;
+        }
+    }
+
+    /* BLKS_PER_CHUNK is even, so a pair never straddles two chunks. */
+    ch->blk[ch->i++] = (void *)fn;
+    ch->blk[ch->i++] = arg;
+}
+
+
+void gc_unsafe_free(ptst_t *ptst, void *p, int alloc_id)
+{
+    gc_tsize_t *ts = gc_tsize(ptst->gc, alloc_id);
+    chunk_t *ch;
+
+#ifdef GC_RSEQ
+    if ( ptst->gc->global->percpu && pcpu_free(ptst->gc->global, alloc_id, p) )
+    {
+        ts->nr_free++;
+        return;
+    }
+#endif
+
+    ch = ts->alloc;
+    if ( ch->i < BLKS_PER_CHUNK )
+    {
+        ch->blk[ch->i++] = p;
+        ts->nr_free++;
+    }
+    else
+    {
+        gc_free(ptst, p, alloc_id);
+    }
+}
+
+
+void gc_enter(ptst_t *ptst)
+{
+    /* QSBR threads are always inside a critical region. */
+    if ( ptst->qsbr ) return;
+
+#ifdef MINIMAL_GC
+    ptst->count++;
+    MB();
+#else
+    gc_t *gc = ptst->gc;
+    gc_global_t *gc_global = gc->global;
+    int new_epoch, cnt;
+
+ retry:
+    cnt = ptst->count++;
+    MB();
+    if ( cnt == 1 )
+    {
+        if ( gc->ibr ) ibr_reserve(gc);
+        new_epoch = gc_global->current;
+        if ( gc->epoch != new_epoch )
+        {
+            gc->epoch = new_epoch;
+            gc->entries_since_reclaim        = 0;
+#ifdef YIELD_TO_HELP_PROGRESS
+            gc->reclaim_attempts_since_yield = 0;
+#endif
+        }
+        else if ( !gc_global->bg_reclaim &&
+                  (++gc->entries_since_reclaim >=
+                   (HEAP_PRESSURE(gc_global) ?
+                    ENTRIES_PER_PRESSURED_RECLAIM_ATTEMPT :
+                    ENTRIES_PER_RECLAIM_ATTEMPT)) )
+        {
+            /*
+             * Pressure only shortens the wait between attempts: the heap
+             * never shrinks, so it cannot say when to stop trying.
+             */
+            ptst->count--;
+#ifdef YIELD_TO_HELP_PROGRESS
+            if ( gc->reclaim_attempts_since_yield++ == 10000 )
+            {
+                gc->reclaim_attempts_since_yield = 0;
+                sched_yield();
+            }
+#endif
+            gc->entries_since_reclaim = 0;
+            gc_reclaim(gc_global);
+            goto retry;
+        }
+    }
+#endif
+}
+
+
+void gc_synchronize(gc_global_t *gc_global)
+{
+#ifndef MINIMAL_GC
+    struct timespec ts = { 0, 100000 };
+    unsigned long start = gc_global->nr_epochs;
+
+    /*
+     * Regions entered before the call may have seen the current epoch, so
+     * the first advance does not shut them out; the second waits for them.
+     */
+    for ( ; ; )
+    {
+        RMB();
+        if ( gc_global->nr_epochs - start >= 2 ) break;
+        if ( gc_global->bg_reclaim )
+        {
+            nanosleep(&ts, NULL);
+        }
+        else
+        {
+            gc_reclaim(gc_global);
+            sched_yield();
+        }
+    }
+#endif
+}
+
+
+void gc_exit(ptst_t *ptst)
+{
+    if ( ptst->qsbr ) return;
+#ifndef MINIMAL_GC
+    if ( ptst->gc->ibr && (ptst->count == 2) ) ibr_release(ptst->gc);
+#endif
+    MB();
+    ptst->count--;
+}
+
+
+/*
+ * Guards are read through by whichever thread holds them, so they cannot
+ * extend their reservation with gc_protect(); its upper bound is left
+ * open instead.
+ */
+void gc_guard_pin(ptst_t *ptst)
+{
+#ifndef MINIMAL_GC
+    if ( ptst->gc->ibr ) (void)FASPO(&ptst->gc->ibr_hi, IBR_INACTIVE - 1);
+    MB();
+#endif
+}
+
+
+/*
+ * QSBR states. An online thread holds one critical-region reference on
+ * its ptst for as long as it is registered; an offline thread drops it.
+ */
+#define QSBR_ONLINE  1
+#define QSBR_OFFLINE 2
+
+ptst_t *gc_qsbr_register(gc_global_t *gc_global)
+{
+    ptst_t *ptst = critical_enter(gc_global);
+    ptst->qsbr = QSBR_ONLINE;
+    return(ptst);
+}
+
+
+void gc_qsbr_unregister(ptst_t *ptst)
+{
+    int online = (ptst->qsbr == QSBR_ONLINE);
+    ptst->qsbr = 0;
+    if ( online ) gc_exit(ptst);
+}
+
+
+/*
+ * gc_quiescent: The calling QSBR thread holds no references to shared
+ * objects. Catch up with the current epoch, which is all that gc_enter()
+ * would have done for a non-nested critical region.
+ */
+void gc_quiescent(ptst_t *ptst)
+{
+#ifndef MINIMAL_GC
+    gc_t *gc = ptst->gc;
+    gc_global_t *gc_global = gc->global;
+    unsigned int new_epoch;
+
+    /* Earlier accesses must complete before we are seen in a new epoch. */
+    MB();
+    if ( gc->ibr ) ibr_reserve(gc);
+    new_epoch = gc_global->current;
+    if ( gc->epoch != new_epoch )
+    {
+        gc->epoch = new_epoch;
+        gc->entries_since_reclaim = 0;
+    }
+    else if ( !gc_global->bg_reclaim &&
+              (gc->entries_since_reclaim++ == ENTRIES_PER_RECLAIM_ATTEMPT) )
+    {
+        gc->entries_since_reclaim = 0;
+        gc_reclaim(gc_global);
+    }
+#endif
+}
+
+
+void gc_offline(ptst_t *ptst)
+{
+    if ( ptst->qsbr != QSBR_ONLINE ) return;
+    ptst->qsbr = QSBR_OFFLINE;
+#ifndef MINIMAL_GC
+    if ( ptst->gc->ibr ) ibr_release(ptst->gc);
+#endif
+    MB();
+    ptst->count--;
+}
+
+
+void gc_online(ptst_t *ptst)
+{
+    if ( ptst->qsbr != QSBR_OFFLINE ) return;
+    ptst->qsbr = 0;
+    gc_enter(ptst);
+    ptst->qsbr = QSBR_ONLINE;
+}
+
+
+gc_t *gc_init(gc_global_t *gc_global)
+{
+    gc_t *gc;
+
+    gc = domain_alloc(gc_global, sizeof(*gc));
+    if ( gc == NULL ) MEM_FAIL(sizeof(*gc));
+    memset(gc, 0, sizeof(*gc));
+
+    gc->global = gc_global;
+    gc->ibr    = (gc_global->mode == GC_MODE_IBR);
+    gc->ibr_lo = gc->ibr_hi = IBR_INACTIVE;
+    gc->ibr_next_scan = gc_global->ibr_scan_freq;
+#ifdef WEAK_MEM_ORDER
+    /* Initialise shootdown state. */
+    gc->async_page = mmap(NULL, gc_global->page_size, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( gc->async_page == (void *)MAP_FAILED ) MEM_FAIL(gc_global->page_size);
+    gc->async_page_state = 1;
+#endif
+
+    gc->chunk_cache = get_empty_chunks(gc_global, 100, 0);
+
+    /* Per-allocator and per-hook state is created as each is used. */
+    gc->sizes = table_alloc(gc_global, INITIAL_SIZES, NULL);
+    gc->hooks = table_alloc(gc_global, INITIAL_HOOKS, NULL);
+
+    return(gc);
+}
+
+
+/*
+ * Called as a thread exits. Pending garbage and hooks move to the domain's
+ * orphan lists under their original epochs, and partly used allocation
+ * chunks go back to the main allocation lists. The structure is left as
+ * if freshly initialised, for adoption by a later thread.
+ */
+void gc_flush(gc_t *gc)
+{
+    gc_global_t *gc_global = gc->global;
+    gc_tsize_t *ts;
+    gc_size_t *gs;
+    chunk_t *ch, *t;
+    int i;
+#ifndef MINIMAL_GC
+    gc_thook_t *th;
+    gc_hook_t *gh;
+    int e;
+#endif
+
+#ifndef MINIMAL_GC
+    /* Reuse what we can now, and pick up blocks orphaned by others. */
+    if ( gc->ibr )
+    {
+        gc->ibr_lo = IBR_INACTIVE;
+        ibr_scan(gc);
     }
-    else
+#endif
+
+    /* Reclaimers walk our lists: keep them out while we empty them. */
+    while ( gc_global->inreclaim || CASIO(&gc_global->inreclaim, 0, gc_pid) )
+        sched_yield();
+
+#ifndef MINIMAL_GC
+    for ( i = 0; i < gc_global->nr_sizes; i++ )
     {
-        ch = ch->next;
-        if ( ch->i == BLKS_PER_CHUNK )
+        if ( (ts = TABLE_ENT(gc->sizes, i)) == NULL ) continue;
+        gs = GC_SIZE(gc_global, i);
+        for ( e = 0; e < NR_EPOCHS; e++ )
         {
-            och       = gc->hook[gc->epoch][hook_id];
-            ch        = chunk_from_cache(gc);
-            ch->next  = och->next;
-            och->next = ch;
+            if ( (ch = ts->garbage[e]) == NULL ) continue;
+            gs->orphan_blks[e]   += ts->nr_garbage[e];
+            gs->orphan_chunks[e] +=
+                1 + (ts->nr_garbage[e] - ch->i) / BLKS_PER_CHUNK;
+            gs->orphan_garbage[e] = splice_chunks(gs->orphan_garbage[e], ch);
+            ts->garbage[e]    = NULL;
+            ts->nr_garbage[e] = 0;
+        }
+        if ( ts->retired != NULL )
+        {
+            gs->orphan_retired = splice_chunks(gs->orphan_retired,
+                                               ts->retired);
+            ts->retired = NULL;
+            gc_global->nr_orphan_retired = 1;
+        }
+        if ( (ch = ts->ibr_spill) != NULL )
+        {
+            ts->ibr_spill = NULL;
+            if ( ch->i != 0 ) ADD_TO(gs->nr_alloc_chunks, 1);
+            add_chunks_to_list(ch, (ch->i != 0) ? gs->alloc
+                                                : gc_global->free_chunks);
         }
     }
 
-    ch->blk[ch->i++] = ptr;
+    for ( i = 0; i < gc_global->nr_hooks; i++ )
+    {
+        if ( (th = TABLE_ENT(gc->hooks, i)) == NULL ) continue;
+        gh = GC_HOOK(gc_global, i);
+        for ( e = 0; e < NR_EPOCHS; e++ )
+        {
+            gh->orphan[e] = splice_chunks(gh->orphan[e], th->list[e]);
+            th->list[e] = NULL;
+        }
+    }
+
+    for ( e = 0; e < NR_EPOCHS; e++ )
+    {
+        gc_global->orphan_defer[e] =
+            splice_chunks(gc_global->orphan_defer[e], gc->defer[e]);
+        gc->defer[e] = NULL;
+    }
+
+    gc->ibr_lo         = IBR_INACTIVE;
+    gc->ibr_nr_retired = 0;
+    gc->ibr_next_scan  = gc_global->ibr_scan_freq;
+    free(gc->ibr_resv);
+    gc->ibr_resv       = NULL;
+    gc->ibr_resv_size  = 0;
+#endif
+
+    /*
+     * The current allocation chunk is the only one which may hold blocks.
+     * Our block counts join those of other exited threads.
+     */
+    for ( i = 0; i < gc_global->nr_sizes; i++ )
+    {
+        if ( (ts = TABLE_ENT(gc->sizes, i)) == NULL ) continue;
+        gs = GC_SIZE(gc_global, i);
+        ch = ts->alloc;
+        if ( (t = unlink_chunk(ch)) != NULL )
+            add_chunks_to_list(t, gc_global->free_chunks);
+        if ( ch->i != 0 )
+        {
+            ADD_TO(gs->nr_alloc_chunks, 1);
+            add_chunks_to_list(ch, gs->alloc);
+            ts->alloc = chunk_from_cache(gc);
+        }
+        ts->alloc_chunks = 0;
+        gs->nr_alloc += ts->nr_alloc;
+        gs->nr_free  += ts->nr_free;
+        ts->nr_alloc = ts->nr_free = 0;
+    }
+
+    /* Keep one cached chunk, so that chunk_from_cache() still works. */
+    if ( (t = unlink_chunk(gc->chunk_cache)) != NULL )
+        add_chunks_to_list(t, gc_global->free_chunks);
+
+    WMB();
+    gc_global->inreclaim = 0;
 }
 
 
-void gc_unsafe_free(ptst_t *ptst, void *p, int alloc_id)
+/* Serialise registry updates. Readers never take this lock. */
+static void reg_lock(gc_global_t *gc_global)
 {
-    gc_t *gc = ptst->gc;
-    chunk_t *ch;
+    while ( CASIO(&gc_global->reg_lock, 0, gc_pid) != 0 )
+        while ( gc_global->reg_lock ) continue;
+}
 
-    ch = gc->alloc[alloc_id];
-    if ( ch->i < BLKS_PER_CHUNK )
+static void reg_unlock(gc_global_t *gc_global)
+{
+    WMB();
+    gc_global->reg_lock = 0;
+}
+
+
+/*
+ * Register an allocator. With @prefill clear, its main list starts out as
+ * a bare sentinel and is filled on first use.
+ */
+static int add_allocator(gc_global_t *gc_global, int alloc_size,
+                         const char *tag, int prefill,
+                         gc_ctor_fn_t ctor, void *ctor_arg)
+{
+    gc_size_t *gs;
+    gc_ctor_t *c;
+    char *t;
+    int i;
+
+    gs = domain_alloc(gc_global, sizeof(*gs));
+    if ( gs == NULL ) MEM_FAIL(sizeof(*gs));
+    memset(gs, 0, sizeof(*gs));
+    if ( (t = domain_alloc(gc_global, strlen(tag) + 1)) == NULL )
+        MEM_FAIL(strlen(tag) + 1);
+    gs->blk_size   = alloc_size;
+    gs->tag        = strcpy(t, tag);
+    gs->alloc_size = ALLOC_CHUNKS_PER_LIST;
+    if ( ctor != NULL )
     {
-        ch->blk[ch->i++] = p;
+        if ( (c = domain_alloc(gc_global, sizeof(*c))) == NULL )
+            MEM_FAIL(sizeof(*c));
+        c->fn    = ctor;
+        c->arg   = ctor_arg;
+        gs->ctor = c;
+    }
+    if ( gc_global->percpu )
+    {
+        gs->pcpu = domain_alloc(gc_global,
+                                gc_global->nr_cpus * sizeof(pcpu_slot_t));
+        if ( gs->pcpu == NULL )
+            MEM_FAIL(gc_global->nr_cpus * sizeof(pcpu_slot_t));
+        memset(gs->pcpu, 0, gc_global->nr_cpus * sizeof(pcpu_slot_t));
+    }
+    if ( prefill )
+    {
+        gs->alloc = get_filled_chunks(gc_global, gs, ALLOC_CHUNKS_PER_LIST, 0);
+        /* The head of the list is a sentinel. */
+        gs->nr_alloc_chunks = ALLOC_CHUNKS_PER_LIST - 1;
     }
     else
     {
-        gc_free(ptst, p, alloc_id);
+        gs->alloc = get_empty_chunks(gc_global, 1, 0);
+        gs->alloc->i = 0;
     }
+
+    /* The entry is visible before the count which makes it valid. */
+    reg_lock(gc_global);
+    i = gc_global->nr_sizes;
+    table_reserve(gc_global, &gc_global->sizes, i)->ent[i] = gs;
+    WMB();
+    gc_global->nr_sizes = i + 1;
+    reg_unlock(gc_global);
+
+    return i;
 }
 
 
-void gc_enter(ptst_t *ptst)
+int
+gc_add_allocator(gc_global_t *gc_global, int alloc_size, const char *tag)
 {
-#ifdef MINIMAL_GC
-    ptst->count++;
-    MB();
-#else
-    gc_t *gc = ptst->gc;
-    gc_global_t *gc_global = gc->global;
-    int new_epoch, cnt;
+    return add_allocator(gc_global, alloc_size, tag, 1, NULL, NULL);
+}
 
- retry:
-    cnt = ptst->count++;
-    MB();
-    if ( cnt == 1 )
+
+int gc_add_allocator_ctor(gc_global_t *gc_global, int alloc_size,
+                          const char *tag, gc_ctor_fn_t ctor, void *arg)
+{
+    return add_allocator(gc_global, alloc_size, tag, 1, ctor, arg);
+}
+
+
+void gc_for_each_block(gc_global_t *gc_global, int alloc_id, gc_ctor_fn_t fn,
+                       void *arg)
+{
+    gc_size_t *gs = GC_SIZE(gc_global, alloc_id);
+    int sz = gs->blk_size + gc_global->hdr_size;
+    gc_slab_t *slab;
+    char *blk;
+    unsigned long i;
+
+    for ( slab = gs->slabs; slab != NULL; slab = slab->next )
     {
-        new_epoch = gc_global->current;
-        if ( gc->epoch != new_epoch )
-        {
-            gc->epoch = new_epoch;
-            gc->entries_since_reclaim        = 0;
-#ifdef YIELD_TO_HELP_PROGRESS
-            gc->reclaim_attempts_since_yield = 0;
-#endif
-        }
-        else if ( gc->entries_since_reclaim++ == 100 )
-        {
-            ptst->count--;
-#ifdef YIELD_TO_HELP_PROGRESS
-            if ( gc->reclaim_attempts_since_yield++ == 10000 )
-            {
-                gc->reclaim_attempts_since_yield = 0;
-                sched_yield();
-            }
-#endif
-            gc->entries_since_reclaim = 0;
-            gc_reclaim(gc_global);
-            goto retry;
-        }
+        blk = (char *)slab + SLAB_HDR_SIZE + gc_global->hdr_size;
+        for ( i = 0; i < slab->nr_blks; i++, blk += sz )
+            fn(blk, arg);
     }
-#endif
 }
 
 
-void gc_exit(ptst_t *ptst)
+/* Block size of size class @k. */
+static int size_class_bytes(int k)
 {
-    MB();
-    ptst->count--;
+    int base;
+
+    if ( k < 7 ) return 16 + 8*k;
+    k -= 7;
+    base = 64 << (k >> 2);
+    return base + (base >> 2) * ((k & 3) + 1);
 }
 
 
-gc_t *gc_init(gc_global_t *gc_global)
+/* Register the size classes used by gc_alloc_size(). */
+static void init_size_classes(gc_global_t *gc_global)
 {
-    gc_t *gc;
-    int   i;
+    char tag[32];
+    int k, j;
 
-    gc = ALIGNED_ALLOC(sizeof(*gc));
-    if ( gc == NULL ) MEM_FAIL(sizeof(*gc));
-    memset(gc, 0, sizeof(*gc));
+    for ( k = 0; k < NR_SIZE_CLASSES; k++ )
+    {
+        sprintf(tag, "size-%d", size_class_bytes(k));
+        gc_global->class_id[k] =
+            add_allocator(gc_global, size_class_bytes(k), tag, 0, NULL, NULL);
+    }
 
-    gc->global = gc_global;
-#ifdef WEAK_MEM_ORDER
-    /* Initialise shootdown state. */
-    gc->async_page = mmap(NULL, gc_global->page_size, PROT_NONE,
-                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if ( gc->async_page == (void *)MAP_FAILED ) MEM_FAIL(gc_global->page_size);
-    gc->async_page_state = 1;
-#endif
+    for ( j = 0, k = 0; j <= (GC_SIZE_CLASS_MAX >> 3); j++ )
+    {
+        while ( size_class_bytes(k) < (j << 3) ) k++;
+        gc_global->size_class[j] = k;
+    }
+}
 
-    gc->chunk_cache = get_empty_chunks(gc_global, 100);
 
-    /* Get ourselves a set of allocation chunks. */
-    for ( i = 0; i < gc_global->nr_sizes; i++ )
+/* Add up allocator @i's counters, held by the domain and by each thread. */
+static void size_stats(gc_global_t *gc_global, int i, int curr,
+                       gc_size_stats_t *ss)
+{
+    gc_size_t *gs = GC_SIZE(gc_global, i);
+    gc_tsize_t *ts;
+    ptst_t *ptst;
+    int e, age;
+
+    memset(ss, 0, sizeof(*ss));
+    ss->tag          = gs->tag;
+    ss->blk_size     = gs->blk_size;
+    ss->allocated    = gs->nr_alloc;
+    ss->freed        = gs->nr_free;
+    ss->alloc_chunks = gs->nr_alloc_chunks;
+    ss->reserved     = gs->reserved;
+    for ( e = 0; e < NR_EPOCHS; e++ )
     {
-        gc->alloc[i] = get_alloc_chunk(gc, i);
+        age = (curr - e + NR_EPOCHS) % NR_EPOCHS;
+        ss->garbage[age] += gs->orphan_blks[e];
     }
-    for ( ; i < MAX_SIZES; i++ )
+
+    for ( ptst = ptst_first(gc_global); ptst != NULL; ptst = ptst_next(ptst) )
     {
-        gc->alloc[i] = chunk_from_cache(gc);
+        if ( (ptst->count == 0) ||
+             ((ts = TABLE_ENT(ptst->gc->sizes, i)) == NULL) )
+            continue;
+        ss->allocated += ts->nr_alloc;
+        ss->freed     += ts->nr_free;
+        for ( e = 0; e < NR_EPOCHS; e++ )
+        {
+            age = (curr - e + NR_EPOCHS) % NR_EPOCHS;
+            ss->garbage[age] += ts->nr_garbage[e];
+        }
     }
-
-    return(gc);
 }
 
 
-int
-gc_add_allocator(gc_global_t *gc_global, int alloc_size, const char *tag)
+void gc_get_stats(gc_global_t *gc_global, gc_stats_t *out)
 {
-    int ni, i;
-
-    RMB();
-    FASPO(&gc_global->n_allocators, gc_global->n_allocators + 1);
-    if (gc_global->n_allocators > MAX_SIZES) {
-	/* critical error */
-#if !defined(KERNEL)
-	printf("MCAS gc max allocators exceeded, aborting\n");
-#endif
-	abort();
+    gc_size_stats_t *ss;
+    ptst_t *ptst;
+    struct timespec now;
+    unsigned long epochs;
+    double secs;
+    int i, curr = gc_global->current;
+
+    memset(out, 0, sizeof(*out));
+    out->heap_size      = gc_global->total_size;
+    out->heap_allocs    = gc_global->allocations;
+    out->reclaim_failed = gc_global->nr_reclaim_failed;
+
+    /* The rate is over the interval since the last sample. */
+    epochs = gc_global->nr_epochs;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - gc_global->stats_time.tv_sec) +
+           (now.tv_nsec - gc_global->stats_time.tv_nsec) / 1e9;
+    out->epochs = epochs;
+    if ( secs > 0 )
+        out->epochs_per_sec = (epochs - gc_global->stats_epochs) / secs;
+    gc_global->stats_epochs = epochs;
+    gc_global->stats_time   = now;
+
+    out->nr_sizes = gc_global->nr_sizes;
+    out->sizes = ss = calloc(out->nr_sizes, sizeof(*ss));
+    if ( (ss == NULL) && (out->nr_sizes != 0) )
+        MEM_FAIL(out->nr_sizes * sizeof(*ss));
+
+    for ( i = 0; i < out->nr_sizes; i++ )
+        size_stats(gc_global, i, curr, &ss[i]);
+
+    for ( ptst = ptst_first(gc_global); ptst != NULL; ptst = ptst_next(ptst) )
+    {
+        if ( ptst->count == 0 ) continue;
+        out->nr_threads++;
+        if ( !out->blocked && (ptst->count > 1) &&
+             (ptst->gc->epoch != curr) )
+        {
+            out->blocked = 1;
+            out->blocker = ptst->thread;
+        }
     }
+}
 
-    i = gc_global->nr_sizes;
-    while ((ni = CASIO(&gc_global->nr_sizes, i, i + 1)) != i)
-	i = ni;
-    gc_global->blk_sizes[i] = alloc_size;
-    gc_global->tags[i] = strdup(tag);
-    gc_global->alloc_size[i] = ALLOC_CHUNKS_PER_LIST;
-    gc_global->alloc[i] = get_filled_chunks(gc_global, ALLOC_CHUNKS_PER_LIST, alloc_size);
-    return i;
+
+void gc_get_size_stats(gc_global_t *gc_global, int alloc_id,
+                       gc_size_stats_t *out)
+{
+    size_stats(gc_global, alloc_id, gc_global->current, out);
 }
 
 
 void gc_remove_allocator(gc_global_t *gc_global, int alloc_id)
 {
-    /* This is a no-op for now. */
+    gc_size_t *gs = GC_SIZE(gc_global, alloc_id);
+
+    /*
+     * The blocks stay with the domain, but no chunk carved later may be
+     * handed to a constructor whose argument is gone. A refill already
+     * under way has read the pair whole, old or new.
+     */
+    gs->ctor = NULL;
 }
 
 
 int gc_add_hook(gc_global_t *gc_global, hook_fn_t fn)
 {
-    int ni, i = gc_global->nr_hooks;
-    while ( (ni = CASIO(&gc_global->nr_hooks, i, i+1)) != i ) i = ni;
-    if (gc_global->nr_hooks > MAX_HOOKS) {
-	/* critical error */
-#if !defined(KERNEL)
-	printf("MCAS gc max hooks exceeded, aborting\n");
-#endif
-	abort();
-    }
-    gc_global->hook_fns[i] = fn;
+    gc_hook_t *gh;
+    int i;
+
+    gh = domain_alloc(gc_global, sizeof(*gh));
+    if ( gh == NULL ) MEM_FAIL(sizeof(*gh));
+    memset(gh, 0, sizeof(*gh));
+    gh->fn = fn;
+
+    reg_lock(gc_global);
+    i = gc_global->nr_hooks;
+    table_reserve(gc_global, &gc_global->hooks, i)->ent[i] = gh;
+    WMB();
+    gc_global->nr_hooks = i + 1;
+    reg_unlock(gc_global);
+
     return i;
 }
 
 
 void gc_remove_hook(gc_global_t *gc_global, int hook_id)
 {
-    gc_global->hook_fns[hook_id] = 0;
+    GC_HOOK(gc_global, hook_id)->fn = NULL;
 }
 
 
@@ -634,34 +2195,197 @@ void _destroy_gc_subsystem(gc_global_t *gc_global)
     // assume: 2's complement math and page_size a multiple of 2
     size_t global_size = (sizeof (*gc_global) + (gc_global->page_size-1))
 	& -gc_global->page_size;
-#ifdef PROFILE_GC
-    printf("Total heap: %u bytes (%.2fMB) in %u allocations\n",
-           gc_global->total_size, (double)gc_global->total_size / 1000000,
-           gc_global->allocations);
+
+    if ( gc_global->shared_size != 0 )
+    {
+        _detach_ptst_subsystem(gc_global);
+        munmap(gc_global, gc_global->shared_size);
+        return;
+    }
+
+#ifndef MINIMAL_GC
+    if ( gc_global->bg_reclaim )
+    {
+        gc_global->reclaimer_stop = 1;
+        pthread_join(gc_global->reclaimer, NULL);
+    }
 #endif
     munmap(gc_global, global_size);
 }
 
 
+void gc_config_init(gc_config_t *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->mode          = GC_MODE_EPOCH;
+    cfg->ibr_era_freq  = IBR_ERA_FREQ;
+    cfg->ibr_scan_freq = IBR_SCAN_FREQ;
+    cfg->reclaim_batch = RECLAIM_BATCH;
+}
+
+
 gc_global_t * _init_gc_subsystem(void)
+{
+    return _init_gc_subsystem_config(NULL);
+}
+
+
+/* Set up a domain in the zeroed memory at @gc_global. */
+static gc_global_t *init_domain(gc_global_t *gc_global,
+                                const gc_config_t *cfg)
+{
+    gc_config_t defaults;
+    int e;
+
+    if ( cfg == NULL )
+    {
+        gc_config_init(&defaults);
+        cfg = &defaults;
+    }
+
+    gc_global->page_size   = (unsigned int)sysconf(_SC_PAGESIZE);
+    gc_global->free_chunks = alloc_more_chunks(gc_global, 0);
+
+    gc_global->mode          = cfg->mode;
+    gc_global->ibr_era_freq  = cfg->ibr_era_freq ? cfg->ibr_era_freq : 1;
+    gc_global->ibr_scan_freq = cfg->ibr_scan_freq ? cfg->ibr_scan_freq : 1;
+    gc_global->hdr_size      =
+        (cfg->mode == GC_MODE_IBR) ? sizeof(ibr_hdr_t) : 0;
+    gc_global->heap_soft_limit = cfg->heap_soft_limit;
+    gc_global->heap_pressure   = cfg->heap_soft_limit -
+        (cfg->heap_soft_limit >> HEAP_PRESSURE_SHIFT);
+    clock_gettime(CLOCK_MONOTONIC, &gc_global->stats_time);
+#ifdef GC_RSEQ
+    gc_global->nr_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    gc_global->percpu  = cfg->percpu && (gc_global->nr_cpus > 0) &&
+        rseq_available();
+#endif
+
+    gc_global->nr_hooks = 0;
+    gc_global->nr_sizes = 0;
+    gc_global->sizes    = table_alloc(gc_global, INITIAL_SIZES, NULL);
+    gc_global->hooks    = table_alloc(gc_global, INITIAL_HOOKS, NULL);
+
+	/* ptst */
+    _init_ptst_subsystem(gc_global);
+
+    init_size_classes(gc_global);
+
+#ifndef MINIMAL_GC
+    /* A reclaimer thread would belong to one process: not for shared domains. */
+    if ( (cfg->reclaim_interval_us != 0) && !IS_SHARED(gc_global) )
+    {
+        gc_global->reclaim_interval_us = cfg->reclaim_interval_us;
+        gc_global->reclaim_batch       = cfg->reclaim_batch;
+        gc_global->bg_reclaim          = 1;
+        WMB();
+        if ( (e = pthread_create(&gc_global->reclaimer, NULL,
+                                 gc_reclaimer, gc_global)) != 0 )
+        {
+#if !defined(KERNEL)
+            printf("MCAS can't start reclaimer error=%d, aborting\n", e);
+#endif
+            abort();
+        }
+    }
+#endif
+
+    return gc_global;
+}
+
+
+gc_global_t * _init_gc_subsystem_config(const gc_config_t *cfg)
 {
     gc_global_t *gc_global;
     unsigned int page_size = (unsigned int)sysconf(_SC_PAGESIZE);
 	// assume: 2's complement math and page_size a multiple of 2
     size_t global_size = (sizeof (*gc_global) + (page_size-1)) & -page_size;
-    int e;
 
     gc_global = mmap(NULL, global_size, PROT_READ | PROT_WRITE,
                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     // memset(gc_global, 0, sizeof(*gc_global));
 
-    gc_global->page_size   = page_size;
-    gc_global->free_chunks = alloc_more_chunks();
+    return init_domain(gc_global, cfg);
+}
 
-    gc_global->nr_hooks = 0;
-    gc_global->nr_sizes = 0;
 
-	/* ptst */
-    _init_ptst_subsystem(gc_global);
-    return gc_global;
+/* Map @size bytes of @fd shared, at exactly @base. */
+static gc_global_t *shared_map(int fd, void *base, unsigned long size)
+{
+    int flags = MAP_SHARED;
+    void *p;
+
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    p = mmap(base, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if ( p == MAP_FAILED ) return(NULL);
+    if ( p != base )
+    {
+        /* Without MAP_FIXED_NOREPLACE, @base was only a hint. */
+        munmap(p, size);
+        return(NULL);
+    }
+
+    return((gc_global_t *)p);
+}
+
+
+gc_global_t *gc_shared_create(int fd, void *base, unsigned long size,
+                              const gc_config_t *cfg)
+{
+    gc_global_t *gc_global;
+    unsigned int page_size = (unsigned int)sysconf(_SC_PAGESIZE);
+    size_t global_size = (sizeof (*gc_global) + (page_size-1)) & -page_size;
+
+    if ( size <= global_size ) return(NULL);
+
+    /* Truncate first, so that the whole domain starts out zeroed. */
+    if ( (ftruncate(fd, 0) != 0) || (ftruncate(fd, (off_t)size) != 0) )
+        return(NULL);
+    if ( (gc_global = shared_map(fd, base, size)) == NULL ) return(NULL);
+
+    gc_global->shared_next = (char *)gc_global + global_size;
+    gc_global->shared_end  = (char *)gc_global + size;
+    init_domain(gc_global, cfg);
+
+    /* Attachers take the size as the sign that the domain is ready. */
+    WMB();
+    gc_global->shared_size = size;
+
+    return(gc_global);
+}
+
+
+gc_global_t *gc_shared_attach(int fd, void *base)
+{
+    gc_global_t *gc_global;
+    struct stat st;
+
+    if ( fstat(fd, &st) != 0 ) return(NULL);
+    if ( (gc_global = shared_map(fd, base, st.st_size)) == NULL ) return(NULL);
+
+    if ( gc_global->shared_size != (unsigned long)st.st_size )
+    {
+        /* Not a shared domain, or not yet set up. */
+        munmap(gc_global, st.st_size);
+        return(NULL);
+    }
+    RMB();
+
+    _attach_ptst_subsystem(gc_global);
+
+    return(gc_global);
+}
+
+
+void *gc_shared_alloc(gc_global_t *gc_global, unsigned long bytes)
+{
+    return domain_alloc(gc_global, bytes);
+}
+
+
+void **gc_shared_root(gc_global_t *gc_global)
+{
+    return((void **)&gc_global->shared_root);
 }
@@ -31,6 +31,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __GC_H__
 #define __GC_H__
 
+#include <pthread.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -53,9 +55,26 @@ ptst_t *critical_enter(gc_global_t *);
 /* Initialise GC section of given per-thread state structure. */
 gc_t *gc_init(gc_global_t *);
 
+/* Hand an exiting thread's chunks and garbage back to the domain. */
+void gc_flush(gc_t *);
+
 int gc_add_allocator(gc_global_t *, int alloc_size, const char *tag);
 void gc_remove_allocator(gc_global_t *, int alloc_id);
 
+/*
+ * As gc_add_allocator(), but @ctor(blk, @arg) is run on each block as it
+ * is carved from the heap, before any thread can allocate it. Blocks are
+ * never returned to the heap, so as long as they are freed in their
+ * constructed state, every block allocated is in it. gc_for_each_block()
+ * calls @fn(blk, @arg) on every block carved for an allocator so far; it
+ * must not race with allocation.
+ */
+typedef void (*gc_ctor_fn_t)(void *blk, void *arg);
+int gc_add_allocator_ctor(gc_global_t *, int alloc_size, const char *tag,
+                          gc_ctor_fn_t ctor, void *arg);
+void gc_for_each_block(gc_global_t *, int alloc_id, gc_ctor_fn_t fn,
+                       void *arg);
+
 /*
  * Memory allocate/free. An unsafe free can be used when an object was
  * not made visible to other processes.
@@ -64,6 +83,39 @@ void *gc_alloc(ptst_t *ptst, int alloc_id);
 void gc_free(ptst_t *ptst, void *p, int alloc_id);
 void gc_unsafe_free(ptst_t *ptst, void *p, int alloc_id);
 
+/*
+ * As gc_alloc(), but returns NULL rather than grow the heap beyond the
+ * domain's soft limit, or abort when memory is exhausted. One reclaim
+ * attempt is made first. The epoch cannot advance far while the caller
+ * stays in its critical region, so on failure leave it before retrying.
+ */
+void *gc_try_alloc(ptst_t *ptst, int alloc_id);
+
+/*
+ * Wait for a grace period: until every critical region entered before the
+ * call has been left, so that nothing freed before it can still be in
+ * use. The caller must not be in a critical region of the domain.
+ */
+void gc_synchronize(gc_global_t *);
+
+/*
+ * Size-class allocation, for structures which would otherwise register an
+ * allocator per exact size. Requests are rounded up to one of a fixed set
+ * of geometrically spaced classes, of at most GC_SIZE_CLASS_MAX bytes.
+ * A block must be freed with the size it was allocated with.
+ */
+#define GC_SIZE_CLASS_MAX 8192
+void *gc_alloc_size(ptst_t *ptst, int bytes);
+void gc_free_size(ptst_t *ptst, void *p, int bytes);
+
+/*
+ * Bulk versions of gc_alloc() and gc_free(), for @n blocks at a time.
+ * Whole chunks move between lists where possible, rather than block by
+ * block.
+ */
+void gc_alloc_n(ptst_t *ptst, int alloc_id, void **out, int n);
+void gc_free_n(ptst_t *ptst, void **p, int n, int alloc_id);
+
 /*
  * Hook registry. Allows users to hook in their own per-epoch delay
  * lists.
@@ -73,17 +125,175 @@ int gc_add_hook(gc_global_t *, hook_fn_t fn);
 void gc_remove_hook(gc_global_t *, int hook_id);
 void gc_add_ptr_to_hook_list(ptst_t *ptst, void *ptr, int hook_id);
 
+/*
+ * Run @fn(ptst, @arg) once every thread currently in a critical region has
+ * left it, as for a registered hook but with no registration. Callbacks
+ * run during reclamation, on the background reclaimer if there is one,
+ * and are passed that thread's ptst. They may free and defer, but must
+ * not block.
+ */
+void gc_defer(ptst_t *ptst, hook_fn_t fn, void *arg);
+
 /* Per-thread entry/exit from critical regions */
 void gc_enter(ptst_t *ptst);
 void gc_exit(ptst_t *ptst);
 
+/*
+ * Quiescent-state-based reclamation. A registered thread is treated as
+ * permanently inside a critical region, so critical_enter/critical_exit
+ * are no-ops for it. Instead it must call gc_quiescent() at points where
+ * it holds no references to shared objects (eg. once per event-loop
+ * iteration). gc_offline/gc_online bracket periods in which the thread
+ * blocks for a long time and so should not hold back reclamation.
+ */
+ptst_t *gc_qsbr_register(gc_global_t *);
+void gc_qsbr_unregister(ptst_t *ptst);
+void gc_quiescent(ptst_t *ptst);
+void gc_offline(ptst_t *ptst);
+void gc_online(ptst_t *ptst);
+
+/*
+ * Guards hold an epoch independently of any thread, for tasks which may
+ * suspend and resume on another thread (eg. coroutines). Blocks reached
+ * while a guard is held stay valid until it is released, wherever the
+ * task runs next, although each access is still made from a critical
+ * region. A guard belongs to one task at a time, and is not a ptst for
+ * any other call. Refreshing it releases what it has pinned so far,
+ * without going back to the domain's pool of guards and threads.
+ */
+typedef struct ptst_st gc_guard_t;
+gc_guard_t *gc_guard_acquire(gc_global_t *);
+void gc_guard_refresh(gc_guard_t *guard);
+void gc_guard_release(gc_guard_t *guard);
+
+/*
+ * Reclamation schemes. GC_MODE_EPOCH is the classic three-epoch scheme:
+ * cheap, but a thread stalled inside a critical region blocks all
+ * reclamation. GC_MODE_IBR uses interval-based reclamation for blocks
+ * from gc_alloc(), which keeps unreclaimed memory bounded however long a
+ * thread stalls. It requires structures to read shared pointers to
+ * GC-managed blocks through gc_protect(). Hook lists remain epoch-based
+ * in both modes.
+ */
+#define GC_MODE_EPOCH 0
+#define GC_MODE_IBR   1
+
+/*
+ * Per-domain configuration. Fill in defaults with gc_config_init() and
+ * override individual fields before creating the domain.
+ */
+typedef struct gc_config_st
+{
+    int mode;                     /* GC_MODE_*                          */
+    unsigned int ibr_era_freq;    /* IBR: allocations per era increment */
+    unsigned int ibr_scan_freq;   /* IBR: retirements per reclaim scan  */
+    /*
+     * If non-zero, epochs are advanced by a background thread which wakes
+     * this often, instead of inline by mutators.
+     */
+    unsigned int reclaim_interval_us;
+    /* Threads processed per background reclaim step (0 = no limit). */
+    unsigned int reclaim_batch;
+    /*
+     * Soft limit on block memory, in bytes (0 = none). Near the limit,
+     * reclamation is attempted on every critical-region entry. Beyond it,
+     * gc_try_alloc() fails; gc_alloc() may still exceed it.
+     */
+    unsigned long heap_soft_limit;
+    /*
+     * If non-zero, gc_alloc() and gc_unsafe_free() go through per-CPU
+     * chunks, using restartable sequences, rather than per-thread ones.
+     * Ignored where the kernel or C library does not provide rseq.
+     */
+    int percpu;
+} gc_config_t;
+
+void gc_config_init(gc_config_t *);
+
+/*
+ * Read a shared pointer to a GC-managed block inside a critical region.
+ * In GC_MODE_IBR this extends the caller's reservation to cover the
+ * block; otherwise it is a plain read.
+ */
+void *gc_protect(ptst_t *ptst, void **pp);
+
 /* Start-of-day initialisation of garbage collector. */
 gc_global_t * _init_gc_subsystem(void);
+gc_global_t * _init_gc_subsystem_config(const gc_config_t *);
 void _destroy_gc_subsystem(gc_global_t *);
 
+/*
+ * Shared domains, for structures used by several processes. The domain,
+ * its chunks and blocks, and its per-thread state all live in @size bytes
+ * of the file or shared memory object @fd, mapped at @base in every
+ * process, so pointers within it are valid in all of them. Processes
+ * forked after gc_shared_create() may use the domain directly; others map
+ * it with gc_shared_attach(). Both return NULL if @base is taken. Function
+ * pointers kept in the domain (hooks, deferred callbacks, comparators)
+ * must also be valid in every process, as they are across fork(). A
+ * shared domain never runs a background reclaimer, and
+ * _destroy_gc_subsystem() only unmaps it from the calling process.
+ *
+ * gc_shared_alloc() returns permanent memory from a domain, for the roots
+ * of structures built in it, and gc_shared_root() is a place to publish
+ * one. gc_shared_recover() gives back the per-thread state of processes
+ * which have died, releasing their critical regions and guards, and
+ * returns the number of threads recovered.
+ */
+gc_global_t *gc_shared_create(int fd, void *base, unsigned long size,
+                              const gc_config_t *);
+gc_global_t *gc_shared_attach(int fd, void *base);
+void *gc_shared_alloc(gc_global_t *, unsigned long bytes);
+void **gc_shared_root(gc_global_t *);
+int gc_shared_recover(gc_global_t *);
+
 const char *gc_get_tag(gc_global_t *, int alloc_id);
 int gc_get_blocksize(gc_global_t *, int alloc_id);
 
+/*
+ * Statistics. Counters are gathered from each thread without stopping it,
+ * so while the domain is busy they are a close snapshot, not an exact
+ * one. Garbage is given by age: garbage[0] was freed in the current epoch,
+ * garbage[1] in the one before, and so on; it is not kept in GC_MODE_IBR.
+ */
+#define GC_STATS_EPOCHS 4
+
+typedef struct gc_size_stats_st
+{
+    const char   *tag;
+    int           blk_size;
+    unsigned long allocated;                 /* blocks handed out          */
+    unsigned long freed;                     /* blocks freed               */
+    unsigned long garbage[GC_STATS_EPOCHS];  /* blocks awaiting reclaim    */
+    unsigned long alloc_chunks;              /* chunks on the main list    */
+    unsigned long reserved;                  /* bytes taken from the heap  */
+} gc_size_stats_t;
+
+typedef struct gc_stats_st
+{
+    unsigned long heap_size;       /* bytes of block memory             */
+    unsigned long heap_allocs;     /* ... and in how many allocations   */
+    unsigned long epochs;          /* epoch advances                    */
+    double        epochs_per_sec;  /* ... since the previous call       */
+    unsigned long reclaim_failed;  /* reclaims which could not advance  */
+    int           nr_threads;      /* threads currently in the domain   */
+    /* A thread in a critical region which has not seen the epoch. */
+    int           blocked;
+    pthread_t     blocker;
+    /* Per-allocator statistics, indexed by id. */
+    int              nr_sizes;
+    gc_size_stats_t *sizes;
+} gc_stats_t;
+
+/*
+ * Fill in @out. Its sizes array is malloc()ed, and is the caller's to free.
+ * Each call also starts the interval over which epochs_per_sec is taken.
+ */
+void gc_get_stats(gc_global_t *, gc_stats_t *out);
+
+/* The statistics of allocator @alloc_id alone, leaving the rate be. */
+void gc_get_size_stats(gc_global_t *, int alloc_id, gc_size_stats_t *out);
+
 #ifdef __cplusplus
 }
 #endif
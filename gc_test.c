@@ -0,0 +1,1332 @@
+/******************************************************************************
+ * gc_test.c
+ *
+ * Stress tests for the garbage collector.
+ *
+ *  gc_test [stall [epoch|ibr]]
+ *  gc_test latency [inline|bg]
+ *  gc_test threads
+ *  gc_test bulk
+ *  gc_test classes
+ *  gc_test defer [inline|bg]
+ *  gc_test limit
+ *  gc_test stats
+ *  gc_test percpu
+ *  gc_test guard
+ *  gc_test shared
+ *  gc_test objcache
+ *
+ * stall: worker threads churn a skip list while one reader is parked
+ * inside a critical region. Heap growth is reported each round. Under
+ * epoch-based reclamation it is expected to grow without bound; under
+ * interval-based reclamation it must level off.
+ *
+ * latency: worker threads churn a skip list and time every operation.
+ * Percentiles are reported with reclamation done inline by mutators, and
+ * by the background reclaimer.
+ *
+ * threads: many short-lived threads each churn a skip list and exit.
+ * Exiting threads must hand their state back, so RSS must stay flat.
+ *
+ * bulk: blocks per second allocated and freed one at a time, and through
+ * gc_alloc_n()/gc_free_n(), for several batch sizes.
+ *
+ * classes: heap used by sets of skip-list nodes of random height, with an
+ * exact-size allocator per level, and with gc_alloc_size().
+ *
+ * defer: worker threads replace and remove malloc()ed values in a skip
+ * list, releasing each old value through gc_defer(), while readers check
+ * every value they find is still intact. Every callback must eventually
+ * run, and none may run while a reader can still see its value.
+ *
+ * limit: a domain with a soft heap limit is filled with gc_try_alloc()
+ * until it fails, which it must do without exceeding the limit. Once the
+ * blocks are freed and their grace period has passed, allocation must
+ * succeed again without growing the heap. With the heap still under
+ * pressure, and another thread holding the epoch back, entering critical
+ * regions must not spin on reclaim attempts.
+ *
+ * stats: gc_get_stats() is sampled while worker threads churn a skip list.
+ * Per-allocator reservations must add up to the heap size, and once a
+ * reader is parked inside a critical region it must be named as the
+ * thread blocking the epoch.
+ *
+ * percpu: many threads each allocate a block of every size and then idle,
+ * with per-thread and with per-CPU allocation chunks. The chunks held by
+ * idle threads are reported, and must be fewer with per-CPU chunks.
+ * Single-threaded alloc/free throughput is reported for both.
+ *
+ * guard: a task takes a guard and looks up every value in a skip list on
+ * one thread, then checks them from another while writers replace them
+ * and release the old values through gc_defer(). No value may be released
+ * while the guard is held. Each refresh lets the epoch advance once more,
+ * after which all of them may be.
+ *
+ * shared: worker processes attach to a shared domain and churn a skip list
+ * built in it, while another process is killed inside a critical region.
+ * The epoch must stop advancing until gc_shared_recover() releases the
+ * dead process's pin, and start again after.
+ *
+ * objcache: objects with an embedded mutex are allocated from an object
+ * cache, freed, and allocated again once their grace period has passed.
+ * Reused objects must still be constructed, without the constructor being
+ * run again; destroying the cache runs the destructor on each object, but
+ * not until a reader parked in a critical region has left it.
+ * Alloc/free throughput is reported with and without a constructor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sched.h>
+
+#include "portable_defns.h"
+#include "random.h"
+#include "gc.h"
+#include "ptst.h"
+#include "set_queue_adt.h"
+#include "osi_mcas_obj_cache.h"
+#include "internal.h"
+
+#define NR_WORKERS    3
+#define NR_KEYS       1024
+#define NR_ROUNDS     10
+#define ROUND_USECS   200000
+#define LAT_OPS       500000
+#define NR_THREADS    10000
+#define THREAD_OPS    256
+#define BULK_BLOCKS   (1 << 24)
+#define BULK_MAX      1024
+#define NR_LEVELS     20
+#define DEFER_OPS     200000
+#define VAL_MAGIC     0x5ca1ab1eUL
+#define HEAP_LIMIT    (8UL << 20)
+#define LIMIT_BLKSZ   256
+#define NR_IDLE       64
+#define IDLE_SIZES    8
+#define SHARED_BASE   ((void *)0x6f0000000000UL)
+#define SHARED_SIZE   (256UL << 20)
+#define NR_OBJS       100000
+#define OBJ_MAGIC     0x0b1ec7UL
+
+/* Skip-list node of @_l levels: level, key, value and forward pointers. */
+#define NODE_BYTES(_l) (3 * sizeof(void *) + (_l) * sizeof(void *))
+
+/* Keys are small integers, offset clear of the reserved pointer values. */
+#define KEY(_i)       ((setkey_t)(uintptr_t)((_i) + 16))
+
+static gc_global_t *gc_global;
+static osi_set_t *set;
+static VOLATILE int stop;
+
+static volatile sig_atomic_t st_in_region, st_parked, st_release;
+static VOLATILE int holder_in_region, holder_release;
+
+
+static int
+key_comp(const void *lhs, const void *rhs)
+{
+    uintptr_t l = (uintptr_t)lhs, r = (uintptr_t)rhs;
+    return ((l > r) - (l < r));
+}
+
+
+static void *
+worker(void *arg)
+{
+    unsigned long r = (unsigned long)(uintptr_t)arg * 7919 + 1;
+    setkey_t k;
+
+    while (!stop) {
+	r = r * 1103515245 + 12345;
+	k = KEY((r >> 20) % NR_KEYS);
+	if (r & 0x10000)
+	    osi_cas_skip_update(gc_global, set, k, k, 1);
+	else
+	    osi_cas_skip_remove(gc_global, set, k);
+    }
+
+    return (NULL);
+}
+
+
+/*
+ * SIGSTOP would stop the whole process, so the staller is instead parked
+ * from within a signal handler, wherever it happens to be.
+ */
+static void
+park(int sig)
+{
+    struct timespec ts = { 0, 1000000 };
+
+    if (!st_in_region) {
+	st_parked = -1;
+	return;
+    }
+    st_parked = 1;
+    while (!st_release)
+	nanosleep(&ts, NULL);
+}
+
+
+static void *
+staller(void *arg)
+{
+    ptst_t *ptst;
+    int i;
+
+    while (!stop) {
+	ptst = critical_enter(gc_global);
+	st_in_region = 1;
+	for (i = 0; i < 64; i++)
+	    (void)osi_cas_skip_lookup_critical(ptst, set, KEY(i));
+	st_in_region = 0;
+	critical_exit(ptst);
+    }
+
+    return (NULL);
+}
+
+
+/* Keep signalling until the staller is caught inside its region. */
+static void
+park_staller(pthread_t st)
+{
+    do {
+	st_parked = 0;
+	pthread_kill(st, SIGUSR1);
+	while (st_parked == 0)
+	    usleep(100);
+    } while (st_parked < 0);
+}
+
+
+static int
+test_stall(int mode)
+{
+    pthread_t workers[NR_WORKERS], st;
+    gc_config_t cfg;
+    unsigned long first = 0, size;
+    int i, rc = 0;
+
+    gc_config_init(&cfg);
+    cfg.mode = mode;
+    gc_global = _init_gc_subsystem_config(&cfg);
+    _init_osi_cas_skip_subsystem(gc_global);
+    set = osi_cas_skip_alloc(&key_comp);
+    stop = 0;
+    st_release = 0;
+
+    signal(SIGUSR1, park);
+    pthread_create(&st, NULL, staller, NULL);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&workers[i], NULL, worker, (void *)(uintptr_t)i);
+
+    park_staller(st);
+
+    printf("stall (%s): reader parked in critical region\n",
+	   (mode == GC_MODE_IBR) ? "ibr" : "epoch");
+    for (i = 1; i <= NR_ROUNDS; i++) {
+	usleep(ROUND_USECS);
+	size = gc_global->total_size;
+	if (i == 1)
+	    first = size;
+	printf("  round %2d: heap %lu bytes\n", i, size);
+    }
+
+    /* With a bounded collector the heap settles after the first round. */
+    if ((mode == GC_MODE_IBR) && (size > 2 * first)) {
+	printf("stall (ibr): FAILED, heap grew from %lu to %lu bytes\n",
+	       first, size);
+	rc = 1;
+    }
+
+    st_release = 1;
+    stop = 1;
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(workers[i], NULL);
+    pthread_join(st, NULL);
+
+    return (rc);
+}
+
+
+static unsigned long *lat_samples[NR_WORKERS];
+
+
+static unsigned long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec);
+}
+
+
+static void *
+lat_worker(void *arg)
+{
+    int id = (int)(uintptr_t)arg;
+    unsigned long r = id * 7919 + 1, t, *samples = lat_samples[id];
+    setkey_t k;
+    int i;
+
+    for (i = 0; i < LAT_OPS; i++) {
+	r = r * 1103515245 + 12345;
+	k = KEY((r >> 20) % NR_KEYS);
+	t = now_ns();
+	if (r & 0x10000)
+	    osi_cas_skip_update(gc_global, set, k, k, 1);
+	else
+	    osi_cas_skip_remove(gc_global, set, k);
+	samples[i] = now_ns() - t;
+    }
+
+    return (NULL);
+}
+
+
+static int
+ul_comp(const void *lhs, const void *rhs)
+{
+    unsigned long l = *(const unsigned long *)lhs;
+    unsigned long r = *(const unsigned long *)rhs;
+    return ((l > r) - (l < r));
+}
+
+
+static int
+test_latency(int bg)
+{
+    pthread_t workers[NR_WORKERS];
+    unsigned long *all;
+    gc_config_t cfg;
+    size_t n = (size_t)NR_WORKERS * LAT_OPS;
+    int i;
+
+    gc_config_init(&cfg);
+    if (bg)
+	cfg.reclaim_interval_us = 1000;
+    gc_global = _init_gc_subsystem_config(&cfg);
+    _init_osi_cas_skip_subsystem(gc_global);
+    set = osi_cas_skip_alloc(&key_comp);
+
+    for (i = 0; i < NR_WORKERS; i++) {
+	lat_samples[i] = malloc(LAT_OPS * sizeof(unsigned long));
+	pthread_create(&workers[i], NULL, lat_worker, (void *)(uintptr_t)i);
+    }
+    all = malloc(n * sizeof(unsigned long));
+    for (i = 0; i < NR_WORKERS; i++) {
+	pthread_join(workers[i], NULL);
+	memcpy(all + (size_t)i * LAT_OPS, lat_samples[i],
+	       LAT_OPS * sizeof(unsigned long));
+	free(lat_samples[i]);
+    }
+
+    qsort(all, n, sizeof(unsigned long), ul_comp);
+    printf("latency (%s): p50 %lu ns, p99 %lu ns, p99.9 %lu ns, max %lu ns, "
+	   "heap %lu bytes\n", bg ? "bg" : "inline", all[n / 2],
+	   all[n * 99 / 100], all[n * 999 / 1000], all[n - 1],
+	   gc_global->total_size);
+    free(all);
+
+    return (0);
+}
+
+
+static void *
+short_worker(void *arg)
+{
+    unsigned long r = (unsigned long)(uintptr_t)arg * 7919 + 1;
+    setkey_t k;
+    int i;
+
+    for (i = 0; i < THREAD_OPS; i++) {
+	r = r * 1103515245 + 12345;
+	k = KEY((r >> 20) % NR_KEYS);
+	if (r & 0x10000)
+	    osi_cas_skip_update(gc_global, set, k, k, 1);
+	else
+	    osi_cas_skip_remove(gc_global, set, k);
+    }
+
+    return (NULL);
+}
+
+
+/* Resident set size, in bytes. */
+static unsigned long
+rss(void)
+{
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f != NULL) {
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+	    resident = 0;
+	fclose(f);
+    }
+    return (resident * sysconf(_SC_PAGESIZE));
+}
+
+
+static int
+test_threads(void)
+{
+    pthread_t workers[NR_WORKERS];
+    unsigned long base = 0, now = 0;
+    int i, j, rc = 0;
+
+    gc_global = _init_gc_subsystem();
+    _init_osi_cas_skip_subsystem(gc_global);
+    set = osi_cas_skip_alloc(&key_comp);
+
+    for (i = 0; i < NR_THREADS; i += NR_WORKERS) {
+	for (j = 0; j < NR_WORKERS; j++)
+	    pthread_create(&workers[j], NULL, short_worker,
+			   (void *)(uintptr_t)(i + j));
+	for (j = 0; j < NR_WORKERS; j++)
+	    pthread_join(workers[j], NULL);
+
+	if (((i + NR_WORKERS) % (NR_THREADS / 10)) < NR_WORKERS) {
+	    now = rss();
+	    if (base == 0)
+		base = now;
+	    printf("  %5d threads: rss %lu bytes, heap %lu bytes\n",
+		   i + NR_WORKERS, now, gc_global->total_size);
+	}
+    }
+
+    /* Allow some slack for stdio and the like. */
+    if (now > base + base / 4) {
+	printf("threads: FAILED, rss grew from %lu to %lu bytes\n", base, now);
+	rc = 1;
+    }
+
+    return (rc);
+}
+
+
+static double
+bulk_rate(int id, int batch, int bulk)
+{
+    void *blks[BULK_MAX];
+    unsigned long t;
+    ptst_t *ptst;
+    int i, j;
+
+    t = now_ns();
+    for (i = 0; i < BULK_BLOCKS; i += batch) {
+	ptst = critical_enter(gc_global);
+	if (bulk) {
+	    gc_alloc_n(ptst, id, blks, batch);
+	    gc_free_n(ptst, blks, batch, id);
+	} else {
+	    for (j = 0; j < batch; j++)
+		blks[j] = gc_alloc(ptst, id);
+	    for (j = 0; j < batch; j++)
+		gc_free(ptst, blks[j], id);
+	}
+	critical_exit(ptst);
+    }
+    t = now_ns() - t;
+
+    return ((double)BULK_BLOCKS * 1000.0 / t);
+}
+
+
+static int
+test_bulk(void)
+{
+    static const int batches[] = { 16, 100, 256, 1024 };
+    int i, id;
+
+    gc_global = _init_gc_subsystem();
+    id = gc_add_allocator(gc_global, 64, "bulk");
+
+    for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+	printf("bulk: batch %4d: single %7.1f Mblocks/s, bulk %7.1f Mblocks/s\n",
+	       batches[i], bulk_rate(id, batches[i], 0),
+	       bulk_rate(id, batches[i], 1));
+    }
+
+    return (0);
+}
+
+
+static unsigned long
+class_heap(int nr_nodes, int exact)
+{
+    int id[NR_LEVELS];
+    unsigned long r = 1, base;
+    ptst_t *ptst;
+    int i, l;
+
+    gc_global = _init_gc_subsystem();
+    base = gc_global->total_size;
+    if (exact) {
+	for (l = 1; l <= NR_LEVELS; l++)
+	    id[l - 1] = gc_add_allocator(gc_global, NODE_BYTES(l), "level");
+    }
+
+    ptst = critical_enter(gc_global);
+    for (i = 0; i < nr_nodes; i++) {
+	r = r * 1103515245 + 12345;
+	for (l = 1; (l < NR_LEVELS) && ((r >> (16 + l)) & 1); l++)
+	    ;
+	if (exact)
+	    (void)gc_alloc(ptst, id[l - 1]);
+	else
+	    (void)gc_alloc_size(ptst, NODE_BYTES(l));
+    }
+    critical_exit(ptst);
+
+    return (gc_global->total_size - base);
+}
+
+
+static int
+test_classes(void)
+{
+    static const int sizes[] = { 1000, 100000, 1000000 };
+    unsigned long exact, classes;
+    int i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	exact = class_heap(sizes[i], 1);
+	classes = class_heap(sizes[i], 0);
+	printf("classes: %7d nodes: per-level %10lu bytes, size classes %10lu "
+	       "bytes (%+.1f%%)\n", sizes[i], exact, classes,
+	       100.0 * ((double)classes - exact) / exact);
+    }
+
+    return (0);
+}
+
+
+/* Values stored by the defer test. */
+typedef struct
+{
+    unsigned long magic;
+} val_t;
+
+static VOLATILE unsigned long nr_deferred, nr_released, nr_torn;
+
+
+static void
+release_val(ptst_t *ptst, void *arg)
+{
+    val_t *v = arg;
+
+    v->magic = 0;
+    free(v);
+    ADD_TO(nr_released, 1);
+}
+
+
+static void *
+defer_writer(void *arg)
+{
+    unsigned long r = (unsigned long)(uintptr_t)arg * 7919 + 1;
+    ptst_t *ptst;
+    val_t *v, *old;
+    setkey_t k;
+    int i;
+
+    for (i = 0; i < DEFER_OPS; i++) {
+	r = r * 1103515245 + 12345;
+	k = KEY((r >> 20) % NR_KEYS);
+	if (r & 0x10000) {
+	    v = malloc(sizeof(*v));
+	    v->magic = VAL_MAGIC;
+	    old = osi_cas_skip_update(gc_global, set, k, v, 1);
+	} else {
+	    old = osi_cas_skip_remove(gc_global, set, k);
+	}
+	if (old != NULL) {
+	    ptst = critical_enter(gc_global);
+	    gc_defer(ptst, release_val, old);
+	    critical_exit(ptst);
+	    ADD_TO(nr_deferred, 1);
+	}
+    }
+
+    return (NULL);
+}
+
+
+static void *
+defer_reader(void *arg)
+{
+    ptst_t *ptst;
+    val_t *v;
+    int i;
+
+    while (!stop) {
+	ptst = critical_enter(gc_global);
+	for (i = 0; i < NR_KEYS; i++) {
+	    v = osi_cas_skip_lookup_critical(ptst, set, KEY(i));
+	    /* Give writers a chance to replace the value we hold. */
+	    if ((i & 63) == 0)
+		sched_yield();
+	    if ((v != NULL) && (v->magic != VAL_MAGIC))
+		ADD_TO(nr_torn, 1);
+	}
+	critical_exit(ptst);
+    }
+
+    return (NULL);
+}
+
+
+static int
+test_defer(int bg)
+{
+    pthread_t writers[NR_WORKERS], reader;
+    gc_config_t cfg;
+    ptst_t *ptst;
+    setkey_t k;
+    val_t *old;
+    int i, rc = 0;
+
+    gc_config_init(&cfg);
+    if (bg)
+	cfg.reclaim_interval_us = 1000;
+    gc_global = _init_gc_subsystem_config(&cfg);
+    _init_osi_cas_skip_subsystem(gc_global);
+    set = osi_cas_skip_alloc(&key_comp);
+    nr_deferred = nr_released = nr_torn = 0;
+    stop = 0;
+
+    pthread_create(&reader, NULL, defer_reader, NULL);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&writers[i], NULL, defer_writer, (void *)(uintptr_t)i);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(writers[i], NULL);
+    stop = 1;
+    pthread_join(reader, NULL);
+
+    /* Empty the set, then let enough epochs pass to run everything. */
+    for (i = 0; i < NR_KEYS; i++) {
+	k = KEY(i);
+	if ((old = osi_cas_skip_remove(gc_global, set, k)) != NULL) {
+	    ptst = critical_enter(gc_global);
+	    gc_defer(ptst, release_val, old);
+	    critical_exit(ptst);
+	    ADD_TO(nr_deferred, 1);
+	}
+    }
+    for (i = 0; (i < 100000) && (nr_released != nr_deferred); i++) {
+	ptst = critical_enter(gc_global);
+	critical_exit(ptst);
+	if (bg)
+	    usleep(100);
+    }
+
+    printf("defer (%s): %lu deferred, %lu run, %lu torn reads\n",
+	   bg ? "bg" : "inline", nr_deferred, nr_released, nr_torn);
+    if ((nr_released != nr_deferred) || (nr_torn != 0)) {
+	printf("defer (%s): FAILED\n", bg ? "bg" : "inline");
+	rc = 1;
+    }
+
+    return (rc);
+}
+
+
+/* Sit in a critical region, so that the epoch cannot advance. */
+static void *
+region_holder(void *arg)
+{
+    ptst_t *ptst = critical_enter(gc_global);
+
+    holder_in_region = 1;
+    while (!holder_release)
+	usleep(100);
+    critical_exit(ptst);
+
+    return (NULL);
+}
+
+
+static int
+test_limit(void)
+{
+    gc_config_t cfg;
+    pthread_t holder;
+    ptst_t *ptst;
+    void **blks;
+    unsigned long full;
+    int i, n, id, rc = 0, max = HEAP_LIMIT / LIMIT_BLKSZ;
+
+    gc_config_init(&cfg);
+    cfg.heap_soft_limit = HEAP_LIMIT;
+    gc_global = _init_gc_subsystem_config(&cfg);
+    id = gc_add_allocator(gc_global, LIMIT_BLKSZ, "limit");
+    blks = malloc(max * sizeof(void *));
+
+    ptst = critical_enter(gc_global);
+    for (n = 0; (n < max) && ((blks[n] = gc_try_alloc(ptst, id)) != NULL); n++)
+	;
+    full = gc_global->total_size;
+    printf("limit: %d blocks allocated, heap %lu bytes, limit %lu bytes\n",
+	   n, full, HEAP_LIMIT);
+    if ((n == max) || (full > HEAP_LIMIT)) {
+	printf("limit: FAILED, soft limit not enforced\n");
+	rc = 1;
+    }
+
+    for (i = 0; i < n; i++)
+	gc_free(ptst, blks[i], id);
+    critical_exit(ptst);
+
+    /* Let the freed blocks pass through the epochs. */
+    for (i = 0; i < 1000; i++) {
+	ptst = critical_enter(gc_global);
+	critical_exit(ptst);
+    }
+
+    ptst = critical_enter(gc_global);
+    for (i = 0; (i < n) && (gc_try_alloc(ptst, id) != NULL); i++)
+	;
+    critical_exit(ptst);
+    printf("limit: %d blocks reallocated, heap %lu bytes\n",
+	   i, gc_global->total_size);
+    if ((i < n / 2) || (gc_global->total_size > HEAP_LIMIT)) {
+	printf("limit: FAILED, freed blocks not reused\n");
+	rc = 1;
+    }
+    free(blks);
+
+    /* The heap never shrinks, so it stays under pressure from here on. */
+    holder_in_region = holder_release = 0;
+    pthread_create(&holder, NULL, region_holder, NULL);
+    while (!holder_in_region)
+	usleep(100);
+    for (i = 0; i < 1000; i++) {
+	ptst = critical_enter(gc_global);
+	critical_exit(ptst);
+    }
+    holder_release = 1;
+    pthread_join(holder, NULL);
+    printf("limit: %d regions entered with the epoch held back\n", i);
+
+    return (rc);
+}
+
+
+static void
+print_stats(const char *when, gc_stats_t *s)
+{
+    int i;
+
+    printf("stats (%s): heap %lu bytes in %lu allocations, %lu epochs "
+	   "(%.0f/s), %lu failed reclaims, %d threads, %s\n", when,
+	   s->heap_size, s->heap_allocs, s->epochs, s->epochs_per_sec,
+	   s->reclaim_failed, s->nr_threads,
+	   s->blocked ? "epoch blocked" : "not blocked");
+    for (i = 0; i < s->nr_sizes; i++) {
+	if (s->sizes[i].reserved == 0)
+	    continue;
+	printf("  %-10s %5d: alloc %9lu free %9lu garbage %5lu/%5lu/%5lu "
+	       "chunks %4lu reserved %8lu\n", s->sizes[i].tag,
+	       s->sizes[i].blk_size, s->sizes[i].allocated, s->sizes[i].freed,
+	       s->sizes[i].garbage[0], s->sizes[i].garbage[1],
+	       s->sizes[i].garbage[2], s->sizes[i].alloc_chunks,
+	       s->sizes[i].reserved);
+    }
+}
+
+
+static int
+test_stats(void)
+{
+    pthread_t workers[NR_WORKERS], st;
+    unsigned long reserved;
+    gc_stats_t s;
+    int i, rc = 0;
+
+    gc_global = _init_gc_subsystem();
+    _init_osi_cas_skip_subsystem(gc_global);
+    set = osi_cas_skip_alloc(&key_comp);
+    stop = 0;
+    st_release = 0;
+
+    signal(SIGUSR1, park);
+    pthread_create(&st, NULL, staller, NULL);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&workers[i], NULL, worker, (void *)(uintptr_t)i);
+
+    usleep(ROUND_USECS);
+    gc_get_stats(gc_global, &s);
+    print_stats("running", &s);
+    for (i = 0, reserved = 0; i < s.nr_sizes; i++)
+	reserved += s.sizes[i].reserved;
+    if (reserved != s.heap_size) {
+	printf("stats: FAILED, %lu bytes reserved but heap is %lu bytes\n",
+	       reserved, s.heap_size);
+	rc = 1;
+    }
+    free(s.sizes);
+
+    park_staller(st);
+    usleep(ROUND_USECS);
+    gc_get_stats(gc_global, &s);
+    print_stats("stalled", &s);
+    if (!s.blocked || !pthread_equal(s.blocker, st)) {
+	printf("stats: FAILED, parked reader not reported\n");
+	rc = 1;
+    }
+    free(s.sizes);
+
+    st_release = 1;
+    stop = 1;
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(workers[i], NULL);
+    pthread_join(st, NULL);
+
+    return (rc);
+}
+
+
+static int idle_id[IDLE_SIZES];
+static pthread_barrier_t idle_bar;
+
+static void *
+idler(void *arg)
+{
+    ptst_t *ptst;
+    void *p;
+    int i;
+
+    ptst = critical_enter(gc_global);
+    for (i = 0; i < IDLE_SIZES; i++) {
+	p = gc_alloc(ptst, idle_id[i]);
+	gc_unsafe_free(ptst, p, idle_id[i]);
+    }
+    critical_exit(ptst);
+
+    /* Stay alive, holding whatever we cached, until measured. */
+    pthread_barrier_wait(&idle_bar);
+    pthread_barrier_wait(&idle_bar);
+    return (NULL);
+}
+
+
+/* Heap taken by idle threads' caches; also time alloc/free pairs. */
+static unsigned long
+percpu_run(int percpu, double *rate)
+{
+    pthread_t t[NR_IDLE];
+    gc_config_t cfg;
+    unsigned long base, heap, ns;
+    ptst_t *ptst;
+    void *p;
+    int i;
+
+    gc_config_init(&cfg);
+    cfg.percpu = percpu;
+    gc_global = _init_gc_subsystem_config(&cfg);
+    for (i = 0; i < IDLE_SIZES; i++)
+	idle_id[i] = gc_add_allocator(gc_global, 64 << (i & 3), "idle");
+    base = gc_global->total_size;
+
+    pthread_barrier_init(&idle_bar, NULL, NR_IDLE + 1);
+    for (i = 0; i < NR_IDLE; i++)
+	pthread_create(&t[i], NULL, idler, NULL);
+    pthread_barrier_wait(&idle_bar);
+    heap = gc_global->total_size - base;
+    pthread_barrier_wait(&idle_bar);
+    for (i = 0; i < NR_IDLE; i++)
+	pthread_join(t[i], NULL);
+    pthread_barrier_destroy(&idle_bar);
+
+    ptst = critical_enter(gc_global);
+    ns = now_ns();
+    for (i = 0; i < BULK_BLOCKS; i++) {
+	p = gc_alloc(ptst, idle_id[0]);
+	gc_unsafe_free(ptst, p, idle_id[0]);
+    }
+    ns = now_ns() - ns;
+    critical_exit(ptst);
+    *rate = (double)BULK_BLOCKS * 1000.0 / ns;
+
+    return (heap);
+}
+
+
+static int
+test_percpu(void)
+{
+    unsigned long thread_heap, cpu_heap;
+    double thread_rate, cpu_rate;
+    int rc = 0;
+
+    thread_heap = percpu_run(0, &thread_rate);
+    cpu_heap = percpu_run(1, &cpu_rate);
+    if (!gc_global->percpu) {
+	printf("percpu: rseq unavailable, per-CPU chunks not tested\n");
+	return (0);
+    }
+
+    printf("percpu: %d idle threads: per-thread %9lu bytes, per-CPU %9lu "
+	   "bytes\n", NR_IDLE, thread_heap, cpu_heap);
+    printf("percpu: alloc/free: per-thread %6.1f Mblocks/s, per-CPU %6.1f "
+	   "Mblocks/s\n", thread_rate, cpu_rate);
+    if (cpu_heap >= thread_heap) {
+	printf("percpu: FAILED, per-CPU chunks held no less memory\n");
+	rc = 1;
+    }
+
+    return (rc);
+}
+
+
+static gc_guard_t *guard;
+static val_t *held[NR_KEYS];
+
+
+/* First half of the task: take a guard and look everything up. */
+static void *
+guard_lookup(void *arg)
+{
+    int i;
+
+    guard = gc_guard_acquire(gc_global);
+    for (i = 0; i < NR_KEYS; i++)
+	held[i] = osi_cas_skip_lookup(gc_global, set, KEY(i));
+
+    return (NULL);
+}
+
+
+/* Second half, resumed on another thread: check what was looked up. */
+static void *
+guard_check(void *arg)
+{
+    int i;
+
+    for (i = 0; i < NR_KEYS; i++) {
+	if ((held[i] != NULL) && (held[i]->magic != VAL_MAGIC))
+	    ADD_TO(nr_torn, 1);
+    }
+
+    return (NULL);
+}
+
+
+/* Drive reclamation until everything deferred has run, or give up. */
+static void
+drain_deferred(void)
+{
+    ptst_t *ptst;
+    int i;
+
+    for (i = 0; (i < 1000) && (nr_released != nr_deferred); i++) {
+	ptst = critical_enter(gc_global);
+	critical_exit(ptst);
+    }
+}
+
+
+static int
+test_guard(void)
+{
+    pthread_t writers[NR_WORKERS], t;
+    unsigned long pinned;
+    val_t *v;
+    int i, rc = 0;
+
+    gc_global = _init_gc_subsystem();
+    _init_osi_cas_skip_subsystem(gc_global);
+    set = osi_cas_skip_alloc(&key_comp);
+    nr_deferred = nr_released = nr_torn = 0;
+
+    for (i = 0; i < NR_KEYS; i++) {
+	v = malloc(sizeof(*v));
+	v->magic = VAL_MAGIC;
+	osi_cas_skip_update(gc_global, set, KEY(i), v, 1);
+    }
+
+    pthread_create(&t, NULL, guard_lookup, NULL);
+    pthread_join(t, NULL);
+
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&writers[i], NULL, defer_writer, (void *)(uintptr_t)i);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(writers[i], NULL);
+    drain_deferred();
+    pinned = nr_deferred - nr_released;
+
+    pthread_create(&t, NULL, guard_check, NULL);
+    pthread_join(t, NULL);
+    printf("guard: %lu deferred, %lu pending while held, %lu torn reads\n",
+	   nr_deferred, pinned, nr_torn);
+    if ((pinned == 0) || (nr_torn != 0)) {
+	printf("guard: FAILED, held values not protected\n");
+	rc = 1;
+    }
+
+    /* A held guard lets the epoch advance once per refresh. */
+    for (i = 0; i < 4; i++) {
+	gc_guard_refresh(guard);
+	drain_deferred();
+    }
+    printf("guard: %lu pending after refreshing\n", nr_deferred - nr_released);
+    if (nr_released != nr_deferred) {
+	printf("guard: FAILED, refreshed guard still holds the epoch\n");
+	rc = 1;
+    }
+    gc_guard_release(guard);
+
+    return (rc);
+}
+
+
+/* Root of the shared test domain. */
+typedef struct
+{
+    osi_set_t *set;
+    VOLATILE int stop;
+} shared_root_t;
+
+
+/* Body of a process using the shared domain; returns its exit status. */
+static int
+shared_child(int fd, int go, int ready, int stall)
+{
+    unsigned long r = (unsigned long)getpid() * 7919 + 1;
+    shared_root_t *root;
+    ptst_t *ptst;
+    setkey_t k, v;
+    char c;
+
+    if ((read(go, &c, 1) != 1) ||
+	((gc_global = gc_shared_attach(fd, SHARED_BASE)) == NULL))
+	return (2);
+    root = *gc_shared_root(gc_global);
+
+    if (stall) {
+	/* Pin the epoch, then wait to be killed. */
+	ptst = critical_enter(gc_global);
+	(void)osi_cas_skip_lookup_critical(ptst, root->set, KEY(0));
+	if (write(ready, &c, 1) != 1)
+	    return (2);
+	for (;;)
+	    pause();
+    }
+
+    while (!root->stop) {
+	r = r * 1103515245 + 12345;
+	k = KEY((r >> 20) % NR_KEYS);
+	if (r & 0x10000)
+	    osi_cas_skip_update(gc_global, root->set, k, k, 1);
+	else
+	    osi_cas_skip_remove(gc_global, root->set, k);
+	v = osi_cas_skip_lookup(gc_global, root->set, k);
+	if ((v != NULL) && (v != k))
+	    return (1);
+    }
+
+    return (0);
+}
+
+
+static int
+test_shared(void)
+{
+    pid_t pids[NR_WORKERS + 1];
+    shared_root_t *root;
+    unsigned long e1, e2, e3;
+    char path[] = "/tmp/gc_test.XXXXXX", c = 0;
+    int go[2], ready[2], fd, i, n, st, rc = 0;
+
+    if (((fd = mkstemp(path)) < 0) || (pipe(go) != 0) || (pipe(ready) != 0)) {
+	printf("shared: FAILED, cannot create domain file\n");
+	return (1);
+    }
+    unlink(path);
+
+    /* The children map the domain themselves, so fork them first. */
+    for (i = 0; i <= NR_WORKERS; i++) {
+	if ((pids[i] = fork()) == 0)
+	    _exit(shared_child(fd, go[0], ready[1], i == NR_WORKERS));
+    }
+
+    if ((gc_global = gc_shared_create(fd, SHARED_BASE, SHARED_SIZE,
+				      NULL)) == NULL) {
+	printf("shared: FAILED, cannot map domain at %p\n", SHARED_BASE);
+	return (1);
+    }
+    root = gc_shared_alloc(gc_global, sizeof(*root));
+    root->set = osi_cas_skip_alloc_in(gc_global, &key_comp);
+    root->stop = 0;
+    *gc_shared_root(gc_global) = root;
+    for (i = 0; i <= NR_WORKERS; i++)
+	(void)write(go[1], &c, 1);
+
+    /* Wait for the staller to pin the epoch. */
+    (void)read(ready[0], &c, 1);
+    usleep(ROUND_USECS);
+    e1 = gc_global->nr_epochs;
+    usleep(ROUND_USECS);
+    e2 = gc_global->nr_epochs;
+
+    kill(pids[NR_WORKERS], SIGKILL);
+    waitpid(pids[NR_WORKERS], NULL, 0);
+    n = gc_shared_recover(gc_global);
+    usleep(ROUND_USECS);
+    e3 = gc_global->nr_epochs;
+
+    printf("shared: %d processes, epochs %lu while pinned, %lu after "
+	   "recovering %d thread(s), heap %lu bytes\n", NR_WORKERS + 1,
+	   e2 - e1, e3 - e2, n, gc_global->total_size);
+    if ((e2 - e1 > 1) || (n != 1) || (e3 == e2)) {
+	printf("shared: FAILED, dead process's pin not handled\n");
+	rc = 1;
+    }
+
+    root->stop = 1;
+    for (i = 0; i < NR_WORKERS; i++) {
+	waitpid(pids[i], &st, 0);
+	if (!WIFEXITED(st) || (WEXITSTATUS(st) != 0)) {
+	    printf("shared: FAILED, worker exited with status %#x\n", st);
+	    rc = 1;
+	}
+    }
+
+    /* Workers exit without leaving: their state is recovered too. */
+    n = gc_shared_recover(gc_global);
+    printf("shared: %d thread(s) recovered after workers exited\n", n);
+    if (n != NR_WORKERS) {
+	printf("shared: FAILED, exited workers not recovered\n");
+	rc = 1;
+    }
+
+    _destroy_gc_subsystem(gc_global);
+    close(fd);
+
+    return (rc);
+}
+
+
+/* Objects for the objcache test. */
+typedef struct
+{
+    unsigned long magic;
+    pthread_mutex_t lock;
+    void *link[4];
+} obj_t;
+
+static VOLATILE unsigned long nr_dtor;
+
+
+static void
+obj_ctor(void *p, void *arg)
+{
+    obj_t *o = p;
+
+    o->magic = OBJ_MAGIC;
+    pthread_mutex_init(&o->lock, NULL);
+    memset(o->link, 0, sizeof(o->link));
+}
+
+
+static void
+obj_dtor(void *p, void *arg)
+{
+    obj_t *o = p;
+
+    pthread_mutex_destroy(&o->lock);
+    o->magic = 0;
+    nr_dtor++;
+}
+
+
+/* Allocate NR_OBJS objects, checking each is constructed. */
+static int
+obj_fill(osi_mcas_obj_cache_t cache, obj_t **objs)
+{
+    int i, bad = 0;
+
+    for (i = 0; i < NR_OBJS; i++) {
+	objs[i] = osi_mcas_obj_cache_alloc(gc_global, cache);
+	if ((objs[i]->magic != OBJ_MAGIC) ||
+	    (pthread_mutex_trylock(&objs[i]->lock) != 0))
+	    bad++;
+	else
+	    pthread_mutex_unlock(&objs[i]->lock);
+    }
+
+    return (bad);
+}
+
+
+static void
+obj_drain(osi_mcas_obj_cache_t cache, obj_t **objs)
+{
+    ptst_t *ptst;
+    int i;
+
+    for (i = 0; i < NR_OBJS; i++)
+	osi_mcas_obj_cache_free(gc_global, cache, objs[i]);
+    for (i = 0; i < 1000; i++) {
+	ptst = critical_enter(gc_global);
+	critical_exit(ptst);
+    }
+}
+
+
+/* Alloc/free pairs per second, constructing each object if @reinit. */
+static double
+obj_rate(osi_mcas_obj_cache_t cache, int reinit)
+{
+    unsigned long t;
+    ptst_t *ptst;
+    obj_t *o;
+    int i;
+
+    t = now_ns();
+    for (i = 0; i < BULK_BLOCKS / 4; i++) {
+	ptst = critical_enter(gc_global);
+	o = osi_mcas_obj_cache_alloc_critical(ptst, cache);
+	if (reinit)
+	    obj_ctor(o, NULL);
+	o->link[0] = o;
+	if (reinit)
+	    pthread_mutex_destroy(&o->lock);
+	osi_mcas_obj_cache_free_critical(ptst, cache, o);
+	critical_exit(ptst);
+    }
+    t = now_ns() - t;
+
+    return ((double)(BULK_BLOCKS / 4) * 1000.0 / t);
+}
+
+
+static void *
+obj_destroyer(void *arg)
+{
+    osi_mcas_obj_cache_destroy((osi_mcas_obj_cache_t)arg);
+    return (NULL);
+}
+
+
+static int
+test_objcache(void)
+{
+    pthread_t holder, destroyer;
+    osi_mcas_obj_cache_t cache, plain;
+    osi_mcas_obj_cache_stats_t st;
+    unsigned long first;
+    obj_t **objs;
+    int bad, rc = 0;
+
+    gc_global = _init_gc_subsystem();
+    osi_mcas_obj_cache_create_ctor(gc_global, &cache, sizeof(obj_t), "obj",
+				   obj_ctor, obj_dtor, NULL);
+    objs = malloc(NR_OBJS * sizeof(*objs));
+    nr_dtor = 0;
+
+    bad = obj_fill(cache, objs);
+    osi_mcas_obj_cache_get_stats(cache, &st);
+    first = st.constructed;
+    obj_drain(cache, objs);
+    bad += obj_fill(cache, objs);
+    osi_mcas_obj_cache_get_stats(cache, &st);
+    printf("objcache: %d objects twice: %lu constructed, then %lu more; "
+	   "%lu allocated, %lu freed, %lu bytes\n", NR_OBJS, first,
+	   st.constructed - first, st.allocated, st.freed, st.reserved);
+    if ((bad != 0) || (st.constructed - first > NR_OBJS / 2)) {
+	printf("objcache: FAILED, %d unconstructed objects\n", bad);
+	rc = 1;
+    }
+
+    obj_drain(cache, objs);
+    osi_mcas_obj_cache_create(gc_global, &plain, sizeof(obj_t), "plain");
+    printf("objcache: alloc/free: reinitialised %6.1f Mobjs/s, "
+	   "constructed once %6.1f Mobjs/s\n", obj_rate(plain, 1),
+	   obj_rate(cache, 0));
+
+    /* Objects freed just now may still be seen from a region. */
+    osi_mcas_obj_cache_get_stats(cache, &st);
+    holder_in_region = holder_release = 0;
+    pthread_create(&holder, NULL, region_holder, NULL);
+    while (!holder_in_region)
+	usleep(100);
+    pthread_create(&destroyer, NULL, obj_destroyer, cache);
+    usleep(50000);
+    if (nr_dtor != 0) {
+	printf("objcache: FAILED, %lu destructed within a grace period\n",
+	       nr_dtor);
+	rc = 1;
+    }
+    holder_release = 1;
+    pthread_join(holder, NULL);
+    pthread_join(destroyer, NULL);
+    printf("objcache: %lu destructed\n", nr_dtor);
+    if (nr_dtor != st.constructed) {
+	printf("objcache: FAILED, %lu constructed but %lu destructed\n",
+	       st.constructed, nr_dtor);
+	rc = 1;
+    }
+    free(objs);
+
+    return (rc);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int rc = 0;
+
+    if ((argc < 2) || !strcmp(argv[1], "stall")) {
+	if ((argc < 3) || !strcmp(argv[2], "epoch"))
+	    rc |= test_stall(GC_MODE_EPOCH);
+	if ((argc < 3) || !strcmp(argv[2], "ibr"))
+	    rc |= test_stall(GC_MODE_IBR);
+    } else if (!strcmp(argv[1], "latency")) {
+	if ((argc < 3) || !strcmp(argv[2], "inline"))
+	    rc |= test_latency(0);
+	if ((argc < 3) || !strcmp(argv[2], "bg"))
+	    rc |= test_latency(1);
+    } else if (!strcmp(argv[1], "threads")) {
+	rc |= test_threads();
+    } else if (!strcmp(argv[1], "bulk")) {
+	rc |= test_bulk();
+    } else if (!strcmp(argv[1], "classes")) {
+	rc |= test_classes();
+    } else if (!strcmp(argv[1], "defer")) {
+	if ((argc < 3) || !strcmp(argv[2], "inline"))
+	    rc |= test_defer(0);
+	if ((argc < 3) || !strcmp(argv[2], "bg"))
+	    rc |= test_defer(1);
+    } else if (!strcmp(argv[1], "limit")) {
+	rc |= test_limit();
+    } else if (!strcmp(argv[1], "stats")) {
+	rc |= test_stats();
+    } else if (!strcmp(argv[1], "percpu")) {
+	rc |= test_percpu();
+    } else if (!strcmp(argv[1], "guard")) {
+	rc |= test_guard();
+    } else if (!strcmp(argv[1], "shared")) {
+	rc |= test_shared();
+    } else if (!strcmp(argv[1], "objcache")) {
+	rc |= test_objcache();
+    } else {
+	fprintf(stderr, "usage: %s [stall [epoch|ibr] | latency [inline|bg] "
+		"| threads | bulk | classes | defer [inline|bg] | limit | stats "
+		"| percpu | guard | shared | objcache]\n", argv[0]);
+	return (2);
+    }
+
+    return (rc);
+}
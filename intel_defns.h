@@ -114,6 +114,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define WMB_NEAR_CAS() WMB()
 #define MB_NEAR_CAS()  WMB()
 
+/* Spin-wait hint, so that a waiting thread yields to its sibling. */
+#define CPU_RELAX() __asm__ __volatile__ ("rep; nop" : : : "memory")
+
 
 /*
  * III. Cycle counter access.
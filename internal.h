@@ -34,17 +34,23 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 /*#define MINIMAL_GC*/
 /*#define YIELD_TO_HELP_PROGRESS*/
-#define PROFILE_GC
 
 /* Recycled nodes are filled with this value if WEAK_MEM_ORDER. */
 #define INVALID_BYTE 0
 #define INITIALISE_NODES(_p,_c) memset((_p), INVALID_BYTE, (_c));
 
-/* Number of unique block sizes we can deal with. Equivalently, the
- * number of unique object caches which can be created. */
-#define MAX_SIZES 60
+/*
+ * Initial capacity of the allocator and hook registries. They grow on
+ * demand, as do the per-thread tables which mirror them.
+ */
+#define INITIAL_SIZES 16
+#define INITIAL_HOOKS 4
 
-#define MAX_HOOKS 4
+/*
+ * Size classes for gc_alloc_size(): every multiple of 8 bytes from 16 to
+ * 64, then four per power of two up to GC_SIZE_CLASS_MAX.
+ */
+#define NR_SIZE_CLASSES 35
 
 /*
  * The initial number of allocation chunks for each per-blocksize list.
@@ -59,6 +65,37 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #define ENTRIES_PER_RECLAIM_ATTEMPT 100
 
+/* And how many, while the heap is under pressure? */
+#define ENTRIES_PER_PRESSURED_RECLAIM_ATTEMPT 10
+
+/*
+ * The heap is under pressure once within 1/2^HEAP_PRESSURE_SHIFT of its
+ * soft limit.
+ */
+#define HEAP_PRESSURE_SHIFT 3
+
+/* Default number of threads processed per background reclaim step. */
+#define RECLAIM_BATCH 32
+
+/*
+ * Interval-based reclamation (GC_MODE_IBR) defaults. The global era is
+ * advanced once per IBR_ERA_FREQ allocations by each thread, and a thread
+ * scans its retired blocks once per IBR_SCAN_FREQ retirements.
+ */
+#define IBR_ERA_FREQ  128
+#define IBR_SCAN_FREQ 512
+
+/* Reservation value of a thread outside any critical region. */
+#define IBR_INACTIVE  (~0UL)
+
+/* IBR header, placed immediately before each block handed out. */
+typedef struct ibr_hdr_st
+{
+    unsigned long birth;       /* era in which the block was allocated */
+    unsigned long retire;      /* era in which the block was freed     */
+} ibr_hdr_t;
+#define IBR_HDR(_p) ((ibr_hdr_t *)(_p) - 1)
+
 /*
  *  0: current epoch -- threads are moving to this;
  * -1: some threads may still throw garbage into this epoch;
@@ -86,6 +123,124 @@ struct chunk_st
     void *blk[BLKS_PER_CHUNK];
 };
 
+/*
+ * Header of a region of blocks carved from the heap for an allocator. The
+ * blocks follow it, from SLAB_HDR_SIZE bytes on.
+ */
+typedef struct gc_slab_st gc_slab_t;
+struct gc_slab_st
+{
+    gc_slab_t *next;
+    unsigned long nr_blks;
+};
+#define SLAB_HDR_SIZE CACHE_LINE_SIZE
+
+/*
+ * A growable table of pointers. A full table is replaced by a larger copy
+ * rather than resized, because readers may still hold it; old tables stay
+ * reachable through @prev.
+ */
+typedef struct gc_table_st gc_table_t;
+struct gc_table_st
+{
+    int size;
+    gc_table_t *prev;
+    void * VOLATILE ent[1];
+};
+#define TABLE_ENT(_t,_i) (((_i) < (_t)->size) ? (_t)->ent[_i] : NULL)
+
+/*
+ * A per-CPU allocation slot: the chunk from which threads running on that
+ * CPU allocate, and into which they free. Slots are a cache line apart.
+ */
+typedef struct pcpu_slot_st
+{
+    chunk_t * VOLATILE ch;
+    char pad[CACHE_LINE_SIZE - sizeof(chunk_t *)];
+} pcpu_slot_t;
+
+/*
+ * An allocator's constructor and its argument, published together through
+ * one pointer, and never changed or freed once published.
+ */
+typedef struct gc_ctor_st
+{
+    gc_ctor_fn_t fn;
+    void *arg;
+} gc_ctor_t;
+
+/* A registered allocator. */
+typedef struct gc_size_st
+{
+    /* Node size (run-time constant), and tag (trace support). */
+    int blk_size;
+    const char *tag;
+
+    /* Main allocation list, and the number of chunks on it. */
+    chunk_t * VOLATILE alloc;
+    VOLATILE unsigned int alloc_size;
+    VOLATILE unsigned long nr_alloc_chunks;
+
+    /* Bytes of blocks (and their headers) obtained from the system. */
+    VOLATILE unsigned long reserved;
+
+    /* Per-CPU slots, one per possible CPU (NULL unless the domain uses them). */
+    pcpu_slot_t *pcpu;
+
+    /* Constructor for newly carved blocks, and every region carved. */
+    gc_ctor_t * VOLATILE ctor;
+    gc_slab_t * VOLATILE slabs;
+
+    /*
+     * Pending garbage of exited threads, by epoch, with its size in blocks
+     * and chunks, and their IBR retired blocks. Also the block counts of
+     * exited threads. Protected by the reclaim barrier.
+     */
+    chunk_t *orphan_garbage[NR_EPOCHS];
+    unsigned long orphan_blks[NR_EPOCHS];
+    unsigned long orphan_chunks[NR_EPOCHS];
+    chunk_t *orphan_retired;
+    unsigned long nr_alloc, nr_free;
+} gc_size_t;
+
+/* A registered epoch hook. */
+typedef struct gc_hook_st
+{
+    hook_fn_t fn;
+    /* Pending lists of exited threads. Protected by the reclaim barrier. */
+    chunk_t *orphan[NR_EPOCHS];
+} gc_hook_t;
+
+/* Per-thread state for one allocator, created on first use. */
+typedef struct gc_tsize_st
+{
+    /* Garbage lists. */
+    chunk_t *garbage[NR_EPOCHS];
+    chunk_t *garbage_tail[NR_EPOCHS];
+
+    /* Local allocation list. */
+    chunk_t *alloc;
+    unsigned int alloc_chunks;
+
+    /* IBR retired blocks, and reclaimed blocks awaiting a full chunk. */
+    chunk_t *retired;
+    chunk_t *ibr_spill;
+
+    /*
+     * Statistics, written only by the owner (and by reclaimers, for lists
+     * the owner cannot be using). Every garbage chunk but the first is
+     * full, so nr_garbage also gives the length of each garbage list.
+     */
+    unsigned long nr_alloc, nr_free;
+    unsigned long nr_garbage[NR_EPOCHS];
+} gc_tsize_t;
+
+/* Per-thread state for one hook, created on first use. */
+typedef struct gc_thook_st
+{
+    chunk_t *list[NR_EPOCHS];
+} gc_thook_t;
+
 struct gc_global_st
 {
     CACHE_PAD(0);
@@ -94,13 +249,25 @@ struct gc_global_st
     VOLATILE unsigned int current;
     CACHE_PAD(1);
 
-    /* Exclusive access to gc_reclaim(). */
+    /* Exclusive access to gc_reclaim(): the holder's pid, or 0. */
     VOLATILE unsigned int inreclaim;
     CACHE_PAD(2);
 
-
-    /* Allocator caches currently defined */
-    long n_allocators;
+    /*
+     * Background reclaimer state. The cursor is the next thread to be
+     * processed in an unfinished pass, or NULL between passes.
+     */
+    int bg_reclaim;
+    VOLATILE int reclaimer_stop;
+    unsigned int reclaim_interval_us;
+    unsigned int reclaim_batch;
+    ptst_t *reclaim_cursor;
+    pthread_t reclaimer;
+    CACHE_PAD(5);
+
+    /* The current era (GC_MODE_IBR only). */
+    VOLATILE unsigned long era;
+    CACHE_PAD(4);
 
     /*
      * RUN-TIME CONSTANTS (to first approximation)
@@ -109,16 +276,32 @@ struct gc_global_st
     /* Memory page size, in bytes. */
     unsigned int page_size;
 
-    /* Node sizes (run-time constants). */
-    int nr_sizes;
-    int blk_sizes[MAX_SIZES];
+    /* Reclamation scheme (GC_MODE_*) and its parameters. */
+    int mode;
+    unsigned int ibr_era_freq;
+    unsigned int ibr_scan_freq;
+
+    /* Bytes reserved before each block for the IBR header. */
+    unsigned int hdr_size;
 
-    /* tags (trace support) */
-    const char *tags[MAX_SIZES];
+    /* Per-CPU allocation caches in use, and the number of possible CPUs. */
+    int percpu;
+    int nr_cpus;
 
-    /* Registered epoch hooks. */
-    int nr_hooks;
-    hook_fn_t hook_fns[MAX_HOOKS];
+    /* Soft heap limit, and the size at which pressure starts (0 = none). */
+    unsigned long heap_soft_limit;
+    unsigned long heap_pressure;
+
+    /*
+     * Registered allocators (gc_size_t) and hooks (gc_hook_t). Entries
+     * below nr_sizes/nr_hooks are valid. Adders serialise on reg_lock,
+     * which holds the holder's pid.
+     */
+    VOLATILE int nr_sizes;
+    gc_table_t * VOLATILE sizes;
+    VOLATILE int nr_hooks;
+    gc_table_t * VOLATILE hooks;
+    VOLATILE unsigned int reg_lock;
     CACHE_PAD(3);
 
     /*
@@ -128,25 +311,63 @@ struct gc_global_st
     /* Chain of free, empty chunks. */
     chunk_t * VOLATILE free_chunks;
 
-    /* Main allocation lists. */
-    chunk_t * VOLATILE alloc[MAX_SIZES];
-    VOLATILE unsigned int alloc_size[MAX_SIZES];
+    /* Deferred callbacks of exited threads. Protected by the reclaim barrier. */
+    chunk_t *orphan_defer[NR_EPOCHS];
+
+    /* Set when some allocator has orphaned IBR retired blocks. */
+    VOLATILE int nr_orphan_retired;
 
     pthread_key_t ptst_key;
     ptst_t *ptst_list;
 
+    /*
+     * Stack of released ptsts, linked through free_next. Pushes are
+     * lock-free; pops serialise on ptst_free_lock, which holds the
+     * holder's pid.
+     */
+    ptst_t * VOLATILE ptst_free;
+    VOLATILE unsigned int ptst_free_lock;
+
+    /* Distinguishes this domain from earlier ones at the same address. */
+    unsigned long domain_id;
+
+    /*
+     * Shared domains: the size of the mapping (0 for a private domain),
+     * the unused remainder of it, and a slot for the root of a structure.
+     * The size is written last, once the domain is set up, for attachers
+     * to check; IS_SHARED() holds from the start.
+     */
+    unsigned long shared_size;
+    char * VOLATILE shared_next;
+    char *shared_end;
+    void * VOLATILE shared_root;
+
 #ifdef NEED_ID
     static unsigned int next_id;
 #endif
-#ifdef PROFILE_GC
-    VOLATILE unsigned int total_size;
-    VOLATILE unsigned int allocations;
-#endif
+    /* Bytes of block memory obtained from the system, and in how many calls. */
+    VOLATILE unsigned long total_size;
+    VOLATILE unsigned long allocations;
 
-    /* skiplist specifics.  need better way to store per-global stuff. */
-    int *gc_id;
+    /*
+     * Epoch advances and failed reclaim attempts. Updated under the
+     * reclaim barrier. The last sample of the former, for rate reporting.
+     */
+    unsigned long nr_epochs;
+    unsigned long nr_reclaim_failed;
+    unsigned long stats_epochs;
+    struct timespec stats_time;
+
+    /*
+     * Allocator for each size class, and the class for each request size
+     * rounded up to a multiple of 8 bytes.
+     */
+    int class_id[NR_SIZE_CLASSES];
+    unsigned char size_class[(GC_SIZE_CLASS_MAX >> 3) + 1];
 };
 
+#define IS_SHARED(_g) ((_g)->shared_end != NULL)
+
 /* internal interator for ptst_list */
 #define _ptst_first(gc_global)	(gc_global->ptst_list)
 
@@ -165,19 +386,44 @@ struct gc_st
     unsigned int reclaim_attempts_since_yield;
 #endif
 
+    /* IBR reservation: the range of eras this thread may be reading. */
+    int ibr;
+    VOLATILE unsigned long ibr_lo;
+    VOLATILE unsigned long ibr_hi;
+
+    /* IBR retirement state. */
+    unsigned int ibr_allocs;
+    unsigned int ibr_nr_retired, ibr_next_scan;
+    unsigned long *ibr_resv;
+    int ibr_resv_size;
+
     /* Used by gc_async_barrier(). */
     void *async_page;
     int   async_page_state;
 
-    /* Garbage lists. */
-    chunk_t *garbage[NR_EPOCHS][MAX_SIZES];
-    chunk_t *garbage_tail[NR_EPOCHS][MAX_SIZES];
     chunk_t *chunk_cache;
 
-    /* Local allocation lists. */
-    chunk_t *alloc[MAX_SIZES];
-    unsigned int alloc_chunks[MAX_SIZES];
+    /* Callbacks from gc_defer(), as (fn, arg) pairs of chunk entries. */
+    chunk_t *defer[NR_EPOCHS];
 
-    /* Hook pointer lists. */
-    chunk_t *hook[NR_EPOCHS][MAX_HOOKS];
+    /*
+     * Per-allocator (gc_tsize_t) and per-hook (gc_thook_t) state, indexed
+     * by id. Reclaimers read these tables, so they are replaced, not
+     * resized, when an id beyond the end is first used.
+     */
+    gc_table_t * VOLATILE sizes;
+    gc_table_t * VOLATILE hooks;
 };
+
+/*
+ * Open the IBR reservation of a guard which has just entered its critical
+ * region, so that it covers every block born from now on.
+ */
+void gc_guard_pin(ptst_t *ptst);
+
+/* This process, kept up to date across fork(). Used to tag lock holders. */
+extern unsigned int gc_pid;
+
+/* Per-process setup of a shared domain mapped by gc_shared_attach(). */
+void _attach_ptst_subsystem(gc_global_t *gc_global);
+void _detach_ptst_subsystem(gc_global_t *gc_global);
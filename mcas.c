@@ -35,39 +35,74 @@ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/resource.h>
 #include <assert.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
-#include <string.h>
-#if 0
-#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-
 #include "portable_defns.h"
-#endif
+#include "gc.h"
+#include "osi_mcas.h"
 
 typedef struct CasDescriptor CasDescriptor_t;
-typedef struct CasEntry CasEntry_t;
-typedef struct per_thread_state_t per_thread_state_t;
+typedef mcas_entry_t CasEntry_t;
+typedef struct mcas_thread_st mcas_thread_t;
+
+/*
+ * Descriptors are allocated from, and retired to, a GC domain shared by
+ * all MCAS domains. A word found marked may name any descriptor, so there
+ * is no telling which domain to enter before following it.
+ */
+struct mcas_domain_st
+{
+    gc_global_t  *gc;
+    mcas_config_t cfg;
+};
+
+static gc_global_t *mcas_gc;
 
-extern int num_threads;
+/* Default contention-policy parameters, in pauses. */
+#define BACKOFF_MIN 16
+#define BACKOFF_MAX 4096
+#define HELP_DELAY  1024
 
-#define ARENA_SIZE 40960
+/* Start times of operations, under MCAS_CM_AGE. */
+static VOLATILE unsigned long mcas_clock;
 
-struct per_thread_state_t
+/*
+ * Each thread has a claim slot, naming the descriptor it is acquiring
+ * words for. An in-progress claim written into a word holds the thread's
+ * id and the slot's sequence number rather than an address, so each is
+ * unique, and a stale one can be told from a current one. The slot is a
+ * seqlock: an odd sequence number means it is being rewritten. Slots are
+ * process-wide, as are the ids which index mcas_threads[]; an exiting
+ * thread's slot goes on a free stack, to be reused with its id.
+ */
+struct mcas_thread_st
 {
-    int              id;
-    CasDescriptor_t *next_descriptor;
-    void            *arena;
-    void            *arena_lim;
+    VOLATILE unsigned long seq;
+    CasDescriptor_t * VOLATILE cd;
+    int                 id;
+    mcas_thread_t      *free_next;
+#ifdef MCAS_STATS
+    mcas_stats_t        stats;
+#endif
 };
 
+#define TID_BITS 8
+#if MAX_THREADS > (1 << TID_BITS)
+#error "MAX_THREADS is too large for the in-progress claim encoding"
+#endif
 
-static pthread_key_t mcas_ptst_key;
-
-typedef struct pad128 { char pad[128]; } pad128_t;
+static mcas_thread_t *mcas_threads[MAX_THREADS];
+static mcas_thread_t * VOLATILE thread_free;
+static VOLATILE int thread_free_lock;
+static VOLATILE int next_thread_id;
+static pthread_key_t thread_key;
+static pthread_once_t mcas_once = PTHREAD_ONCE_INIT;
+static __thread mcas_thread_t *mcas_self;
 
 
 /* CAS descriptors. */
@@ -77,208 +112,268 @@ typedef struct pad128 { char pad[128]; } pad128_t;
 #define STATUS_FAILED       2
 #define STATUS_ABORTED      3
 
-struct CasEntry {
-    void **ptr;
-    void *old;
-    void *new;
-};
-
+/*
+ * A descriptor is retired once its owner, and every thread which has
+ * joined in to help it, has finished with it (@users drops to zero). By
+ * then no word is marked with it, nor can be again, so a thread which
+ * has read a marked word inside a critical region of mcas_gc may follow
+ * it without taking a reference. Only helpers must join, as they may
+ * mark words afresh; readers never do. @age orders operations under
+ * MCAS_CM_AGE, and survives an aborted descriptor's replacement.
+ */
 struct CasDescriptor {
-    int              status;
-    int              length;
-    CasDescriptor_t *pt[MAX_THREADS];
-    int              rc;
-    CasDescriptor_t *fc; /* free chain */
-    CasEntry_t       entries[1];
+    int                    status;
+    int                    length;
+    int                    flags;
+    VOLATILE unsigned long users;
+    mcas_domain_t         *domain;
+    unsigned long          age;
+    CasEntry_t             entries[1];
 };
 
-/* Marked pointers. */
+#define DESCRIPTOR_SIZE(_n) \
+    (sizeof(CasDescriptor_t) + (((_n) - 1) * sizeof(CasEntry_t)))
+
+/* Compare-only entries are checked, but never installed (MCAS_COMPARE_ONLY). */
+#define IS_COMPARE_ONLY(_cd, _ce) \
+    (((_cd)->flags & MCAS_COMPARE_ONLY) && ((_ce)->oldval == (_ce)->newval))
+
+/*
+ * Marked pointers. Both marks have bit 1 set, leaving bit 0 of each word
+ * to the caller (see MCAS_IS_OWNED()). MARK_PTR_TO_CD marks a descriptor
+ * pointer; MARK_IN_PROGRESS marks a claim (see mcas_thread_t).
+ */
 typedef unsigned long ptr_int;
-#ifndef MARK_IN_PROGRESS
-#define MARK_IN_PROGRESS 1
-#endif
-#ifndef MARK_PTR_TO_CD
-#define MARK_PTR_TO_CD   2
-#endif
+#define MARK_IN_PROGRESS 2
+#define MARK_PTR_TO_CD   3
 
 #define get_markedness(p) (((ptr_int) (p)) & 3)
 #define get_unmarked_reference(p) ((void *) (((ptr_int) (p)) & (~3)))
 #define get_marked_reference(p,m) ((void *) (((ptr_int) (p)) | m))
 
-static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd);
-static per_thread_state_t *get_ptst (void);
+#define make_claim(id,seq) \
+    ((void *) (((ptr_int) (seq) << (TID_BITS + 2)) | \
+               ((ptr_int) (id) << 2) | MARK_IN_PROGRESS))
+#define claim_id(p)  ((int) ((((ptr_int) (p)) >> 2) & ((1 << TID_BITS) - 1)))
+#define claim_seq(p) (((ptr_int) (p)) >> (TID_BITS + 2))
 
-pad128_t p0; /* I'm worried these important RO vars might be false shared */
-static int cas_sz;
-static int num_ptrs = 1024;
-static int ptr_mult = 1;
-pad128_t p1;
+static bool_t mcas0 (ptst_t *ptst, CasDescriptor_t *cd);
+static bool_t fixup (ptst_t *ptst, void **ptr, void *value_read);
+static mcas_thread_t *get_thread (void);
 
-static void *ALLOC(int size)
+/* Statistics are kept in the calling thread's slot, which outlives it. */
+#ifdef MCAS_STATS
+#define MCAS_STAT(_f) (get_thread()->stats._f++)
+static void stat_result (int n, bool_t result)
 {
-    void *a = calloc(1, size);
-    if ( a == NULL ) abort();
-    return a;
+    mcas_stats_t *st = &get_thread()->stats;
+    int           b;
+
+    if ( result ) st->successes++; else st->failures++;
+    for ( b = 0; (b < MCAS_STATS_LENGTHS - 1) && ((1 << b) < n); b++ )
+        continue;
+    st->lengths[b]++;
 }
+#define MCAS_STAT_RESULT(_n, _r) stat_result(_n, _r)
+#else
+#define MCAS_STAT(_f)            ((void)0)
+#define MCAS_STAT_RESULT(_n, _r) ((void)0)
+#endif
 
-static void *ALLOC_ALONE (int size)
+static void thread_destructor (void *arg)
 {
-    int ps = sysconf(_SC_PAGESIZE);
-    int req = ps + size + ps;
-    char *res = ALLOC(req);
-    return (void *)(res + ps);
-}
+    mcas_thread_t *t = arg, *top, *new_top;
 
-static int next_thread_id = 0;
-static per_thread_state_t *ptsts = NULL;
+    if ( mcas_self == t ) mcas_self = NULL;
 
-static void new_arena (per_thread_state_t *ptst, int size)
+    new_top = thread_free;
+    do {
+        t->free_next = top = new_top;
+        WMB_NEAR_CAS();
+    }
+    while ( (new_top = CASPO(&thread_free, top, t)) != top );
+}
+
+static void mcas_init_process (void)
 {
-    ptst->arena = ALLOC(size);
-    if ( !ptst->arena ) abort();
-    ptst->arena_lim = (((char *) ptst->arena) + size);
+    if ( pthread_key_create(&thread_key, thread_destructor) != 0 ) abort();
+    mcas_gc = _init_gc_subsystem();
 }
 
-static per_thread_state_t *get_ptst (void)
+/* The calling thread's claim slot, taking one on first use. */
+static mcas_thread_t *get_thread (void)
 {
-    per_thread_state_t *result;
-    int r;
+    mcas_thread_t *t, *new_t;
+    int my_id;
 
-    result = pthread_getspecific(mcas_ptst_key);
+    if ( (t = mcas_self) != NULL ) return t;
 
-    if ( result == NULL )
+    /*
+     * Pop a released slot. With one popper at a time, the top cannot be
+     * popped and pushed back under us (ABA); exiting threads push without
+     * the lock. A fresh id is taken only if the stack is truly empty.
+     */
+    t = NULL;
+    if ( thread_free != NULL )
     {
-        int my_id;
-        int largest = sysconf(_SC_PAGESIZE);
-
-        if ( largest < sizeof (per_thread_state_t) )
-            largest = sizeof (per_thread_state_t);
+        while ( CASIO(&thread_free_lock, 0, 1) != 0 )
+            while ( thread_free_lock ) continue;
+        new_t = thread_free;
+        do {
+            if ( (t = new_t) == NULL ) break;
+        }
+        while ( (new_t = CASPO(&thread_free, t, t->free_next)) != t );
+        WMB();
+        thread_free_lock = 0;
+    }
 
-        ALLOC (largest);
-        result = ALLOC (largest);
-        ALLOC (largest);
+    if ( t == NULL )
+    {
+        t = ALIGNED_ALLOC(sizeof(mcas_thread_t));
+        if ( t == NULL ) abort();
+        memset(t, 0, sizeof(*t));
 
         do { my_id = next_thread_id; }
         while ( CASIO (&next_thread_id, my_id, my_id + 1) != my_id );
+        if ( my_id >= MAX_THREADS )
+        {
+            fprintf(stderr, "MCAS: more than %d threads\n", MAX_THREADS);
+            abort();
+        }
 
-        result->id = my_id;
-        ptsts = result;
+        t->id = my_id;
+        WMB();
+        mcas_threads[my_id] = t;
+    }
 
-        new_arena(result, ARENA_SIZE);
+    pthread_setspecific(thread_key, t);
+    mcas_self = t;
 
-        r = pthread_setspecific(mcas_ptst_key, result);
-        assert(r == 0);
-    }
+    return t;
+}
 
-    return result;
+/*
+ * Point the calling thread's slot at @cd, and return a claim on its
+ * behalf. Claims made under the slot's previous sequence number must all
+ * have been withdrawn, so that none can reappear.
+ */
+static void *new_claim (mcas_thread_t *t, CasDescriptor_t *cd)
+{
+    t->seq++;
+    WMB();
+    t->cd = cd;
+    WMB();
+    t->seq++;
+
+    return make_claim(t->id, t->seq);
 }
 
-static void release_descriptor (CasDescriptor_t *cd)
+/*
+ * The descriptor on whose behalf @claim was made, or NULL if the claim
+ * has been withdrawn, in which case it is no longer in memory. While it
+ * was in place, its maker was working on the descriptor, which so cannot
+ * have been retired before the caller's critical region began.
+ */
+static CasDescriptor_t *claim_descriptor (void *claim)
 {
-    per_thread_state_t *ptst = get_ptst ();
-    cd->fc = ptst->next_descriptor;
-    ptst->next_descriptor = cd;
+    mcas_thread_t   *t = mcas_threads[claim_id(claim)];
+    ptr_int          seq = claim_seq(claim);
+    CasDescriptor_t *cd;
+
+    if ( t->seq != seq ) return NULL;
+    RMB();
+    cd = t->cd;
+    RMB();
+    if ( t->seq != seq ) return NULL;
+
+    return cd;
 }
 
-static int rc_delta_descriptor (CasDescriptor_t *cd,
-				int delta)
+static CasDescriptor_t *new_descriptor (ptst_t *ptst,
+                                        mcas_domain_t *d,
+                                        int length)
 {
-    int rc, new_rc = cd->rc;
+    CasDescriptor_t *cd;
+    int size = DESCRIPTOR_SIZE(length);
 
-    do { rc = new_rc; }
-    while ( (new_rc = CASIO (&(cd->rc), rc, rc + delta)) != rc );
+    if ( size <= GC_SIZE_CLASS_MAX )
+        cd = gc_alloc_size(ptst, size);
+    else if ( (cd = malloc(size)) == NULL )
+        abort();
 
-    return rc;
+    cd->status = STATUS_IN_PROGRESS;
+    cd->length = length;
+    cd->flags  = 0;
+    cd->users  = 1;
+    cd->domain = d;
+    cd->age    = 0;
+    if ( d->cfg.cm_policy == MCAS_CM_AGE )
+        ADD_TO_RETURNING_OLD(mcas_clock, 1UL, cd->age);
+
+    return cd;
 }
 
-static void rc_up_descriptor (CasDescriptor_t *cd)
+/* A gc_defer() hook: @ptst is unused, but fixed by hook_fn_t. */
+static void free_large_descriptor (ptst_t *ptst, void *cd)
 {
-    rc_delta_descriptor(cd, 2);
-    MB();
+    (void)ptst;
+    free(cd);
 }
 
-static void rc_down_descriptor (CasDescriptor_t *cd)
+/* Join in with @cd's users, unless it has already been retired. */
+static bool_t get_descriptor (CasDescriptor_t *cd)
 {
-    int old_rc, new_rc, cur_rc = cd->rc;
+    unsigned long users, new_users = cd->users;
 
     do {
-        old_rc = cur_rc;
-        new_rc = old_rc - 2;
-        if ( new_rc == 0 ) new_rc = 1; else MB();
+        if ( (users = new_users) == 0 ) return FALSE;
     }
-    while ( (cur_rc = CASIO(&(cd->rc), old_rc, new_rc)) != old_rc );
+    while ( (new_users = CASIO(&cd->users, users, users + 1)) != users );
 
-    if ( old_rc == 2 )
-        release_descriptor(cd);
+    return TRUE;
 }
 
-static CasDescriptor_t *new_descriptor (per_thread_state_t *ptst, int length)
+static void put_descriptor (ptst_t *ptst, CasDescriptor_t *cd)
 {
-    CasDescriptor_t *result;
-    int i;
+    unsigned long users, new_users = cd->users;
+    int size;
 
-    CasDescriptor_t **ptr = &(ptst->next_descriptor);
-    result = *ptr;
-    while ( (result != NULL) && (result->length != length) )
-    {
-        ptr = &(result->fc);
-        result = *ptr;
-    }
+    do { users = new_users; }
+    while ( (new_users = CASIO(&cd->users, users, users - 1)) != users );
 
-    if ( result == NULL )
-    {
-        int alloc_size;
-
-        alloc_size = sizeof (CasDescriptor_t) +
-            ((length - 1) * sizeof (CasEntry_t));
-
-        result = (CasDescriptor_t *) ptst->arena;
-        ptst->arena = ((char *) (ptst->arena)) + alloc_size;
+    if ( users != 1 ) return;
 
-        if ( ptst->arena >= ptst->arena_lim )
-        {
-            new_arena(ptst, ARENA_SIZE);
-            result = (CasDescriptor_t *) ptst->arena;
-            ptst->arena = ((char *) (ptst->arena)) + alloc_size;
-        }
-
-        for ( i = 0; i < num_threads; i++ )
-            result->pt[i] = result;
-
-        result->length = length;
-        result->rc = 2;
-    }
+    size = DESCRIPTOR_SIZE(cd->length);
+    if ( size <= GC_SIZE_CLASS_MAX )
+        gc_free_size(ptst, cd, size);
     else
-    {
-        *ptr = result->fc;
-        assert((result->rc & 1) == 1);
-        rc_delta_descriptor(result, 1); /* clears lowest bit */
-    }
-
-    assert(result->length == length);
-
-    return result;
+        gc_defer(ptst, free_large_descriptor, cd);
 }
 
+/* Entries are in address order, so @ptr's may be found by bisection. */
 static void *read_from_cd (void **ptr, CasDescriptor_t *cd, bool_t get_old)
 {
     CasEntry_t *ce;
-    int         i;
-    int         n;
+    int         lo = 0, hi = cd->length, mid;
 
-    n = cd->length;
-    for ( i = 0; i < n; i++ )
+    while ( lo < hi )
     {
-        ce = &(cd->entries[i]);
+        mid = (lo + hi) / 2;
+        ce  = &(cd->entries[mid]);
         if ( ce->ptr == ptr )
-            return get_old ? ce->old : ce->new;
+            return get_old ? ce->oldval : ce->newval;
+        if ( ce->ptr < ptr )
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
     assert(0);
     return NULL;
 }
 
-static void *read_barrier_lite (void **ptr)
+/* As mcas_read(), for callers in a critical region of mcas_gc. */
+static void *read_word (void **ptr)
 {
     CasDescriptor_t *cd;
     void            *v;
@@ -292,38 +387,82 @@ static void *read_barrier_lite (void **ptr)
     {
         WEAK_DEP_ORDER_RMB();
         cd = get_unmarked_reference(v);
-
-        rc_up_descriptor(cd);
-        if ( *ptr != v )
-        {
-            rc_down_descriptor(cd);
-            goto retry_read_barrier;
-        }
-
         v = read_from_cd(ptr, cd, (cd->status != STATUS_SUCCEEDED));
-
-        rc_down_descriptor(cd);
     }
     else if ( m == MARK_IN_PROGRESS )
     {
-        WEAK_DEP_ORDER_RMB();
-        cd = *(CasDescriptor_t **)get_unmarked_reference(v);
-
-        rc_up_descriptor(cd);
-        if ( *ptr != v )
-        {
-            rc_down_descriptor(cd);
+        /* A word claimed, but not yet acquired, still holds its old value. */
+        if ( (cd = claim_descriptor(v)) == NULL )
             goto retry_read_barrier;
-        }
-
-        v = read_from_cd(ptr, cd, (cd->status != STATUS_SUCCEEDED));
 
-        rc_down_descriptor(cd);
+        v = read_from_cd(ptr, cd, TRUE);
     }
 
     return v;
 }
 
+void *mcas_read (void **ptr)
+{
+    ptst_t *ptst;
+    void   *v;
+
+    v = *ptr;
+    if ( !MCAS_IS_OWNED(v) ) return v;
+
+    /* Descriptors may only be followed from inside a critical region. */
+    MCAS_STAT(owned_reads);
+    ptst = critical_enter(mcas_gc);
+    v = read_word(ptr);
+    critical_exit(ptst);
+
+    return v;
+}
+
+/*
+ * The logical value of @ptr, entering a critical region on first need.
+ * Notes in @owned whether the word was owned.
+ */
+static void *read_lazily (void **ptr, ptst_t **ptst, bool_t *owned)
+{
+    void *v = *ptr;
+
+    if ( !MCAS_IS_OWNED(v) ) return v;
+
+    MCAS_STAT(owned_reads);
+    if ( *ptst == NULL ) *ptst = critical_enter(mcas_gc);
+    *owned = TRUE;
+    return read_word(ptr);
+}
+
+void mcas_read_n (int n, void **ptrs[], void *out[])
+{
+    ptst_t *ptst = NULL;
+    bool_t  owned;
+    int     i;
+
+    for ( ; ; )
+    {
+        owned = FALSE;
+        for ( i = 0; i < n; i++ )
+            out[i] = read_lazily(ptrs[i], &ptst, &owned);
+        RMB();
+        for ( i = 0; i < n; i++ )
+            if ( read_lazily(ptrs[i], &ptst, &owned) != out[i] ) break;
+        if ( i == n ) break;
+
+        /*
+         * Something committed between the collects. If it may still be
+         * in flight, finish it off, so that it cannot spoil the next try.
+         */
+        if ( owned )
+            for ( i = 0; i < n; i++ )
+                while ( fixup(ptst, ptrs[i], *ptrs[i]) )
+                    continue;
+    }
+
+    if ( ptst != NULL ) critical_exit(ptst);
+}
+
 static void clean_descriptor (CasDescriptor_t *cd)
 {
     int   i;
@@ -331,20 +470,90 @@ static void clean_descriptor (CasDescriptor_t *cd)
     int   status;
 
     status = cd->status;
-    assert(status == STATUS_SUCCEEDED || status == STATUS_FAILED);
+    assert(status != STATUS_IN_PROGRESS);
 
     mcd = get_marked_reference(cd, MARK_PTR_TO_CD);
 
-    if (status == STATUS_SUCCEEDED)
-        for ( i = 0; i < cd->length; i++ )
-            CASPO (cd->entries[i].ptr, mcd, cd->entries[i].new);
-    else
-        for ( i = 0; i < cd->length; i++ )
-            CASPO(cd->entries[i].ptr, mcd, cd->entries[i].old);
+    for ( i = 0; i < cd->length; i++ )
+    {
+        CasEntry_t *ce = &(cd->entries[i]);
+        if ( IS_COMPARE_ONLY(cd, ce) ) continue;
+        CASPO(ce->ptr, mcd,
+              (status == STATUS_SUCCEEDED) ? ce->newval : ce->oldval);
+    }
+}
+
+/* Whether @a is younger than @b: by age, then, for equal ages, address. */
+#define YOUNGER(_a, _b)                                     \
+    (((_a)->age > (_b)->age) ||                             \
+     (((_a)->age == (_b)->age) &&                           \
+      ((unsigned long)(_a) > (unsigned long)(_b))))
+
+/*
+ * Check that each compare-only entry of @cd holds its old value. A word
+ * owned by an MCAS still in progress may not be judged by its old value:
+ * that MCAS may yet succeed, and two which each compare a word the other
+ * writes would both commit (write skew). So the younger of the two is
+ * aborted, and if that is @cd the check fails. The owner is never helped
+ * from here, as it may be helping @cd, which would bring it back here.
+ */
+static bool_t check_compare_only (CasDescriptor_t *cd)
+{
+    CasDescriptor_t *other;
+    CasEntry_t      *ce;
+    void            *v;
+    int              i, m;
+
+    for ( i = 0; i < cd->length; i++ )
+    {
+        ce = &(cd->entries[i]);
+        if ( !IS_COMPARE_ONLY(cd, ce) ) continue;
+
+    retry_check:
+        v = *ce->ptr;
+        m = get_markedness(v);
+
+        if ( m == MARK_PTR_TO_CD )
+        {
+            WEAK_DEP_ORDER_RMB();
+            other = get_unmarked_reference(v);
+        }
+        else if ( m == MARK_IN_PROGRESS )
+        {
+            if ( (other = claim_descriptor(v)) == NULL )
+                goto retry_check;
+        }
+        else
+        {
+            if ( v != ce->oldval ) return FALSE;
+            continue;
+        }
+
+        if ( other->status == STATUS_IN_PROGRESS )
+        {
+            if ( !YOUNGER(other, cd) )
+            {
+                CASIO(&cd->status, STATUS_IN_PROGRESS, STATUS_ABORTED);
+                return FALSE;
+            }
+            CASIO(&other->status, STATUS_IN_PROGRESS, STATUS_ABORTED);
+            goto retry_check;
+        }
+
+        /* A word claimed, but not yet acquired, still holds its old value. */
+        v = read_from_cd(ce->ptr, other,
+                         (m == MARK_IN_PROGRESS) ||
+                         (other->status != STATUS_SUCCEEDED));
+        if ( v != ce->oldval ) return FALSE;
+    }
+
+    return TRUE;
 }
 
-static bool_t mcas_fixup (void **ptr,
-			  void *value_read)
+/* As mcas_fixup(), for callers in a critical region of mcas_gc. */
+static bool_t fixup (ptst_t *ptst,
+		     void **ptr,
+		     void *value_read)
 {
     int m;
 
@@ -355,35 +564,27 @@ static bool_t mcas_fixup (void **ptr,
         CasDescriptor_t *helpee;
         helpee = get_unmarked_reference(value_read);
 
-        rc_up_descriptor(helpee);
-        if ( *ptr != value_read )
+        /* A retired descriptor has already been cleaned up. */
+        if ( get_descriptor(helpee) )
         {
-            rc_down_descriptor(helpee);
-            value_read = *ptr;
-            goto retry_mcas_fixup;
+            MCAS_STAT(helps);
+            mcas0(ptst, helpee);
+            put_descriptor(ptst, helpee);
         }
 
-        mcas0(NULL, helpee);
-
-        rc_down_descriptor(helpee);
-
         return TRUE;
     }
     else if ( m == MARK_IN_PROGRESS )
     {
         CasDescriptor_t *other_cd;
 
-        WEAK_DEP_ORDER_RMB();
-        other_cd = *(CasDescriptor_t **)get_unmarked_reference(value_read);
-
-        rc_up_descriptor(other_cd);
-        if ( *ptr != value_read )
+        if ( (other_cd = claim_descriptor(value_read)) == NULL )
         {
-            rc_down_descriptor(other_cd);
             value_read = *ptr;
             goto retry_mcas_fixup;
         }
 
+        MCAS_STAT(helps);
         if ( other_cd->status == STATUS_IN_PROGRESS )
             CASPO(ptr,
                   value_read,
@@ -393,14 +594,32 @@ static bool_t mcas_fixup (void **ptr,
                   value_read,
                   read_from_cd(ptr, other_cd, TRUE));
 
-        rc_down_descriptor (other_cd);
         return TRUE;
     }
 
     return FALSE;
 }
 
-static void *read_barrier (void **ptr)
+bool_t mcas_fixup (void **ptr,
+		   void *value_read)
+{
+    ptst_t *ptst;
+    bool_t  r;
+
+    if ( !MCAS_IS_OWNED(value_read) ) return FALSE;
+
+    /*
+     * @value_read was read outside our critical region, so whatever it
+     * names may since have been retired. Start again from a fresh read.
+     */
+    ptst = critical_enter(mcas_gc);
+    r = (*ptr != value_read) || fixup(ptst, ptr, *ptr);
+    critical_exit(ptst);
+
+    return r;
+}
+
+void *mcas_read_barrier (void **ptr)
 {
     void *v;
 
@@ -410,7 +629,62 @@ static void *read_barrier (void **ptr)
     return v;
 }
 
-static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
+static void backoff (unsigned int pauses)
+{
+    while ( pauses-- != 0 ) CPU_RELAX();
+}
+
+/*
+ * @cd found @value_read at @ptr, rather than its entry's old value.
+ * Returns FALSE if the word is not owned by an MCAS, so that @cd must
+ * fail. Otherwise deals with the owner as @cd's domain's contention
+ * policy says, and returns TRUE for @cd to retry. @delay is the caller's
+ * current backoff, starting at zero.
+ */
+static bool_t contend (ptst_t *ptst,
+                       CasDescriptor_t *cd,
+                       void **ptr,
+                       void *value_read,
+                       unsigned int *delay)
+{
+    const mcas_config_t *cfg = &cd->domain->cfg;
+    CasDescriptor_t     *other;
+    unsigned int         i;
+
+    if ( !MCAS_IS_OWNED(value_read) ) return FALSE;
+
+    switch ( cfg->cm_policy )
+    {
+    case MCAS_CM_BACKOFF:
+        if ( *delay < cfg->backoff_max )
+        {
+            *delay = (*delay == 0) ? cfg->backoff_min : (*delay * 2);
+            backoff(*delay);
+            return TRUE;
+        }
+        break;
+
+    case MCAS_CM_WAIT:
+        for ( i = 0; (i < cfg->help_delay) && (*ptr == value_read); i++ )
+            CPU_RELAX();
+        if ( *ptr != value_read ) return TRUE;
+        break;
+
+    case MCAS_CM_AGE:
+        if ( get_markedness(value_read) == MARK_PTR_TO_CD )
+            other = get_unmarked_reference(value_read);
+        else if ( (other = claim_descriptor(value_read)) == NULL )
+            return TRUE;
+        /* The owner cannot be retired within our critical region. */
+        if ( other->age > cd->age )
+            CASIO(&other->status, STATUS_IN_PROGRESS, STATUS_ABORTED);
+        break;
+    }
+
+    return fixup(ptst, ptr, value_read);
+}
+
+static bool_t mcas0 (ptst_t *ptst, CasDescriptor_t *cd)
 {
     int     i;
     int     n;
@@ -418,10 +692,8 @@ static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
     bool_t  final_success;
     void   *mcd;
     void   *dmcd;
-    int     old_status;
-
-    if ( ptst == NULL )
-        ptst = get_ptst();
+    unsigned int delay = 0;
+    mcas_thread_t *self = get_thread();
 
     MB(); /* required for sequential consistency */
 
@@ -431,7 +703,7 @@ static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
         final_success = TRUE;
         goto out;
     }
-    else if ( cd->status == STATUS_FAILED )
+    else if ( cd->status != STATUS_IN_PROGRESS )
     {
         clean_descriptor(cd);
         final_success = FALSE;
@@ -440,23 +712,30 @@ static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
 
     /* Attempt to link in all entries in the descriptor. */
     mcd = get_marked_reference(cd, MARK_PTR_TO_CD);
-    dmcd = get_marked_reference(&(cd->pt[ptst->id]), MARK_IN_PROGRESS);
 
     desired_status = STATUS_SUCCEEDED;
 
  retry:
+    /* Helping another operation may have used our slot: claim afresh. */
+    dmcd = new_claim(self, cd);
     n = cd->length;
     for (i = 0; i < n; i ++)
     {
-        CasEntry_t *ce         = &(cd->entries[i]);
-        void       *value_read = CASPO(ce->ptr, ce->old, dmcd);
+        CasEntry_t *ce = &(cd->entries[i]);
+        void       *value_read;
+
+        if ( IS_COMPARE_ONLY(cd, ce) ) continue;
 
-        if ( (value_read != ce->old) &&
+        value_read = CASPO(ce->ptr, ce->oldval, dmcd);
+        if ( (value_read != ce->oldval) &&
              (value_read != dmcd) &&
              (value_read != mcd) )
         {
-            if ( mcas_fixup(ce->ptr, value_read) )
+            if ( contend(ptst, cd, ce->ptr, value_read, &delay) )
+            {
+                MCAS_STAT(retries);
                 goto retry;
+            }
             desired_status = STATUS_FAILED;
             break;
         }
@@ -464,7 +743,7 @@ static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
         RMB_NEAR_CAS(); /* ensure check of status occurs after CASPO. */
         if ( cd->status != STATUS_IN_PROGRESS )
         {
-            CASPO(ce->ptr, dmcd, ce->old);
+            CASPO(ce->ptr, dmcd, ce->oldval);
             break;
         }
 
@@ -477,6 +756,17 @@ static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
         }
     }
 
+    /*
+     * With the write set held, check the compare-only entries, then check
+     * them again just before the status CAS. A word matching on both
+     * passes held its old value (barring ABA) when the first pass ended,
+     * at which point every word of the write set was ours too.
+     */
+    if ( (desired_status == STATUS_SUCCEEDED) &&
+         (cd->flags & MCAS_COMPARE_ONLY) &&
+         (!check_compare_only(cd) || !check_compare_only(cd)) )
+        desired_status = STATUS_FAILED;
+
     /*
      * All your ptrs are belong to us (or we've been helped and
      * already known to have succeeded or failed).  Try to
@@ -499,9 +789,9 @@ static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
      * of coherency before producing its result: even Alpha provides this!
      */
     WEAK_DEP_ORDER_WMB();
-    old_status = CASIO((int *)&cd->status,
-                       STATUS_IN_PROGRESS,
-                       desired_status);
+    (void)CASIO((int *)&cd->status,
+                STATUS_IN_PROGRESS,
+                desired_status);
     /*
      * This ensures final sequential consistency.
      * Also ensures that the status update is visible before cleanup.
@@ -516,66 +806,324 @@ static bool_t mcas0 (per_thread_state_t *ptst, CasDescriptor_t *cd)
 }
 
 
-void mcas_init (void)
+void mcas_config_init (mcas_config_t *cfg)
 {
-    int r = pthread_key_create(&mcas_ptst_key, NULL);
-    if ( r != 0 ) abort();
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->cm_policy   = MCAS_CM_HELP;
+    cfg->backoff_min = BACKOFF_MIN;
+    cfg->backoff_max = BACKOFF_MAX;
+    cfg->help_delay  = HELP_DELAY;
+}
+
+/* The configuration of domains created without one, if set. */
+static mcas_config_t default_cfg;
+static VOLATILE int  default_cfg_set;
+
+void mcas_set_default_config (const mcas_config_t *cfg)
+{
+    default_cfg = *cfg;
+    WMB();
+    default_cfg_set = 1;
+}
+
+mcas_domain_t *mcas_init (void)
+{
+    return mcas_init_config(NULL);
+}
+
+mcas_domain_t *mcas_init_config (const mcas_config_t *cfg)
+{
+    mcas_domain_t *d = ALIGNED_ALLOC(sizeof(*d));
+
+    if ( d == NULL ) abort();
+    pthread_once(&mcas_once, mcas_init_process);
+    d->gc = mcas_gc;
+
+    if ( cfg != NULL )
+        d->cfg = *cfg;
+    else if ( default_cfg_set )
+        d->cfg = default_cfg;
+    else
+        mcas_config_init(&d->cfg);
+    if ( d->cfg.backoff_min == 0 ) d->cfg.backoff_min = 1;
+
+    return d;
 }
 
 /***********************************************************************/
 
+/* Widths up to which insertion sort beats heapsort. */
+#define SORT_INSERTION_MAX 16
+
+/* Sift @e[i] down into its place in the max-heap @e[0..n). */
+static void sift_down (CasEntry_t *e, int i, int n)
+{
+    CasEntry_t tmp = e[i];
+    int        c;
+
+    while ( (c = 2*i + 1) < n )
+    {
+        if ( (c + 1 < n) && (e[c].ptr < e[c+1].ptr) ) c++;
+        if ( e[c].ptr <= tmp.ptr ) break;
+        e[i] = e[c];
+        i = c;
+    }
+    e[i] = tmp;
+}
+
+static bool_t heap_sort_entries (CasEntry_t *e, int n)
+{
+    CasEntry_t tmp;
+    int        i;
+
+    for ( i = n/2 - 1; i >= 0; i-- )
+        sift_down(e, i, n);
+    for ( i = n - 1; i > 0; i-- )
+    {
+        tmp = e[0];
+        e[0] = e[i];
+        e[i] = tmp;
+        sift_down(e, 0, i);
+    }
+
+    for ( i = 1; i < n; i++ )
+        if ( e[i-1].ptr == e[i].ptr ) return FALSE;
+
+    return TRUE;
+}
+
+/* Sort entries into address order. Fail on non-unique pointers. */
+static bool_t sort_entries (CasEntry_t *e, int n)
+{
+    CasEntry_t tmp;
+    int        i, j;
+
+    if ( n > SORT_INSERTION_MAX ) return heap_sort_entries(e, n);
+
+    for ( i = 1; i < n; i++ )
+    {
+        for ( j = i; (j > 0) && (e[j-1].ptr > e[i].ptr); j-- )
+            continue;
+        if ( (j > 0) && (e[j-1].ptr == e[i].ptr) ) return FALSE;
+        if ( j != i )
+        {
+            tmp = e[i];
+            memmove(&e[j+1], &e[j], (i-j)*sizeof(CasEntry_t));
+            e[j] = tmp;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Run @cd to completion and drop the caller's reference to it. An
+ * aborted descriptor is replaced by a copy with the same age, which is
+ * run in its turn.
+ */
+/* Help any MCAS owning one of @cd's compare-only words to finish. */
+static void help_compare_only (ptst_t *ptst, CasDescriptor_t *cd)
+{
+    CasEntry_t *ce;
+    int         i;
+
+    for ( i = 0; i < cd->length; i++ )
+    {
+        ce = &(cd->entries[i]);
+        if ( IS_COMPARE_ONLY(cd, ce) ) (void)fixup(ptst, ce->ptr, *ce->ptr);
+    }
+}
+
+static bool_t run_descriptor (ptst_t *ptst, CasDescriptor_t *cd)
+{
+    CasDescriptor_t *new_cd;
+    bool_t           result;
+
+    while ( !(result = mcas0(ptst, cd)) && (cd->status == STATUS_ABORTED) )
+    {
+        MCAS_STAT(aborts);
+        /*
+         * We may have aborted ourselves for an older MCAS owning a word we
+         * only compare. Holding nothing now, we may safely help it along.
+         */
+        if ( cd->flags & MCAS_COMPARE_ONLY )
+            help_compare_only(ptst, cd);
+        new_cd = new_descriptor(ptst, cd->domain, cd->length);
+        new_cd->flags = cd->flags;
+        new_cd->age   = cd->age;
+        memcpy(new_cd->entries, cd->entries,
+               cd->length * sizeof(CasEntry_t));
+        put_descriptor(ptst, cd);
+        cd = new_cd;
+    }
+    assert(cd->status != STATUS_IN_PROGRESS);
+
+    put_descriptor(ptst, cd);
+    return result;
+}
+
+#ifdef CAS128
+#define DCAS_UNOWNED(_v) (!MCAS_IS_OWNED((void *) (ptr_int) (_v)))
+
+/*
+ * Two words sharing an aligned 16-byte unit are updated by one CAS128,
+ * without a descriptor, while neither is owned by an MCAS. Returns the
+ * MCAS result, or -1 if the operation must take the slow path.
+ */
+static int dcas (void **p0, void *o0, void *n0,
+                 void **p1, void *o1, void *n1)
+{
+    _u128 old, new, seen;
+
+    if ( p1 < p0 )
+        return dcas(p1, o1, n1, p0, o0, n0);
+
+    if ( (((ptr_int) p0) & 15) || (p1 != p0 + 1) ) return -1;
+
+    old  = ((_u128) (ptr_int) o1 << 64) | (ptr_int) o0;
+    new  = ((_u128) (ptr_int) n1 << 64) | (ptr_int) n0;
+    seen = CAS128(p0, old, new);
+    if ( seen == old ) return TRUE;
+
+    /* An owned word's logical value is known only to its descriptor. */
+    if ( DCAS_UNOWNED(seen) && DCAS_UNOWNED(seen >> 64) ) return FALSE;
+
+    return -1;
+}
+#endif
+
+bool_t mcas_n (mcas_domain_t *d,
+	       int n,
+	       mcas_entry_t *e,
+	       int flags)
+{
+    CasDescriptor_t *cd;
+    int              result = 0;
+    ptst_t          *ptst;
+
+    assert(n > 0);
+
+#ifdef CAS128
+    if ( (n == 2) &&
+         ((result = dcas(e[0].ptr, e[0].oldval, e[0].newval,
+                         e[1].ptr, e[1].oldval, e[1].newval)) >= 0) )
+    {
+        MCAS_STAT(fast_path);
+        MCAS_STAT_RESULT(n, result);
+        return result;
+    }
+    result = 0;
+#endif
+
+    ptst = critical_enter(d->gc);
+    cd = new_descriptor(ptst, d, n);
+    cd->flags = flags;
+    memcpy(cd->entries, e, n*sizeof(CasEntry_t));
+
+    if ( !(flags & MCAS_SORTED) && !sort_entries(cd->entries, n) )
+        put_descriptor(ptst, cd);
+    else
+        result = run_descriptor(ptst, cd);
+
+    critical_exit(ptst);
+    MCAS_STAT_RESULT(n, result);
+    return result;
+}
+
+static mcas_domain_t *default_domain;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void default_init (void)
+{
+    default_domain = mcas_init();
+}
+
 bool_t mcas (int n,
 	     void **ptr, void *old, void *new,
 	     ...)
 {
-    va_list             ap;
-    int                 i;
-    CasDescriptor_t    *cd;
-    CasEntry_t         *ce;
-    int                 result = 0;
-    per_thread_state_t *ptst = get_ptst();
+    va_list          ap;
+    int              i;
+    CasDescriptor_t *cd;
+    CasEntry_t      *ce;
+    int              result = 0;
+    ptst_t          *ptst;
 
-    cd = new_descriptor(ptst, n);
+#ifdef CAS128
+    if ( n == 2 )
+    {
+        void **ptr1, *old1, *new1;
 
-    cd->status = STATUS_IN_PROGRESS;
-    cd->length = n;
+        va_start(ap, new);
+        ptr1 = va_arg(ap, void **);
+        old1 = va_arg(ap, void *);
+        new1 = va_arg(ap, void *);
+        va_end(ap);
+
+        if ( (result = dcas(ptr, old, new, ptr1, old1, new1)) >= 0 )
+        {
+            MCAS_STAT(fast_path);
+            MCAS_STAT_RESULT(n, result);
+            return result;
+        }
+        result = 0;
+    }
+#endif
+
+    pthread_once(&default_once, default_init);
+    ptst = critical_enter(default_domain->gc);
+
+    cd = new_descriptor(ptst, default_domain, n);
 
     ce = cd->entries;
     ce->ptr = ptr;
-    ce->old = old;
-    ce->new = new;
+    ce->oldval = old;
+    ce->newval = new;
 
     va_start(ap, new);
     for ( i = 1; i < n; i++ )
     {
         ce ++;
         ce->ptr = va_arg(ap, void **);
-        ce->old = va_arg(ap, void *);
-        ce->new = va_arg(ap, void *);
+        ce->oldval = va_arg(ap, void *);
+        ce->newval = va_arg(ap, void *);
     }
     va_end (ap);
 
-    /* Insertion sort. Fail on non-unique pointers. */
-    for ( i = 1, ce = &cd->entries[1]; i < n; i++, ce++ )
-    {
-        int j;
-        CasEntry_t *cei, tmp;
-        for ( j = i-1, cei = ce-1; j >= 0; j--, cei-- )
-            if ( cei->ptr <= ce->ptr ) break;
-        if ( cei->ptr == ce->ptr ) goto out;
-        if ( ++cei != ce )
-        {
-            tmp = *ce;
-            memmove(cei+1, cei, (ce-cei)*sizeof(CasEntry_t));
-            *cei = tmp;
-        }
-    }
-
-    result = mcas0(ptst, cd);
-    assert(cd->status != STATUS_IN_PROGRESS);
+    if ( !sort_entries(cd->entries, n) )
+        put_descriptor(ptst, cd);
+    else
+        result = run_descriptor(ptst, cd);
 
- out:
-    rc_down_descriptor (cd);
+    critical_exit(ptst);
+    MCAS_STAT_RESULT(n, result);
     return result;
 }
 
+void mcas_get_stats (mcas_stats_t *out)
+{
+#ifdef MCAS_STATS
+    mcas_stats_t *st;
+    int           i, b, nr = next_thread_id;
+#endif
+
+    memset(out, 0, sizeof(*out));
+
+#ifdef MCAS_STATS
+    if ( nr > MAX_THREADS ) nr = MAX_THREADS;
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( mcas_threads[i] == NULL ) continue;
+        st = &mcas_threads[i]->stats;
+        out->successes   += st->successes;
+        out->failures    += st->failures;
+        out->fast_path   += st->fast_path;
+        out->helps       += st->helps;
+        out->retries     += st->retries;
+        out->aborts      += st->aborts;
+        out->owned_reads += st->owned_reads;
+        for ( b = 0; b < MCAS_STATS_LENGTHS; b++ )
+            out->lengths[b] += st->lengths[b];
+    }
+#endif
+}
@@ -0,0 +1,188 @@
+/******************************************************************************
+ * mcas_hpp_test.cc
+ *
+ * Tests for the C++ layer over MCAS, osi_mcas.hpp.
+ *
+ *  mcas_hpp_test [basic | bank]
+ *
+ * basic: single-threaded checks of mcas_word and mcas_txn, with pointer
+ * and integer words. A transaction must commit only if every word holds
+ * its old value (or compared value), and must leave all of them alone
+ * otherwise.
+ *
+ * bank: worker threads move random amounts between random sets of
+ * accounts, each transfer an mcas_txn, while a reader checks that loads
+ * never see an owned word. Money must be neither created nor destroyed.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "osi_mcas.hpp"
+
+using osi_mcas::mcas_txn;
+using osi_mcas::mcas_word;
+
+#define NR_ACCOUNTS   64
+#define NR_WORKERS    4
+#define BANK_OPS      100000
+#define BANK_WIDTH    4
+#define BANK_START    1000
+
+/* Balances are kept shifted clear of the bits MCAS uses. */
+#define TO_WORD(_v)   (static_cast<std::uintptr_t>(_v) << 2)
+#define FROM_WORD(_w) (static_cast<unsigned long>(_w) >> 2)
+
+struct node {
+    int key;
+    node *next;
+};
+
+static mcas_word<std::uintptr_t> accounts[NR_ACCOUNTS];
+static volatile int stop;
+
+
+static int
+test_basic()
+{
+    node a = { 1, nullptr }, b = { 2, nullptr };
+    mcas_word<node *> head(&a), tail(&a);
+    mcas_word<std::uintptr_t> count(TO_WORD(1));
+    int rc = 0;
+
+    /* Push b: head and tail move together, if count is still 1. */
+    mcas_txn<3> txn;
+    txn.update(head, &a, &b).update(tail, &a, &b).compare(count, TO_WORD(1));
+    if (!txn.commit() || (head.load() != &b) || (tail != &b) ||
+	(count != TO_WORD(1))) {
+	std::printf("basic: FAILED, transaction of matching words\n");
+	rc = 1;
+    }
+
+    /* The same transaction again: now stale, nothing may change. */
+    if (txn.commit() || (head.load() != &b) || (tail.load() != &b)) {
+	std::printf("basic: FAILED, stale transaction committed\n");
+	rc = 1;
+    }
+
+    /* A compare-only mismatch fails the lot. */
+    txn.clear();
+    txn.update(head, &b, nullptr).compare(count, TO_WORD(2));
+    if (txn.commit() || (head.load() != &b) || (txn.size() != 2)) {
+	std::printf("basic: FAILED, mismatched compare committed\n");
+	rc = 1;
+    }
+
+    if (!count.compare_exchange(TO_WORD(1), TO_WORD(5)) ||
+	count.compare_exchange(TO_WORD(1), TO_WORD(6)) ||
+	(count.load() != TO_WORD(5))) {
+	std::printf("basic: FAILED, compare_exchange\n");
+	rc = 1;
+    }
+
+    static_assert(mcas_txn<3>::capacity() == 3, "capacity");
+
+    std::printf("basic: %s\n", rc ? "FAILED" : "ok");
+    return rc;
+}
+
+
+static void
+bank_worker(unsigned long r)
+{
+    mcas_txn<BANK_WIDTH> txn;
+    std::uintptr_t old[BANK_WIDTH];
+    int k[BANK_WIDTH];
+    unsigned long v, amount;
+    int i, j, done = 0;
+
+    while (done < BANK_OPS) {
+	for (i = 0; i < BANK_WIDTH; i++) {
+	again:
+	    r = r * 6364136223846793005UL + 1442695040888963407UL;
+	    k[i] = (int)((r >> 33) % NR_ACCOUNTS);
+	    for (j = 0; j < i; j++)
+		if (k[j] == k[i])
+		    goto again;
+	    old[i] = accounts[k[i]].load();
+	}
+	v = FROM_WORD(old[0]);
+	amount = (v < BANK_WIDTH) ? 0 : (r >> 40) % (v / (BANK_WIDTH - 1));
+
+	txn.clear();
+	txn.update(accounts[k[0]], old[0],
+		   TO_WORD(v - amount * (BANK_WIDTH - 1)));
+	for (i = 1; i < BANK_WIDTH; i++)
+	    txn.update(accounts[k[i]], old[i],
+		       TO_WORD(FROM_WORD(old[i]) + amount));
+	if (txn.commit())
+	    done++;
+    }
+}
+
+
+static int
+test_bank()
+{
+    std::vector<std::thread> workers;
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < NR_ACCOUNTS; i++)
+	while (!accounts[i].compare_exchange(accounts[i].load(),
+					     TO_WORD(BANK_START)))
+	    continue;
+
+    stop = 0;
+    std::thread reader([] {
+	while (!stop)
+	    for (int i = 0; i < NR_ACCOUNTS; i++)
+		if (MCAS_IS_OWNED(accounts[i].load())) {
+		    std::printf("bank: FAILED, loaded an owned word\n");
+		    std::abort();
+		}
+    });
+    for (i = 0; i < NR_WORKERS; i++)
+	workers.emplace_back(bank_worker, i * 2654435761UL + 1);
+    for (auto &t : workers)
+	t.join();
+    stop = 1;
+    reader.join();
+
+    for (i = 0; i < NR_ACCOUNTS; i++)
+	total += FROM_WORD(accounts[i].load());
+    std::printf("bank: %d transfers, total %lu of %lu\n",
+		NR_WORKERS * BANK_OPS, total,
+		(unsigned long)NR_ACCOUNTS * BANK_START);
+    if (total != (unsigned long)NR_ACCOUNTS * BANK_START) {
+	std::printf("bank: FAILED\n");
+	return 1;
+    }
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int rc = 0, ran = 0;
+
+    if ((argc < 2) || !std::strcmp(argv[1], "basic")) {
+	rc |= test_basic();
+	ran = 1;
+    }
+    if ((argc < 2) || !std::strcmp(argv[1], "bank")) {
+	rc |= test_bank();
+	ran = 1;
+    }
+    if (!ran) {
+	std::fprintf(stderr, "usage: %s [basic | bank]\n", argv[0]);
+	return 2;
+    }
+
+    return rc;
+}
@@ -0,0 +1,832 @@
+/******************************************************************************
+ * mcas_test.c
+ *
+ * Tests for the MCAS library.
+ *
+ *  mcas_test [basic | bank | threads | skew | crossed | overlap | dcas |
+ *             cm | snapshot | width]
+ *
+ * basic: single-threaded checks of mcas_n() and mcas(). An MCAS must
+ * succeed only if every word holds its old value, and must leave all of
+ * them alone otherwise. Entries naming the same word twice must fail, as
+ * must a compare-only entry which does not match.
+ *
+ * bank: worker threads move random amounts between random sets of
+ * accounts, each transfer a single MCAS, while readers follow the balances
+ * through mcas_read(). Money must be neither created nor destroyed.
+ * Built with MCAS_STATS, also reports the statistics gathered.
+ *
+ * threads: batches of short-lived threads, many more than MAX_THREADS in
+ * all, each run a few MCASes through mcas() and exit. Exiting threads
+ * must hand back their ids for the next ones to use.
+ *
+ * skew: worker threads raise one of a pair of counters while their sum is
+ * below a limit, each MCAS comparing, but not writing, the other counter.
+ * Without the compare-only check the sum would overshoot (write skew).
+ *
+ * crossed: two threads race, round after round, one writing A while
+ * comparing B, the other writing B while comparing A, both from zero. At
+ * most one may succeed in each round. A fast interval timer makes the
+ * threads yield, so that each finds the other's word owned mid-MCAS.
+ *
+ * overlap: as crossed, but with one thread writing A while comparing B,
+ * and the other writing both. Each may find the other holding a word it
+ * needs, and neither may help the other forever.
+ *
+ * dcas: worker threads move amounts between the two words of an aligned
+ * pair, which takes the CAS128 fast path, and between two pairs, which
+ * takes the full protocol. Money must be neither created nor destroyed.
+ * Also reports single-threaded rates of both paths, and checks tagged
+ * pointers.
+ *
+ * cm: the bank workers again, without readers, in a domain of each
+ * contention policy in turn.
+ *
+ * snapshot: the bank workers again, while readers take snapshots of all
+ * the accounts with mcas_read_n(). Every snapshot must add up.
+ *
+ * width: single-threaded rates of MCASes of widths 2 to MAX_WIDTH, with
+ * entries in random order, and already sorted (MCAS_SORTED). A wide MCAS
+ * naming a word twice must fail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "portable_defns.h"
+#include "osi_mcas.h"
+
+#define NR_WORDS      8
+#define NR_ACCOUNTS   64
+#define NR_WORKERS    4
+#define NR_READERS    2
+#define BANK_OPS      200000
+#define BANK_WIDTH    4
+#define BANK_START    1000
+#define NR_BATCHES    (4 * MAX_THREADS / NR_WORKERS)
+#define THREAD_OPS    16
+#define SKEW_LIMIT    100000
+#define CROSSED_ROUNDS 200000
+#define NR_PAIRS      8
+#define DCAS_OPS      200000
+#define MAX_WIDTH     128
+#define WIDTH_WORDS   (1 << 20)
+
+/* Balances are kept shifted clear of the bits MCAS uses. */
+#define TO_WORD(_v)   ((void *)((unsigned long)(_v) << 2))
+#define FROM_WORD(_w) ((unsigned long)(_w) >> 2)
+
+static mcas_domain_t *domain;
+static void *accounts[NR_ACCOUNTS];
+static VOLATILE int stop;
+/* A cache line each, so that the pair never takes the CAS128 fast path. */
+static struct {
+    void *w __attribute__((aligned(64)));
+} counters[2];
+static struct {
+    void *w __attribute__((aligned(64)));
+} crossed[2];
+static mcas_entry_t crossed_e[2][2];
+static int crossed_won[2];
+static pthread_barrier_t crossed_barrier;
+static void *pairs[2 * NR_PAIRS] __attribute__((aligned(16)));
+
+
+static int
+test_basic(void)
+{
+    void *w[NR_WORDS];
+    mcas_entry_t e[NR_WORDS];
+    int i, rc = 0;
+
+    domain = mcas_init();
+    for (i = 0; i < NR_WORDS; i++)
+	w[i] = TO_WORD(i);
+
+    /* Entries in reverse order, so that they must be sorted. */
+    for (i = 0; i < NR_WORDS; i++) {
+	e[i].ptr = &w[NR_WORDS - 1 - i];
+	e[i].oldval = TO_WORD(NR_WORDS - 1 - i);
+	e[i].newval = TO_WORD(NR_WORDS - 1 - i + 100);
+    }
+    if (!mcas_n(domain, NR_WORDS, e, 0)) {
+	printf("basic: FAILED, MCAS of matching words failed\n");
+	rc = 1;
+    }
+    for (i = 0; i < NR_WORDS; i++)
+	if (mcas_read(&w[i]) != TO_WORD(i + 100)) {
+	    printf("basic: FAILED, word %d not updated\n", i);
+	    rc = 1;
+	}
+
+    /* One stale old value: nothing may change. */
+    for (i = 0; i < NR_WORDS; i++) {
+	e[i].oldval = e[i].newval;
+	e[i].newval = TO_WORD(0);
+    }
+    e[NR_WORDS / 2].oldval = TO_WORD(1);
+    if (mcas_n(domain, NR_WORDS, e, 0)) {
+	printf("basic: FAILED, MCAS with a stale word succeeded\n");
+	rc = 1;
+    }
+    for (i = 0; i < NR_WORDS; i++)
+	if (mcas_read(&w[i]) != TO_WORD(i + 100)) {
+	    printf("basic: FAILED, word %d changed by failed MCAS\n", i);
+	    rc = 1;
+	}
+
+    /* Pre-sorted entries. */
+    for (i = 0; i < NR_WORDS; i++) {
+	e[i].ptr = &w[i];
+	e[i].oldval = TO_WORD(i + 100);
+	e[i].newval = TO_WORD(i);
+    }
+    if (!mcas_n(domain, NR_WORDS, e, MCAS_SORTED) ||
+	(mcas_read(&w[NR_WORDS - 1]) != TO_WORD(NR_WORDS - 1))) {
+	printf("basic: FAILED, sorted MCAS failed\n");
+	rc = 1;
+    }
+
+    /* The same word twice. */
+    e[1].ptr = e[0].ptr;
+    e[1].oldval = e[0].oldval;
+    if (mcas_n(domain, 2, e, 0)) {
+	printf("basic: FAILED, MCAS naming a word twice succeeded\n");
+	rc = 1;
+    }
+
+    /* Compare-only entries: w[0] is checked, w[1] written. */
+    e[0].ptr = &w[0];
+    e[0].oldval = e[0].newval = TO_WORD(0);
+    e[1].ptr = &w[1];
+    e[1].oldval = TO_WORD(1);
+    e[1].newval = TO_WORD(2);
+    w[0] = TO_WORD(5);
+    if (mcas_n(domain, 2, e, MCAS_COMPARE_ONLY) || (w[1] != TO_WORD(1))) {
+	printf("basic: FAILED, mismatched compare-only entry succeeded\n");
+	rc = 1;
+    }
+    w[0] = TO_WORD(0);
+    if (!mcas_n(domain, 2, e, MCAS_COMPARE_ONLY) || (w[0] != TO_WORD(0)) ||
+	(w[1] != TO_WORD(2))) {
+	printf("basic: FAILED, compare-only MCAS\n");
+	rc = 1;
+    }
+    e[1].oldval = e[1].newval;
+    if (!mcas_n(domain, 2, e, MCAS_COMPARE_ONLY)) {
+	printf("basic: FAILED, all compare-only MCAS\n");
+	rc = 1;
+    }
+    w[1] = TO_WORD(1);
+
+    /* Varargs, in the default domain. */
+    if (!mcas(2, &w[0], TO_WORD(0), TO_WORD(7), &w[1], TO_WORD(1),
+	      TO_WORD(8)) ||
+	mcas(2, &w[0], TO_WORD(0), TO_WORD(9), &w[1], TO_WORD(8),
+	     TO_WORD(9)) ||
+	(mcas_read_barrier(&w[0]) != TO_WORD(7)) ||
+	(mcas_read_barrier(&w[1]) != TO_WORD(8))) {
+	printf("basic: FAILED, varargs MCAS\n");
+	rc = 1;
+    }
+
+    printf("basic: %s\n", rc ? "FAILED" : "ok");
+    return (rc);
+}
+
+
+static void *
+bank_worker(void *arg)
+{
+    unsigned long r = (unsigned long)arg * 2654435761UL + 1;
+    mcas_entry_t e[BANK_WIDTH];
+    unsigned long v, amount;
+    int i, j, k, done = 0;
+
+    while (done < BANK_OPS) {
+	/* Take an amount from the first account, spread over the rest. */
+	for (i = 0; i < BANK_WIDTH; i++) {
+	again:
+	    r = r * 6364136223846793005UL + 1442695040888963407UL;
+	    k = (int)((r >> 33) % NR_ACCOUNTS);
+	    for (j = 0; j < i; j++)
+		if (e[j].ptr == &accounts[k])
+		    goto again;
+	    e[i].ptr = &accounts[k];
+	    e[i].oldval = mcas_read(&accounts[k]);
+	}
+	v = FROM_WORD(e[0].oldval);
+	amount = (v < BANK_WIDTH) ? 0 : (r >> 40) % (v / (BANK_WIDTH - 1));
+	e[0].newval = TO_WORD(v - amount * (BANK_WIDTH - 1));
+	for (i = 1; i < BANK_WIDTH; i++)
+	    e[i].newval = TO_WORD(FROM_WORD(e[i].oldval) + amount);
+
+	if (mcas_n(domain, BANK_WIDTH, e, 0))
+	    done++;
+    }
+
+    return (NULL);
+}
+
+
+static void *
+bank_reader(void *arg)
+{
+    unsigned long reads = 0;
+    int i;
+
+    while (!stop) {
+	for (i = 0; i < NR_ACCOUNTS; i++)
+	    if (MCAS_IS_OWNED(mcas_read(&accounts[i]))) {
+		printf("bank: FAILED, read an owned word\n");
+		abort();
+	    }
+	reads++;
+    }
+
+    return ((void *)reads);
+}
+
+
+static int
+test_bank(void)
+{
+    pthread_t workers[NR_WORKERS], readers[NR_READERS];
+    struct timespec t0, t1;
+    unsigned long total = 0;
+    double secs;
+#ifdef MCAS_STATS
+    mcas_stats_t st0, st1;
+#endif
+    int i;
+
+    domain = mcas_init();
+#ifdef MCAS_STATS
+    mcas_get_stats(&st0);
+#endif
+    for (i = 0; i < NR_ACCOUNTS; i++)
+	accounts[i] = TO_WORD(BANK_START);
+
+    stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < NR_READERS; i++)
+	pthread_create(&readers[i], NULL, bank_reader, NULL);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&workers[i], NULL, bank_worker, (void *)(long)i);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(workers[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stop = 1;
+    for (i = 0; i < NR_READERS; i++)
+	pthread_join(readers[i], NULL);
+
+    for (i = 0; i < NR_ACCOUNTS; i++)
+	total += FROM_WORD(mcas_read_barrier(&accounts[i]));
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("bank: %d transfers of width %d in %.2fs (%.2f M/s), "
+	   "total %lu of %lu\n", NR_WORKERS * BANK_OPS, BANK_WIDTH, secs,
+	   NR_WORKERS * BANK_OPS / secs / 1e6, total,
+	   (unsigned long)NR_ACCOUNTS * BANK_START);
+
+#ifdef MCAS_STATS
+    mcas_get_stats(&st1);
+    printf("bank: %lu succeeded, %lu failed, %lu helps, %lu retries, "
+	   "%lu owned reads\n", st1.successes - st0.successes,
+	   st1.failures - st0.failures, st1.helps - st0.helps,
+	   st1.retries - st0.retries, st1.owned_reads - st0.owned_reads);
+    if ((st1.successes - st0.successes != NR_WORKERS * BANK_OPS) ||
+	(st1.lengths[2] - st0.lengths[2] !=
+	 st1.successes - st0.successes + st1.failures - st0.failures)) {
+	printf("bank: FAILED, statistics\n");
+	return (1);
+    }
+#endif
+
+    if (total != (unsigned long)NR_ACCOUNTS * BANK_START) {
+	printf("bank: FAILED\n");
+	return (1);
+    }
+    return (0);
+}
+
+
+static void *
+short_lived(void *arg)
+{
+    void **w = arg, *v;
+    int i;
+
+    for (i = 0; i < THREAD_OPS; i++)
+	do
+	    v = mcas_read(w);
+	while (!mcas(1, w, v, TO_WORD(FROM_WORD(v) + 1)));
+
+    return (NULL);
+}
+
+
+static int
+test_threads(void)
+{
+    pthread_t thr[NR_WORKERS];
+    void *w = TO_WORD(0);
+    int b, i;
+
+    for (b = 0; b < NR_BATCHES; b++) {
+	for (i = 0; i < NR_WORKERS; i++)
+	    pthread_create(&thr[i], NULL, short_lived, &w);
+	for (i = 0; i < NR_WORKERS; i++)
+	    pthread_join(thr[i], NULL);
+    }
+
+    printf("threads: %d threads, word is %lu of %lu\n",
+	   NR_BATCHES * NR_WORKERS, FROM_WORD(mcas_read(&w)),
+	   (unsigned long)NR_BATCHES * NR_WORKERS * THREAD_OPS);
+    if (FROM_WORD(mcas_read(&w)) !=
+	(unsigned long)NR_BATCHES * NR_WORKERS * THREAD_OPS) {
+	printf("threads: FAILED\n");
+	return (1);
+    }
+    return (0);
+}
+
+
+static void *
+skew_worker(void *arg)
+{
+    int me = (int)(long)arg & 1;
+    mcas_entry_t e[2];
+    unsigned long mine, other;
+
+    e[0].ptr = &counters[me].w;
+    e[1].ptr = &counters[!me].w;
+    for (;;) {
+	e[0].oldval = mcas_read(&counters[me].w);
+	e[1].oldval = e[1].newval = mcas_read(&counters[!me].w);
+	mine = FROM_WORD(e[0].oldval);
+	other = FROM_WORD(e[1].oldval);
+	if (mine + other >= SKEW_LIMIT)
+	    break;
+	e[0].newval = TO_WORD(mine + 1);
+	mcas_n(domain, 2, e, MCAS_COMPARE_ONLY);
+    }
+
+    return (NULL);
+}
+
+
+static int
+test_skew(void)
+{
+    pthread_t thr[NR_WORKERS];
+    unsigned long sum;
+    int i;
+
+    domain = mcas_init();
+    counters[0].w = counters[1].w = TO_WORD(0);
+
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&thr[i], NULL, skew_worker, (void *)(long)i);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(thr[i], NULL);
+
+    sum = FROM_WORD(mcas_read(&counters[0].w)) +
+	FROM_WORD(mcas_read(&counters[1].w));
+    printf("skew: counters %lu + %lu = %lu, limit %d\n",
+	   FROM_WORD(mcas_read(&counters[0].w)),
+	   FROM_WORD(mcas_read(&counters[1].w)), sum, SKEW_LIMIT);
+    if (sum != SKEW_LIMIT) {
+	printf("skew: FAILED\n");
+	return (1);
+    }
+    return (0);
+}
+
+
+static void
+crossed_yield(int sig)
+{
+    sched_yield();
+}
+
+
+static void *
+crossed_worker(void *arg)
+{
+    int me = (int)(long)arg;
+    unsigned long both = 0;
+    sigset_t alrm;
+    int i;
+
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_UNBLOCK, &alrm, NULL);
+
+    for (i = 0; i < CROSSED_ROUNDS; i++) {
+	pthread_barrier_wait(&crossed_barrier);
+	crossed_won[me] = mcas_n(domain, 2, crossed_e[me], MCAS_COMPARE_ONLY);
+	pthread_barrier_wait(&crossed_barrier);
+	if (me == 0) {
+	    if (crossed_won[0] && crossed_won[1])
+		both++;
+	    crossed[0].w = crossed[1].w = TO_WORD(0);
+	}
+    }
+
+    return ((void *)both);
+}
+
+
+/*
+ * Thread 0 writes word 1 while comparing word 0. Thread 1 writes word 0,
+ * and either compares word 1 (crossed) or writes it too (@overlap), in
+ * which case it takes word 0 first, as thread 0 compares it. Both start
+ * from zero, so at most one may succeed each round.
+ */
+static int
+test_crossed(int overlap)
+{
+    const char *name = overlap ? "overlap" : "crossed";
+    struct itimerval it = { { 0, 20 }, { 0, 20 } };
+    pthread_t thr[2];
+    sigset_t alrm;
+    void *both;
+    int i;
+
+    domain = mcas_init();
+    for (i = 0; i < 2; i++) {
+	crossed_e[i][0].ptr = &crossed[!i].w;
+	crossed_e[i][0].oldval = TO_WORD(0);
+	crossed_e[i][0].newval = TO_WORD(1);
+	crossed_e[i][1].ptr = &crossed[i].w;
+	crossed_e[i][1].oldval = TO_WORD(0);
+	crossed_e[i][1].newval = TO_WORD((overlap && i) ? 1 : 0);
+    }
+    crossed[0].w = crossed[1].w = TO_WORD(0);
+    pthread_barrier_init(&crossed_barrier, NULL, 2);
+
+    /* Only the workers take the timer's signals. */
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, NULL);
+    signal(SIGALRM, crossed_yield);
+    setitimer(ITIMER_REAL, &it, NULL);
+
+    for (i = 0; i < 2; i++)
+	pthread_create(&thr[i], NULL, crossed_worker, (void *)(long)i);
+    pthread_join(thr[0], &both);
+    pthread_join(thr[1], NULL);
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_REAL, &it, NULL);
+    signal(SIGALRM, SIG_IGN);
+    pthread_sigmask(SIG_UNBLOCK, &alrm, NULL);
+    signal(SIGALRM, SIG_DFL);
+    pthread_barrier_destroy(&crossed_barrier);
+
+    printf("%s: both succeeded in %lu of %d rounds\n", name,
+	   (unsigned long)both, CROSSED_ROUNDS);
+    if (both != NULL) {
+	printf("%s: FAILED\n", name);
+	return (1);
+    }
+    return (0);
+}
+
+
+static void *
+dcas_worker(void *arg)
+{
+    unsigned long r = (unsigned long)arg * 2654435761UL + 1;
+    mcas_entry_t e[4];
+    unsigned long v;
+    int i, n, p, q, done = 0;
+
+    while (done < DCAS_OPS) {
+	r = r * 6364136223846793005UL + 1442695040888963407UL;
+	p = (int)((r >> 33) % NR_PAIRS);
+	q = (int)((r >> 40) % NR_PAIRS);
+	/* Mostly within a pair; sometimes from one pair to another. */
+	n = (((r >> 50) & 3) && (p != q)) ? 4 : 2;
+	for (i = 0; i < n; i++) {
+	    e[i].ptr = &pairs[2 * ((i < 2) ? p : q) + (i & 1)];
+	    e[i].oldval = mcas_read(e[i].ptr);
+	}
+	for (i = 0; i < n; i++)
+	    e[i].newval = e[i].oldval;
+	v = FROM_WORD(e[0].oldval) / 4;
+	e[0].newval = TO_WORD(FROM_WORD(e[0].oldval) - v);
+	if (n == 2) {
+	    e[1].newval = TO_WORD(FROM_WORD(e[1].oldval) + v);
+	} else {
+	    e[2].newval = TO_WORD(FROM_WORD(e[2].oldval) + v / 2);
+	    e[3].newval = TO_WORD(FROM_WORD(e[3].oldval) + v - v / 2);
+	}
+	if (mcas_n(domain, n, e, 0))
+	    done++;
+    }
+
+    return (NULL);
+}
+
+
+static double
+dcas_rate(void **w)
+{
+    struct timespec t0, t1;
+    int i;
+
+    w[0] = w[1] = TO_WORD(0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < DCAS_OPS; i++)
+	mcas(2, &w[0], TO_WORD(i), TO_WORD(i + 1),
+	     &w[1], TO_WORD(i), TO_WORD(i + 1));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return (DCAS_OPS / ((t1.tv_sec - t0.tv_sec) +
+			(t1.tv_nsec - t0.tv_nsec) / 1e9) / 1e6);
+}
+
+
+static int
+test_dcas(void)
+{
+    pthread_t thr[NR_WORKERS];
+#ifdef CAS128
+    tagged_ptr_t top, snap, stale;
+#endif
+    unsigned long total = 0;
+    int i, rc = 0;
+
+    domain = mcas_init();
+    for (i = 0; i < 2 * NR_PAIRS; i++)
+	pairs[i] = TO_WORD(BANK_START);
+
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&thr[i], NULL, dcas_worker, (void *)(long)i);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(thr[i], NULL);
+
+    for (i = 0; i < 2 * NR_PAIRS; i++)
+	total += FROM_WORD(mcas_read_barrier(&pairs[i]));
+    printf("dcas: total %lu of %lu\n", total,
+	   (unsigned long)2 * NR_PAIRS * BANK_START);
+    if (total != (unsigned long)2 * NR_PAIRS * BANK_START)
+	rc = 1;
+
+    printf("dcas: %.2f M/s in one unit, %.2f M/s across units\n",
+	   dcas_rate(&pairs[0]), dcas_rate(&pairs[1]));
+    if ((FROM_WORD(pairs[0]) != DCAS_OPS) ||
+	(FROM_WORD(pairs[2]) != DCAS_OPS))
+	rc = 1;
+
+#ifdef CAS128
+    /* A stale snapshot must fail, even though the pointer is unchanged. */
+    top.s.ptr = NULL;
+    top.s.tag = 0;
+    tagged_ptr_read(&top, stale);
+    tagged_ptr_read(&top, snap);
+    if (!tagged_ptr_cas(&top, snap, &top))
+	rc = 1;
+    tagged_ptr_read(&top, snap);
+    if (!tagged_ptr_cas(&top, snap, NULL) ||
+	tagged_ptr_cas(&top, stale, &top) || (top.s.tag != 2))
+	rc = 1;
+#endif
+
+    if (rc)
+	printf("dcas: FAILED\n");
+    return (rc);
+}
+
+
+static int
+test_cm(void)
+{
+    static const char *names[] = { "help", "backoff", "wait", "age" };
+    pthread_t workers[NR_WORKERS];
+    struct timespec t0, t1;
+    mcas_config_t cfg;
+    unsigned long total;
+    double secs;
+    int i, p, rc = 0;
+
+    for (p = MCAS_CM_HELP; p <= MCAS_CM_AGE; p++) {
+	mcas_config_init(&cfg);
+	cfg.cm_policy = p;
+	domain = mcas_init_config(&cfg);
+	for (i = 0; i < NR_ACCOUNTS; i++)
+	    accounts[i] = TO_WORD(BANK_START);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < NR_WORKERS; i++)
+	    pthread_create(&workers[i], NULL, bank_worker, (void *)(long)i);
+	for (i = 0; i < NR_WORKERS; i++)
+	    pthread_join(workers[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	total = 0;
+	for (i = 0; i < NR_ACCOUNTS; i++)
+	    total += FROM_WORD(mcas_read_barrier(&accounts[i]));
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("cm: %-7s %.2f M/s, total %lu of %lu\n", names[p],
+	       NR_WORKERS * BANK_OPS / secs / 1e6, total,
+	       (unsigned long)NR_ACCOUNTS * BANK_START);
+	if (total != (unsigned long)NR_ACCOUNTS * BANK_START) {
+	    printf("cm: FAILED\n");
+	    rc = 1;
+	}
+    }
+
+    return (rc);
+}
+
+
+static void *
+snapshot_reader(void *arg)
+{
+    void **ptrs[NR_ACCOUNTS], *vals[NR_ACCOUNTS];
+    unsigned long snaps = 0, total;
+    int i;
+
+    for (i = 0; i < NR_ACCOUNTS; i++)
+	ptrs[i] = &accounts[i];
+
+    while (!stop) {
+	mcas_read_n(NR_ACCOUNTS, ptrs, vals);
+	total = 0;
+	for (i = 0; i < NR_ACCOUNTS; i++)
+	    total += FROM_WORD(vals[i]);
+	if (total != (unsigned long)NR_ACCOUNTS * BANK_START) {
+	    printf("snapshot: FAILED, snapshot total %lu\n", total);
+	    abort();
+	}
+	snaps++;
+    }
+
+    return ((void *)snaps);
+}
+
+
+static int
+test_snapshot(void)
+{
+    pthread_t workers[NR_WORKERS], readers[NR_READERS];
+    unsigned long snaps = 0;
+    void *r;
+    int i;
+
+    domain = mcas_init();
+    for (i = 0; i < NR_ACCOUNTS; i++)
+	accounts[i] = TO_WORD(BANK_START);
+
+    stop = 0;
+    for (i = 0; i < NR_READERS; i++)
+	pthread_create(&readers[i], NULL, snapshot_reader, NULL);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_create(&workers[i], NULL, bank_worker, (void *)(long)i);
+    for (i = 0; i < NR_WORKERS; i++)
+	pthread_join(workers[i], NULL);
+    stop = 1;
+    for (i = 0; i < NR_READERS; i++) {
+	pthread_join(readers[i], &r);
+	snaps += (unsigned long)r;
+    }
+
+    printf("snapshot: %lu consistent snapshots of %d words\n", snaps,
+	   NR_ACCOUNTS);
+    return (0);
+}
+
+
+/* Millions of MCASes of width @n per second, over words spaced apart. */
+static double
+width_rate(mcas_entry_t *e, int n, int flags)
+{
+    struct timespec t0, t1;
+    int i, j, ops = WIDTH_WORDS / n;
+
+    for (i = 0; i < n; i++)
+	*e[i].ptr = e[i].oldval = TO_WORD(0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (j = 0; j < ops; j++) {
+	for (i = 0; i < n; i++)
+	    e[i].newval = TO_WORD(j + 1);
+	if (!mcas_n(domain, n, e, flags))
+	    return (0);
+	for (i = 0; i < n; i++)
+	    e[i].oldval = e[i].newval;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    return (ops / ((t1.tv_sec - t0.tv_sec) +
+		   (t1.tv_nsec - t0.tv_nsec) / 1e9) / 1e6);
+}
+
+
+static int
+test_width(void)
+{
+    static void *w[2 * MAX_WIDTH];
+    mcas_entry_t e[MAX_WIDTH], sorted[MAX_WIDTH];
+    unsigned long r = 1;
+    mcas_entry_t tmp;
+    double unsorted_rate, sorted_rate;
+    int i, j, n, rc = 0;
+
+    domain = mcas_init();
+
+    /* Every other word, so that no two share a CAS128 unit. */
+    for (i = 0; i < MAX_WIDTH; i++)
+	sorted[i].ptr = &w[2 * i];
+
+    for (n = 2; n <= MAX_WIDTH; n *= 2) {
+	memcpy(e, sorted, n * sizeof(*e));
+	for (i = n - 1; i > 0; i--) {
+	    r = r * 6364136223846793005UL + 1442695040888963407UL;
+	    j = (int)((r >> 33) % (i + 1));
+	    tmp = e[i];
+	    e[i] = e[j];
+	    e[j] = tmp;
+	}
+	unsorted_rate = width_rate(e, n, 0);
+	sorted_rate = width_rate(sorted, n, MCAS_SORTED);
+	printf("width: %3d words, %.3f M/s unsorted, %.3f M/s sorted\n",
+	       n, unsorted_rate, sorted_rate);
+	if ((unsorted_rate == 0) || (sorted_rate == 0))
+	    rc = 1;
+    }
+
+    /* e[] is still shuffled, and still matches; name one word twice. */
+    e[MAX_WIDTH / 3].ptr = e[2 * MAX_WIDTH / 3].ptr;
+    e[MAX_WIDTH / 3].oldval = e[2 * MAX_WIDTH / 3].oldval;
+    if (mcas_n(domain, MAX_WIDTH, e, 0)) {
+	printf("width: FAILED, wide MCAS naming a word twice succeeded\n");
+	rc = 1;
+    }
+
+    if (rc)
+	printf("width: FAILED\n");
+    return (rc);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int rc = 0, ran = 0;
+
+    if ((argc < 2) || !strcmp(argv[1], "basic")) {
+	rc |= test_basic();
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "bank")) {
+	rc |= test_bank();
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "threads")) {
+	rc |= test_threads();
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "skew")) {
+	rc |= test_skew();
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "crossed")) {
+	rc |= test_crossed(0);
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "overlap")) {
+	rc |= test_crossed(1);
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "dcas")) {
+	rc |= test_dcas();
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "cm")) {
+	rc |= test_cm();
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "snapshot")) {
+	rc |= test_snapshot();
+	ran = 1;
+    }
+    if ((argc < 2) || !strcmp(argv[1], "width")) {
+	rc |= test_width();
+	ran = 1;
+    }
+    if (!ran) {
+	fprintf(stderr, "usage: %s [basic | bank | threads | skew | crossed | "
+		"overlap | dcas | cm | snapshot | width]\n", argv[0]);
+	return (2);
+    }
+
+    return (rc);
+}
@@ -0,0 +1,151 @@
+#ifndef __OSI_MCAS_H
+#define __OSI_MCAS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Multi-word compare-and-swap, as described in "A Practical Multi-Word
+ * Compare-and-Swap Operation" (Harris, Fraser and Pratt, DISC 2002).
+ *
+ * Words updated by MCAS are claimed by writing marked pointers to
+ * descriptors into them, so they must be read with mcas_read() or
+ * mcas_read_barrier(), and their values must keep bit 1 clear. Bit 0 is
+ * left to the caller (eg. for its own marks). Values with bit 1 set are
+ * owned by an MCAS in progress; MCAS_IS_OWNED() tells them apart.
+ */
+#define MCAS_IS_OWNED(_v) (((unsigned long)(_v)) & 2)
+
+/*
+ * Descriptors are reclaimed by the epoch GC (gc.h), in a GC domain of
+ * their own, which MCAS enters and leaves itself. Each thread using MCAS
+ * takes a process-wide id, which it hands back on exit for the next
+ * thread to reuse, so any number of threads may use MCAS over time, but
+ * at most MAX_THREADS at once.
+ */
+typedef struct mcas_domain_st mcas_domain_t;
+
+/*
+ * Contention policies: what an MCAS does on finding a word it needs owned
+ * by another MCAS in progress. MCAS_CM_HELP helps the owner at once.
+ * MCAS_CM_BACKOFF first retries after exponentially growing delays, and
+ * helps once the delay reaches its limit. MCAS_CM_WAIT gives the owner a
+ * while to finish before helping. MCAS_CM_AGE aborts the owner if it
+ * started later, and otherwise helps it; an aborted MCAS starts again,
+ * keeping its age, so the oldest always gets through.
+ */
+#define MCAS_CM_HELP    0
+#define MCAS_CM_BACKOFF 1
+#define MCAS_CM_WAIT    2
+#define MCAS_CM_AGE     3
+
+/*
+ * Per-domain configuration. Fill in defaults with mcas_config_init() and
+ * override individual fields before creating the domain.
+ */
+typedef struct mcas_config_st {
+    int cm_policy;               /* MCAS_CM_*                         */
+    unsigned int backoff_min;    /* BACKOFF: first delay, in pauses   */
+    unsigned int backoff_max;    /* BACKOFF: delay at which to help   */
+    unsigned int help_delay;     /* WAIT: pauses to wait before helping */
+} mcas_config_t;
+
+void mcas_config_init(mcas_config_t *);
+
+
+/*
+ * Use @cfg, in place of mcas_config_init()'s defaults, for domains created
+ * by mcas_init(), including the one behind mcas(). Call it before any of
+ * them is created.
+ */
+void mcas_set_default_config(const mcas_config_t *);
+
+mcas_domain_t *mcas_init(void);
+mcas_domain_t *mcas_init_config(const mcas_config_t *);
+
+/* One word of an MCAS: replace @oldval at @ptr with @newval. */
+typedef struct mcas_entry_st {
+    void **ptr;
+    void *oldval;
+    void *newval;
+} mcas_entry_t;
+
+/* Entries are already sorted by address, without duplicates. */
+#define MCAS_SORTED       0x1
+/*
+ * Entries whose old and new values are equal are compare-only: their
+ * words are checked once the rest are held, and again just before the
+ * MCAS commits, but are never claimed, so concurrent readers and other
+ * compare-only users of them are not disturbed. A compare-only word
+ * owned by another MCAS still in progress is settled first: whichever of
+ * the two is the younger is aborted, and retried. A compare-only word
+ * which changes and changes back between the checks goes unnoticed.
+ */
+#define MCAS_COMPARE_ONLY 0x2
+
+/*
+ * Atomically replace each entry's old value with its new one, if every
+ * word still holds its old value. Returns non-zero on success. Unless
+ * MCAS_SORTED is given, entries are sorted into address order first, and
+ * the operation fails if two of them name the same word. @e is not
+ * modified, and is not referenced once mcas_n() returns. Where CAS128 is
+ * available, two words sharing an aligned 16-byte unit are updated with
+ * it directly, unless one of them is owned by an MCAS.
+ */
+int mcas_n(mcas_domain_t *, int n, mcas_entry_t *e, int flags);
+
+/*
+ * As mcas_n(), with @n (ptr, old, new) triples as arguments, in a domain
+ * shared by all callers of mcas(), with the default configuration.
+ */
+int mcas(int n, void **ptr, void *old, void *new_, ...);
+
+/*
+ * Read an MCAS-managed word. mcas_read() returns its logical value
+ * without disturbing an operation in progress. mcas_read_barrier() helps
+ * any such operation to finish, then returns the word's new contents.
+ * mcas_fixup() helps the operation which owned @ptr when @seen was read
+ * from it, and returns zero if @seen was not owned by one.
+ */
+void *mcas_read(void **ptr);
+void *mcas_read_barrier(void **ptr);
+int mcas_fixup(void **ptr, void *seen);
+
+/*
+ * Read @n MCAS-managed words into @out, as they all stood at one moment.
+ * Collects the words' logical values twice, as mcas_read() does, until
+ * both collects agree; only if they do not are operations found in
+ * progress helped to finish. A word which changes and changes back
+ * between the collects goes unnoticed.
+ */
+void mcas_read_n(int n, void **ptrs[], void *out[]);
+
+/*
+ * Statistics, summed over every thread which has used MCAS. They are kept
+ * per thread, without shared atomics, only when the library is built
+ * with MCAS_STATS; otherwise they are all zero. Counters are read without
+ * stopping their threads, so while MCAS is busy they are a close snapshot,
+ * not an exact one. lengths[i] counts MCASes of width up to 2^i, and
+ * more than half that; the last bucket takes everything wider.
+ */
+#define MCAS_STATS_LENGTHS 8
+
+typedef struct mcas_stats_st {
+    unsigned long successes;   /* MCASes which succeeded                */
+    unsigned long failures;    /* ... and which failed                  */
+    unsigned long fast_path;   /* ... of either, done by a single CAS128 */
+    unsigned long helps;       /* other MCASes helped                   */
+    unsigned long retries;     /* restarts of acquisition after helping */
+    unsigned long aborts;      /* MCASes restarted after MCAS_CM_AGE    */
+    unsigned long owned_reads; /* reads which found a word owned        */
+    unsigned long lengths[MCAS_STATS_LENGTHS];
+} mcas_stats_t;
+
+void mcas_get_stats(mcas_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OSI_MCAS_H */
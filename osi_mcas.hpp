@@ -0,0 +1,161 @@
+#ifndef __OSI_MCAS_HPP
+#define __OSI_MCAS_HPP
+
+/*
+ * Typed C++17 layer over osi_mcas.h. Header-only.
+ *
+ * mcas_word<T> is an MCAS-managed word holding a T. Its loads always go
+ * through mcas_read_barrier(), so an owned word is never seen. T must be
+ * trivially copyable and pointer-sized; pointers must be to object types
+ * aligned to at least 4 bytes (so not void *), leaving clear bit 1, which
+ * MCAS uses, and bit 0, which is the caller's. Other values are checked
+ * when stored, in debug builds.
+ *
+ * mcas_txn<N> gathers up to N updates (and compare-only checks) on the
+ * stack, and commits them with one call to mcas_n().
+ *
+ *  osi_mcas::mcas_word<node *> head, tail;
+ *  osi_mcas::mcas_txn<2> txn;
+ *  txn.update(head, h, n).update(tail, t, n);
+ *  if (txn.commit()) ...
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "osi_mcas.h"
+
+namespace osi_mcas {
+
+/* The domain used when none is given, created on first use. */
+inline mcas_domain_t *default_domain()
+{
+    static mcas_domain_t *d = mcas_init();
+    return d;
+}
+
+template <typename T>
+class mcas_word {
+    static_assert(sizeof(T) == sizeof(void *),
+                  "MCAS words must be pointer-sized");
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "MCAS words must be trivially copyable");
+
+    static constexpr bool pointee_aligned()
+    {
+        if constexpr (std::is_pointer_v<T>) {
+            using P = std::remove_pointer_t<T>;
+            if constexpr (std::is_void_v<P> || std::is_function_v<P>)
+                return false;
+            else
+                return alignof(P) >= 4;
+        } else {
+            return true;
+        }
+    }
+    static_assert(pointee_aligned(),
+                  "MCAS pointers must be to types aligned to 4 bytes");
+
+    void *w_;
+
+public:
+    using value_type = T;
+
+    static void *to_word(T v)
+    {
+        void *w;
+        std::memcpy(&w, &v, sizeof(w));
+        assert(!MCAS_IS_OWNED(w));
+        return w;
+    }
+
+    static T from_word(void *w)
+    {
+        T v;
+        std::memcpy(&v, &w, sizeof(v));
+        return v;
+    }
+
+    explicit mcas_word(T v = T()) : w_(to_word(v)) { }
+    mcas_word(const mcas_word &) = delete;
+    mcas_word &operator=(const mcas_word &) = delete;
+
+    T load() const
+    {
+        return from_word(mcas_read_barrier(const_cast<void **>(&w_)));
+    }
+    operator T() const { return load(); }
+
+    /* Single-word MCAS. */
+    bool compare_exchange(T oldval, T newval,
+                          mcas_domain_t *d = default_domain())
+    {
+        mcas_entry_t e = { &w_, to_word(oldval), to_word(newval) };
+        return mcas_n(d, 1, &e, 0);
+    }
+
+    /* For passing to the C API. */
+    void **raw() { return &w_; }
+};
+
+template <std::size_t N>
+class mcas_txn {
+    static_assert(N > 0, "an MCAS needs at least one word");
+
+    mcas_entry_t   e_[N];
+    int            n_ = 0;
+    int            flags_ = 0;
+    mcas_domain_t *d_;
+
+    mcas_txn &add(void **ptr, void *oldval, void *newval)
+    {
+        assert(n_ < static_cast<int>(N));
+        e_[n_].ptr    = ptr;
+        e_[n_].oldval = oldval;
+        e_[n_].newval = newval;
+        n_++;
+        return *this;
+    }
+
+public:
+    explicit mcas_txn(mcas_domain_t *d = default_domain()) : d_(d) { }
+
+    /* Replace @oldval in @w with @newval. */
+    template <typename T>
+    mcas_txn &update(mcas_word<T> &w,
+                     typename mcas_word<T>::value_type oldval,
+                     typename mcas_word<T>::value_type newval)
+    {
+        return add(w.raw(), mcas_word<T>::to_word(oldval),
+                   mcas_word<T>::to_word(newval));
+    }
+
+    /* Require @w to hold @val, without claiming it (MCAS_COMPARE_ONLY). */
+    template <typename T>
+    mcas_txn &compare(mcas_word<T> &w, typename mcas_word<T>::value_type val)
+    {
+        void *v = mcas_word<T>::to_word(val);
+        flags_ |= MCAS_COMPARE_ONLY;
+        return add(w.raw(), v, v);
+    }
+
+    /*
+     * Commit the entries gathered so far; pass MCAS_SORTED if they were
+     * added in address order. The entries are kept, for clear() or reuse.
+     */
+    bool commit(int flags = 0)
+    {
+        return mcas_n(d_, n_, e_, flags | flags_);
+    }
+
+    void clear() { n_ = 0; flags_ = 0; }
+    std::size_t size() const { return n_; }
+    static constexpr std::size_t capacity() { return N; }
+};
+
+} /* namespace osi_mcas */
+
+#endif /* __OSI_MCAS_HPP */
@@ -7,21 +7,71 @@
 #include <osi/osi_includes.h>
 #include <osi/osi_types.h>
 #endif
+#include <stdlib.h>
 #include "osi_mcas_obj_cache.h"
 #include "internal.h"
 #include "random.h"
 #include "ptst.h"
 
+struct osi_mcas_obj_cache_st {
+    gc_global_t *gc_global;
+    int gc_id;
+    osi_mcas_obj_ctor_t ctor;
+    osi_mcas_obj_dtor_t dtor;
+    void *arg;
+    VOLATILE unsigned long nr_constructed;
+};
+
+/* Called by the collector on each block it carves for the cache. */
+static void
+obj_construct(void *obj, void *arg)
+{
+    osi_mcas_obj_cache_t cache = arg;
+
+    if (cache->ctor != NULL)
+	cache->ctor(obj, cache->arg);
+    ADD_TO(cache->nr_constructed, 1);
+}
+
+static void
+obj_destruct(void *obj, void *arg)
+{
+    osi_mcas_obj_cache_t cache = arg;
+
+    cache->dtor(obj, cache->arg);
+}
+
 void
-osi_mcas_obj_cache_create(gc_global_t *gc_global,
+osi_mcas_obj_cache_create_ctor(gc_global_t *gc_global,
 	osi_mcas_obj_cache_t * gc_id, size_t size,
-	const char *tag)
+	const char *tag, osi_mcas_obj_ctor_t ctor,
+	osi_mcas_obj_dtor_t dtor, void *arg)
 {
+    osi_mcas_obj_cache_t cache;
+
     SUBSYS_LOG_MACRO(7,
-	    ("osi_mcas_obj_cache_create: size, adjsize %d\n", size,
-	     size + sizeof(int *)));
+	    ("osi_mcas_obj_cache_create: size %d\n", size));
 
-    *(int *)gc_id = gc_add_allocator(gc_global, size + sizeof(int *), tag);
+    cache = malloc(sizeof(*cache));
+    if (cache == NULL)
+	abort();
+    cache->gc_global = gc_global;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->arg = arg;
+    cache->nr_constructed = 0;
+    cache->gc_id = gc_add_allocator_ctor(gc_global, size, tag,
+					 obj_construct, cache);
+    *gc_id = cache;
+}
+
+void
+osi_mcas_obj_cache_create(gc_global_t *gc_global,
+	osi_mcas_obj_cache_t * gc_id, size_t size,
+	const char *tag)
+{
+    osi_mcas_obj_cache_create_ctor(gc_global, gc_id, size, tag,
+				   NULL, NULL, NULL);
 }
 
 void *
@@ -30,14 +80,14 @@ osi_mcas_obj_cache_alloc_critical(ptst_t *ptst, osi_mcas_obj_cache_t gc_id)
     gc_global_t *gc_global = ptst->gc->global;
     void *obj;
 
-    obj = (void *)gc_alloc(ptst, gc_id);
+    obj = (void *)gc_alloc(ptst, gc_id->gc_id);
 
     SUBSYS_LOG_MACRO(11,
 			("GC: osi_mcas_obj_cache_alloc: block of size %d "
 			 "%p (%s)\n",
-			 gc_get_blocksize(gc_global, gc_id),
+			 gc_get_blocksize(gc_global, gc_id->gc_id),
 			 obj,
-			 gc_get_tag(gc_global, gc_id)));
+			 gc_get_tag(gc_global, gc_id->gc_id)));
 
     return (obj);
 }
@@ -50,7 +100,6 @@ osi_mcas_obj_cache_alloc(gc_global_t *gc_global, osi_mcas_obj_cache_t gc_id)
 
     ptst = critical_enter(gc_global);
     obj = osi_mcas_obj_cache_alloc_critical(ptst, gc_id);
-    obj = (void *)gc_alloc(ptst, gc_id);
     critical_exit(ptst);
 
     return (obj);
@@ -64,11 +113,11 @@ osi_mcas_obj_cache_free_critical(ptst_t *ptst, osi_mcas_obj_cache_t gc_id, void
     SUBSYS_LOG_MACRO(11,
 			("GC: osi_mcas_obj_cache_free: block of size %d "
 			 "%p (%s)\n",
-			 gc_get_blocksize(gc_global, gc_id),
+			 gc_get_blocksize(gc_global, gc_id->gc_id),
 			 obj,
-			 gc_get_tag(gc_global, gc_id)));
+			 gc_get_tag(gc_global, gc_id->gc_id)));
 
-    gc_free(ptst, (void *)obj, gc_id);
+    gc_free(ptst, (void *)obj, gc_id->gc_id);
 }
 
 void
@@ -81,10 +130,32 @@ osi_mcas_obj_cache_free(gc_global_t *gc_global, osi_mcas_obj_cache_t gc_id, void
     critical_exit(ptst);
 }
 
+void
+osi_mcas_obj_cache_get_stats(osi_mcas_obj_cache_t gc_id,
+	osi_mcas_obj_cache_stats_t *out)
+{
+    gc_size_stats_t ss;
+
+    gc_get_size_stats(gc_id->gc_global, gc_id->gc_id, &ss);
+    out->size = ss.blk_size;
+    out->allocated = ss.allocated;
+    out->freed = ss.freed;
+    out->constructed = gc_id->nr_constructed;
+    out->reserved = ss.reserved;
+}
+
 void
 osi_mcas_obj_cache_destroy(osi_mcas_obj_cache_t gc_id)
 {
-    /* TODO:  implement, will need to implement gc_remove_allocator and related
-     * modifications in gc.c */
-    return;
+    gc_remove_allocator(gc_id->gc_global, gc_id->gc_id);
+
+    /*
+     * The collector never gives blocks back, so only the objects go, once
+     * readers which may still hold those freed last have moved on.
+     */
+    if (gc_id->dtor != NULL) {
+	gc_synchronize(gc_id->gc_global);
+	gc_for_each_block(gc_id->gc_global, gc_id->gc_id, obj_destruct, gc_id);
+    }
+    free(gc_id);
 }
@@ -1,4 +1,3 @@
-
 #ifndef __OSI_MCAS_OBJ_CACHE_H
 #define __OSI_MCAS_OBJ_CACHE_H
 
@@ -9,13 +8,28 @@
 extern "C" {
 #endif
 
-typedef int osi_mcas_obj_cache_t;
+typedef struct osi_mcas_obj_cache_st *osi_mcas_obj_cache_t;
+
+/*
+ * Object constructor and destructor. The constructor is run once on each
+ * object, when it enters the cache, and the destructor once, when it
+ * leaves; in between, objects are handed out and must be freed in their
+ * constructed state (eg. with their mutexes initialised and unlocked).
+ */
+typedef void (*osi_mcas_obj_ctor_t)(void *obj, void *arg);
+typedef void (*osi_mcas_obj_dtor_t)(void *obj, void *arg);
 
 /* Create a new MCAS GC pool, and return its identifier, which
  * follows future calls */
 void osi_mcas_obj_cache_create(gc_global_t *, osi_mcas_obj_cache_t *,
 	size_t size, const char *tag);	/* alignment? */
 
+/* As above, with a constructor and destructor (either may be NULL),
+ * which are passed arg */
+void osi_mcas_obj_cache_create_ctor(gc_global_t *, osi_mcas_obj_cache_t *,
+	size_t size, const char *tag, osi_mcas_obj_ctor_t ctor,
+	osi_mcas_obj_dtor_t dtor, void *arg);
+
 /* Allocate an object from the pool identified by
  * gc_id */
 void *osi_mcas_obj_cache_alloc(gc_global_t *, osi_mcas_obj_cache_t);
@@ -24,9 +38,23 @@ void *osi_mcas_obj_cache_alloc_critical(ptst_t *, osi_mcas_obj_cache_t);
 /* Release object obj to its GC pool, identified by
  * gc_id */
 void osi_mcas_obj_cache_free(gc_global_t *, osi_mcas_obj_cache_t, void *);
-void osi_mcas_obj_cache_free_alloc(ptst_t *, osi_mcas_obj_cache_t, void *);
+void osi_mcas_obj_cache_free_critical(ptst_t *, osi_mcas_obj_cache_t, void *);
+
+/* Per-cache statistics */
+typedef struct osi_mcas_obj_cache_stats_st {
+    int size;			/* object size */
+    unsigned long allocated;	/* objects handed out */
+    unsigned long freed;	/* ... and freed */
+    unsigned long constructed;	/* objects which have entered the cache */
+    unsigned long reserved;	/* bytes taken from the heap */
+} osi_mcas_obj_cache_stats_t;
+
+void osi_mcas_obj_cache_get_stats(osi_mcas_obj_cache_t,
+	osi_mcas_obj_cache_stats_t *);
 
-/* Terminate an MCAS GC pool */
+/* Terminate an MCAS GC pool. Every object must have been freed, and
+ * the destructor is run on each after a grace period, so the caller must
+ * not be in a critical region. The memory stays with the domain. */
 void osi_mcas_obj_cache_destroy(osi_mcas_obj_cache_t gc_id);
 
 #ifdef __cplusplus
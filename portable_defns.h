@@ -67,6 +67,10 @@ extern "C" {
 #define MB_NEAR_CAS()  MB()
 #endif
 
+#ifndef CPU_RELAX
+#define CPU_RELAX() MB()
+#endif
+
 typedef unsigned long int_addr_t;
 
 #define FALSE 0
@@ -152,6 +156,39 @@ do {                                                                     \
 #define get_unmarked_ref(_p)    ((void *)(((unsigned long)(_p)) & ~1))
 #define is_marked_ref(_p)       (((unsigned long)(_p)) & 1)
 
+/*
+ * TAGGED POINTERS
+ *
+ * A pointer paired with a counter that every update bumps, so that a CAS
+ * from a stale snapshot fails even if the pointer has since come back
+ * (ABA). Both halves are updated as one by CAS128, where it exists. A
+ * snapshot is read with two plain loads and may be torn, in which case
+ * the CAS made from it fails and the caller goes round again.
+ */
+
+#ifdef CAS128
+
+typedef union {
+    struct { void *ptr; unsigned long tag; } s;
+    _u128 w;
+} tagged_ptr_t;
+
+#define tagged_ptr_read(_a, _t)                                         \
+do {                                                                    \
+    (_t).s.tag = ((volatile tagged_ptr_t *)(_a))->s.tag;                \
+    (_t).s.ptr = ((volatile tagged_ptr_t *)(_a))->s.ptr;                \
+} while ( 0 )
+
+/* Replace snapshot @_o at @_a with pointer @_p. Non-zero on success. */
+#define tagged_ptr_cas(_a, _o, _p)                                      \
+({ tagged_ptr_t __t;                                                    \
+   __t.s.ptr = (_p);                                                    \
+   __t.s.tag = (_o).s.tag + 1;                                          \
+   CAS128(&(_a)->w, (_o).w, __t.w) == (_o).w;                           \
+})
+
+#endif /* CAS128 */
+
 
 /*
  * SUPPORT FOR WEAK ORDERING OF MEMORY ACCESSES
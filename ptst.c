@@ -34,87 +34,365 @@ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "portable_defns.h"
 #include "random.h"
 #include "gc.h"
 #include "ptst.h"
 #include "internal.h"
 
+/*
+ * Per-thread cache of the ptst for the most recently entered domain. A
+ * thread using several domains falls back to pthread_getspecific().
+ */
+static __thread struct {
+    gc_global_t  *gc_global;
+    unsigned long domain_id;
+    ptst_t       *ptst;
+} ptst_cache;
+
+static VOLATILE unsigned long next_domain_id;
+
+unsigned int gc_pid;
+
+/*
+ * Thread-specific data keys belong to a process, so those of shared
+ * domains are kept here rather than in the domain. Entries are added and
+ * removed as domains are attached and detached, under shared_keys_lock.
+ */
+typedef struct shared_key_st shared_key_t;
+struct shared_key_st
+{
+    gc_global_t  *gc_global;
+    pthread_key_t key;
+    shared_key_t *next;
+};
+static shared_key_t * VOLATILE shared_keys;
+static pthread_mutex_t shared_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ptst_once = PTHREAD_ONCE_INIT;
+
+static pthread_key_t ptst_key(gc_global_t *gc_global)
+{
+    shared_key_t *sk;
+
+    if ( !IS_SHARED(gc_global) ) return(gc_global->ptst_key);
+    for ( sk = shared_keys; sk->gc_global != gc_global; sk = sk->next )
+        continue;
+    return(sk->key);
+}
+
+ptst_t *ptst_self(gc_global_t *gc_global)
+{
+    return (ptst_t *)pthread_getspecific(ptst_key(gc_global));
+}
+
 ptst_t *ptst_first(gc_global_t *gc_global)
 {
     return _ptst_first(gc_global);
 }
 
-ptst_t *critical_enter(gc_global_t *gc_global)
+/*
+ * Pop a released ptst. Taking the whole stack makes us the only popper of
+ * its contents, which rules out ABA; the remainder is pushed back.
+ */
+static ptst_t *ptst_pop_free(gc_global_t *gc_global)
+{
+    ptst_t *ptst, *new_ptst;
+
+    if ( gc_global->ptst_free == NULL ) return(NULL);
+
+    /*
+     * With one popper at a time, the top cannot be popped and pushed back
+     * under us (ABA), so it may be taken on its own; pushers need no lock.
+     */
+    while ( CASIO(&gc_global->ptst_free_lock, 0, gc_pid) != 0 )
+        while ( gc_global->ptst_free_lock ) continue;
+    new_ptst = gc_global->ptst_free;
+    do {
+        if ( (ptst = new_ptst) == NULL ) break;
+    }
+    while ( (new_ptst = CASPO(&gc_global->ptst_free, ptst,
+                              ptst->free_next)) != ptst );
+    WMB();
+    gc_global->ptst_free_lock = 0;
+
+    if ( ptst != NULL ) ptst->count = 1;
+    return(ptst);
+}
+
+static void ptst_push_free(gc_global_t *gc_global, ptst_t *ptst)
+{
+    ptst_t *top, *new_top = gc_global->ptst_free;
+
+    do {
+        ptst->free_next = top = new_top;
+        WMB_NEAR_CAS();
+    }
+    while ( (new_top = CASPO(&gc_global->ptst_free, top, ptst)) != top );
+}
+
+/* Take a ptst from the domain's pool, creating one if the pool is empty. */
+static ptst_t *ptst_get(gc_global_t *gc_global)
 {
     ptst_t *ptst, *next, *new_next;
 #ifdef NEED_ID
     unsigned int id, oid;
 #endif
 
-    ptst = (ptst_t *)pthread_getspecific(gc_global->ptst_key);
+    ptst = ptst_pop_free(gc_global);
+
     if ( ptst == NULL )
     {
-        for ( ptst = _ptst_first(gc_global); ptst != NULL; ptst = ptst_next(ptst) )
-        {
-            if ( (ptst->count == 0) && (CASIO(&ptst->count, 0, 1) == 0) )
-            {
-                break;
-            }
-        }
-
-        if ( ptst == NULL )
-        {
-            ptst = ALIGNED_ALLOC(sizeof(*ptst));
-            if ( ptst == NULL ) exit(1);
-            memset(ptst, 0, sizeof(*ptst));
-            ptst->gc = gc_init(gc_global);
-            rand_init(ptst);
-            ptst->count = 1;
+        ptst = gc_shared_alloc(gc_global, sizeof(*ptst));
+        if ( ptst == NULL ) exit(1);
+        memset(ptst, 0, sizeof(*ptst));
+        ptst->gc = gc_init(gc_global);
+        rand_init(ptst);
+        ptst->count = 1;
 #ifdef NEED_ID
-            id = gc_global->next_id;
-            while ( (oid = CASIO(&gc_global->next_id, id, id+1)) != id ) id = oid;
-            ptst->id = id;
+        id = gc_global->next_id;
+        while ( (oid = CASIO(&gc_global->next_id, id, id+1)) != id ) id = oid;
+        ptst->id = id;
 #endif
-            new_next = gc_global->ptst_list;
-            do {
-                ptst->next = next = new_next;
-                WMB_NEAR_CAS();
-            }
-            while ( (new_next = CASPO(&gc_global->ptst_list, next, ptst)) != next );
+        new_next = gc_global->ptst_list;
+        do {
+            ptst->next = next = new_next;
+            WMB_NEAR_CAS();
         }
+        while ( (new_next = CASPO(&gc_global->ptst_list, next, ptst)) != next );
+    }
+
+    ptst->thread = pthread_self();
+    ptst->pid    = gc_pid;
+    return(ptst);
+}
 
-        pthread_setspecific(gc_global->ptst_key, ptst);
+
+/* Hand back a ptst's chunks and garbage, and return it to the pool. */
+static void ptst_put(ptst_t *ptst)
+{
+    gc_global_t *gc_global = ptst->gc->global;
+
+    gc_flush(ptst->gc);
+    ptst->qsbr  = 0;
+    WMB();
+    ptst->count = 0;
+    ptst_push_free(gc_global, ptst);
+}
+
+
+ptst_t *critical_enter(gc_global_t *gc_global)
+{
+    ptst_t *ptst;
+
+    if ( (ptst_cache.gc_global == gc_global) &&
+         (ptst_cache.domain_id == gc_global->domain_id) )
+    {
+        ptst = ptst_cache.ptst;
+        gc_enter(ptst);
+        return(ptst);
     }
 
+    ptst = ptst_self(gc_global);
+    if ( ptst == NULL )
+    {
+        ptst = ptst_get(gc_global);
+        pthread_setspecific(ptst_key(gc_global), ptst);
+    }
+
+    ptst_cache.gc_global = gc_global;
+    ptst_cache.domain_id = gc_global->domain_id;
+    ptst_cache.ptst      = ptst;
+
+    gc_enter(ptst);
+    return(ptst);
+}
+
+
+/*
+ * A guard is a ptst bound to no thread, held inside a critical region
+ * until released. Reclaimers see it as one more thread.
+ */
+gc_guard_t *gc_guard_acquire(gc_global_t *gc_global)
+{
+    ptst_t *ptst = ptst_get(gc_global);
+
     gc_enter(ptst);
+    gc_guard_pin(ptst);
     return(ptst);
 }
 
 
+void gc_guard_refresh(gc_guard_t *guard)
+{
+    gc_exit(guard);
+    gc_enter(guard);
+    gc_guard_pin(guard);
+}
+
+
+void gc_guard_release(gc_guard_t *guard)
+{
+    gc_exit(guard);
+    ptst_put(guard);
+}
+
+
 static void ptst_destructor(ptst_t *ptst)
 {
-    ptst->count = 0;
+    if ( ptst_cache.ptst == ptst ) ptst_cache.gc_global = NULL;
+    ptst_put(ptst);
 }
 
 
-void _init_ptst_subsystem(gc_global_t *gc_global)
+/*
+ * A child process must not carry on with its parent's ptsts in shared
+ * domains, which the parent still owns, so it starts without any. Private
+ * domains were copied along with the ptsts in them, and are unaffected.
+ */
+static void ptst_atfork_child(void)
+{
+    shared_key_t *sk;
+
+    gc_pid = (unsigned int)getpid();
+    ptst_cache.gc_global = NULL;
+    for ( sk = shared_keys; sk != NULL; sk = sk->next )
+        pthread_setspecific(sk->key, NULL);
+}
+
+
+static void ptst_init_process(void)
+{
+    gc_pid = (unsigned int)getpid();
+    pthread_atfork(NULL, NULL, ptst_atfork_child);
+}
+
+
+static void ptst_key_create(gc_global_t *gc_global)
 {
+    pthread_key_t key;
+    shared_key_t *sk;
     int e;
 
+    pthread_once(&ptst_once, ptst_init_process);
+
+    if ( (e = pthread_key_create(&key, (void (*)(void *))ptst_destructor)) )
+    {
+#if !defined(KERNEL)
+	printf("MCAS can't make ptst key error=%d, aborting\n", e);
+#endif
+	abort();
+    }
+
+    if ( !IS_SHARED(gc_global) )
+    {
+        gc_global->ptst_key = key;
+        return;
+    }
+
+    if ( (sk = malloc(sizeof(*sk))) == NULL ) abort();
+    sk->gc_global = gc_global;
+    sk->key       = key;
+    pthread_mutex_lock(&shared_keys_lock);
+    sk->next    = shared_keys;
+    WMB();
+    shared_keys = sk;
+    pthread_mutex_unlock(&shared_keys_lock);
+}
+
+
+void _init_ptst_subsystem(gc_global_t *gc_global)
+{
     gc_global->ptst_list = NULL;
+    gc_global->ptst_free = NULL;
+    gc_global->ptst_free_lock = 0;
+    ADD_TO_RETURNING_NEW(next_domain_id, 1, gc_global->domain_id);
 #ifdef NEED_ID
     gc_global->next_id   = 0;
 #endif
     WMB();
-    if ( pthread_key_create(&gc_global->ptst_key, (void (*)(void *))ptst_destructor) )
+    ptst_key_create(gc_global);
+}
+
+
+void _attach_ptst_subsystem(gc_global_t *gc_global)
+{
+    ptst_key_create(gc_global);
+}
+
+
+/*
+ * Forget a shared domain which this process is unmapping. Its threads must
+ * have left it; their ptsts stay with the domain for other processes.
+ */
+void _detach_ptst_subsystem(gc_global_t *gc_global)
+{
+    shared_key_t *sk, **psk;
+
+    if ( ptst_cache.gc_global == gc_global ) ptst_cache.gc_global = NULL;
+
+    pthread_mutex_lock(&shared_keys_lock);
+    for ( psk = (shared_key_t **)&shared_keys; (sk = *psk) != NULL;
+          psk = &sk->next )
     {
-#if !defined(KERNEL)
-	printf("MCAS can't make ptst key error=%d, aborting\n", e);
-#endif
-	abort();
+        if ( sk->gc_global == gc_global )
+        {
+            *psk = sk->next;
+            pthread_key_delete(sk->key);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shared_keys_lock);
+}
+
+
+/* Is process @pid gone? */
+static int pid_dead(unsigned int pid)
+{
+    return (kill((pid_t)pid, 0) != 0) && (errno == ESRCH);
+}
+
+
+/*
+ * Give back the ptsts of processes which have died, as their threads would
+ * have on exit, dropping any critical region or guard they were in. Locks
+ * left held by a dead process are broken; whatever it was part way through
+ * moving between lists at the time is lost.
+ */
+int gc_shared_recover(gc_global_t *gc_global)
+{
+    ptst_t *ptst;
+    unsigned int pid;
+    int n = 0;
+
+    if ( ((pid = gc_global->inreclaim) != 0) && pid_dead(pid) )
+        (void)CASIO(&gc_global->inreclaim, pid, 0);
+    if ( ((pid = gc_global->reg_lock) != 0) && pid_dead(pid) )
+        (void)CASIO(&gc_global->reg_lock, pid, 0);
+    if ( ((pid = gc_global->ptst_free_lock) != 0) && pid_dead(pid) )
+        (void)CASIO(&gc_global->ptst_free_lock, pid, 0);
+
+    for ( ptst = ptst_first(gc_global); ptst != NULL; ptst = ptst_next(ptst) )
+    {
+        if ( (ptst->count == 0) || ((pid = ptst->pid) == 0) ||
+             (pid == gc_pid) || !pid_dead(pid) )
+            continue;
+        /* Claim it, in case of a concurrent recovery. */
+        if ( CASIO(&ptst->pid, pid, 0) != pid ) continue;
+
+        ptst->qsbr  = 0;
+        ptst->count = 1;
+        /* Its scan buffer was in the dead process's heap. */
+        ptst->gc->ibr_resv      = NULL;
+        ptst->gc->ibr_resv_size = 0;
+        ptst_put(ptst);
+        n++;
     }
+
+    return(n);
 }
@@ -45,7 +45,13 @@ struct ptst_st
 
     /* State management */
     ptst_t      *next;
+    ptst_t      *free_next;
     unsigned int count;
+    /* Non-zero if registered for quiescent-state-based reclamation. */
+    unsigned int qsbr;
+    /* Owning thread, for diagnostics, and its process. */
+    pthread_t    thread;
+    VOLATILE unsigned int pid;
     /* Utility structures */
     gc_t        *gc;
     rand_t       rand;
@@ -55,6 +61,9 @@ struct ptst_st
 ptst_t * ptst_first(gc_global_t *);
 #define ptst_next(_p) ((_p)->next)
 
+/* The calling thread's ptst in a domain, or NULL if it has none. */
+ptst_t *ptst_self(gc_global_t *);
+
 /* Called once at start-of-day for entire application. */
 void _init_ptst_subsystem(gc_global_t *);
 
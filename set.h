@@ -31,6 +31,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __SET_H__
 #define __SET_H__
 
+#include "gc.h"
+
 
 typedef unsigned long setkey_t;
 typedef void         *setval_t;
@@ -98,7 +100,7 @@ do {                                                            \
 
 typedef void set_t; /* opaque */
 
-void _init_set_subsystem(void);
+void _init_set_subsystem(gc_global_t *);
 
 /*
  * Allocate an empty set.
@@ -52,8 +52,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdarg.h>
 
 #include "portable_defns.h"
-#include "set.h"
+#include "random.h"
+#include "gc.h"
 #include "ptst.h"
+#include "set.h"
+#include "osi_mcas.h"
 
 /* This produces an operation log for the 'replay' checker. */
 /*#define DO_WRITE_LOG*/
@@ -116,7 +119,7 @@ static void dump_log (void) {
              "---------------------------\n");
     for (i = 0; i < num_log_records; i ++)
     {
-        char padding[40];
+        char padding[41];
         strcpy(padding, "                                        ");
         if (30-strlen(log_records[i].name) >= 0){
             padding[30-strlen(log_records[i].name)] = '\0';
@@ -172,10 +175,18 @@ static bool_t go = FALSE;
 static int threads_initialised1 = 0, max_key, log_max_key;
 static int threads_initialised2 = 0;
 static int threads_initialised3 = 0;
-int num_threads;
+static int num_threads;
+static gc_global_t *gc_global;
 
 static unsigned long proportion;
 
+/*
+ * Hot-key workload: this proportion (out of 256) of operations go to the
+ * first NUM_HOT_KEYS keys, to measure behaviour under contention.
+ */
+#define NUM_HOT_KEYS 8
+static unsigned long hot_proportion;
+
 static struct timeval start_time, done_time;
 static struct tms start_tms, done_tms;
 
@@ -208,13 +219,14 @@ static void *thread_start(void *arg)
     unsigned long k;
     int i;
     void *ov, *v;
-    int id = (int)arg;
+    int id = (int)(long)arg;
 #ifdef DO_WRITE_LOG
     log_t *log = global_log + id*MAX_ITERATIONS;
     interval_t my_int;
 #endif
     unsigned long r = ((unsigned long)arg)+3; /*RDTICK();*/
     unsigned int prop = proportion;
+    unsigned int hot = hot_proportion;
     unsigned int _max_key = max_key;
 
 #ifdef SPARC
@@ -228,9 +240,8 @@ static void *thread_start(void *arg)
 
     if ( id == 0 )
     {
-        _init_ptst_subsystem();
-        _init_gc_subsystem();
-        _init_set_subsystem();
+        gc_global = _init_gc_subsystem();
+        _init_set_subsystem(gc_global);
         shared.set = set_alloc();
     }
 
@@ -282,9 +293,10 @@ static void *thread_start(void *arg)
 #endif
     for ( i = 0; (i < MAX_ITERATIONS) && !shared.alarm_time; i++ )
     {
-        /* O-3: ignore ; 4-11: proportion ; 12: ins/del */
+        /* O-3: ignore ; 4-11: proportion ; 12: ins/del ; 13-20: hot */
         k = (nrand(r) >> 4) & (_max_key - 1);
         nrand(r);
+        if ( ((r>>13)&255) < hot ) k &= NUM_HOT_KEYS - 1;
 #ifdef DO_WRITE_LOG
         log->start = my_int;
 #endif
@@ -334,7 +346,6 @@ static void *thread_start(void *arg)
         gettimeofday(&done_time, NULL);
         times(&done_tms);
         WMB();
-        _destroy_gc_subsystem();
     }
 
     successes[id] = i;
@@ -373,7 +384,7 @@ static void test_multithreaded (void)
 
 #ifdef MIPS
     pthread_setconcurrency(num_threads + 1);
-#else
+#elif !defined(__linux__) /* a no-op there, and not declared by default */
     pthread_setconcurrency(num_threads);
 #endif
 
@@ -381,9 +392,9 @@ static void test_multithreaded (void)
     {
         MB();
 #ifdef PPC
-        pthread_create (&thrs[i], &attr, THREAD_TEST, (void *)i);
+        pthread_create (&thrs[i], &attr, THREAD_TEST, (void *)(long)i);
 #else
-        pthread_create (&thrs[i], NULL, THREAD_TEST, (void *)i);
+        pthread_create (&thrs[i], NULL, THREAD_TEST, (void *)(long)i);
 #endif
     }
 
@@ -400,6 +411,8 @@ static void test_multithreaded (void)
         }
     }
 
+    _destroy_gc_subsystem(gc_global);
+
     wall_time = (float)(TVAL(done_time) - TVAL(start_time))/ 1000000;
     user_time = ((float)(done_tms.tms_utime - start_tms.tms_utime))/ticksps;
     sys_time  = ((float)(done_tms.tms_stime - start_tms.tms_stime))/ticksps;
@@ -424,6 +437,26 @@ static void test_multithreaded (void)
 
     log_float("us_per_success", (num_threads*wall_time*1000000.0)/num_successes);
 
+#ifdef MCAS_STATS
+    {
+        static char *len_names[MCAS_STATS_LENGTHS] = {
+            "mcas_len_1", "mcas_len_2", "mcas_len_4", "mcas_len_8",
+            "mcas_len_16", "mcas_len_32", "mcas_len_64", "mcas_len_more" };
+        mcas_stats_t st;
+
+        mcas_get_stats(&st);
+        log_int("mcas_successes", (int)st.successes);
+        log_int("mcas_failures", (int)st.failures);
+        log_int("mcas_fast_path", (int)st.fast_path);
+        log_int("mcas_helps", (int)st.helps);
+        log_int("mcas_retries", (int)st.retries);
+        log_int("mcas_aborts", (int)st.aborts);
+        log_int("mcas_owned_reads", (int)st.owned_reads);
+        for ( i = 0; i < MCAS_STATS_LENGTHS; i++ )
+            log_int(len_names[i], (int)st.lengths[i]);
+    }
+#endif
+
     log_int("log max key", log_max_key);
 }
 
@@ -453,6 +486,26 @@ static void tstp_handler(int sig, siginfo_t *info, ucontext_t *uc)
 }
 #endif
 
+/*
+ * Take the MCAS contention policy from the environment, as MCAS_CM=help,
+ * backoff, wait or age, for the domains the set goes on to create.
+ */
+static void set_mcas_policy (void)
+{
+    char *cm = getenv("MCAS_CM");
+    mcas_config_t cfg;
+
+    if ( cm == NULL ) return;
+
+    mcas_config_init(&cfg);
+    if ( !strcmp(cm, "backoff") )   cfg.cm_policy = MCAS_CM_BACKOFF;
+    else if ( !strcmp(cm, "wait") ) cfg.cm_policy = MCAS_CM_WAIT;
+    else if ( !strcmp(cm, "age") )  cfg.cm_policy = MCAS_CM_AGE;
+    mcas_set_default_config(&cfg);
+
+    log_string ("mcas_cm", cm);
+}
+
 int main (int argc, char **argv)
 {
 #ifdef DO_WRITE_LOG
@@ -466,12 +519,14 @@ int main (int argc, char **argv)
         exit(1);
     }
 #else
-    if ( argc != 4 )
+    if ( (argc != 4) && (argc != 5) )
     {
-        printf("%s <num_threads> <read_proportion> <key power>\n"
-               "(0 <= read_proportion <= 256)\n", argv[0]);
+        printf("%s <num_threads> <read_proportion> <key power> "
+               "[<hot_proportion>]\n"
+               "(0 <= read_proportion, hot_proportion <= 256)\n", argv[0]);
         exit(1);
     }
+    if ( argc == 5 ) hot_proportion = atoi(argv[4]);
 #endif
 
     memset(&shared, 0, sizeof(shared));
@@ -482,6 +537,9 @@ int main (int argc, char **argv)
     proportion = atoi(argv[2]);
     log_float ("frac_reads", (float)proportion/256.0);
 
+    log_float ("frac_hot", (float)hot_proportion/256.0);
+    set_mcas_policy();
+
     log_max_key = atoi(argv[3]);
     max_key = 1 << atoi(argv[3]);
     log_int("max_key", max_key);
@@ -135,6 +135,14 @@ void _init_osi_cas_skip_subsystem(gc_global_t *);
  */
 osi_set_t *osi_cas_skip_alloc(int (*cmpf) (const void *, const void *));
 
+/*
+ * As osi_cas_skip_alloc(), but the set is placed in memory belonging to
+ * domain @g, so that it can be shared along with the domain (see
+ * gc_shared_create()). Its memory stays with the domain when it is freed.
+ */
+osi_set_t *osi_cas_skip_alloc_in(gc_global_t *g,
+				  int (*cmpf) (const void *, const void *));
+
 /*
  * Remove a set.  Caller is responsible for making sure it's not in use.
  */
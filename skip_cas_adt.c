@@ -80,11 +80,15 @@ struct node_st {
     sh_node_pt next[1];
 };
 
+/* Size of a node with @l forward pointers. */
+#define NODE_SIZE(l) (sizeof(node_t) + ((l) - 1) * sizeof(node_t *))
+
 typedef int (*osi_set_cmp_func) (const void *lhs, const void *rhs);
 
 struct set_st {
     CACHE_PAD(0);
     osi_set_cmp_func cmpf;
+    gc_global_t *domain;	/* owner of our memory, or NULL if malloc()ed */
       CACHE_PAD(1);
     node_t *tail;
       CACHE_PAD(2);
@@ -97,6 +101,18 @@ struct set_st {
 
 #define compare_keys(s, k1, k2) (s->cmpf((const void*) k1, (const void *) k2))
 
+/*
+ * Read a forward pointer which is about to be followed. Under interval-based
+ * reclamation the pointer must also be covered by our reservation.
+ */
+#define READ_NODE(_p, _x, _f)                                   \
+    do {                                                        \
+        if ((_p)->gc->ibr)                                      \
+            (_x) = gc_protect((_p), (void **)&(_f));            \
+        else                                                    \
+            READ_FIELD(_x, _f);                                 \
+    } while (0)
+
 /*
  * Random level generator. Drop-off rate is 0.5 per level.
  * Returns value 1 <= level <= NUM_LEVELS.
@@ -125,11 +141,9 @@ alloc_node(ptst_t * ptst)
 {
     int l;
     node_t *n;
-    gc_t *gc = ptst->gc;
-    gc_global_t *gc_global = gc->global;
 
     l = get_level(ptst);
-    n = gc_alloc(ptst, gc_global->gc_id[l - 1]);
+    n = gc_alloc_size(ptst, NODE_SIZE(l));
     n->level = l;
     return (n);
 }
@@ -139,9 +153,7 @@ alloc_node(ptst_t * ptst)
 static void
 free_node(ptst_t * ptst, sh_node_pt n)
 {
-    gc_t *gc = ptst->gc;
-    gc_global_t *gc_global = gc->global;
-    gc_free(ptst, (void *)n, gc_global->gc_id[(n->level & LEVEL_MASK) - 1]);
+    gc_free_size(ptst, (void *)n, NODE_SIZE(n->level & LEVEL_MASK));
 }
 
 
@@ -153,8 +165,8 @@ free_node(ptst_t * ptst, sh_node_pt n)
  *  MAIN RETURN VALUE: same as @na[0].
  */
 static sh_node_pt
-strong_search_predecessors(osi_set_t * l, setkey_t k, sh_node_pt * pa,
-			   sh_node_pt * na)
+strong_search_predecessors(ptst_t * ptst, osi_set_t * l, setkey_t k,
+			   sh_node_pt * pa, sh_node_pt * na)
 {
     sh_node_pt x, x_next, old_x_next, y, y_next;
     setkey_t y_k;
@@ -166,7 +178,7 @@ strong_search_predecessors(osi_set_t * l, setkey_t k, sh_node_pt * pa,
     x = &l->head;
     for (i = NUM_LEVELS - 1; i >= 0; i--) {
 	/* We start our search at previous level's unmarked predecessor. */
-	READ_FIELD(x_next, x->next[i]);
+	READ_NODE(ptst, x_next, x->next[i]);
 	/* If this pointer's marked, so is @pa[i+1]. May as well retry. */
 	if (is_marked_ref(x_next))
 	    goto retry;
@@ -174,7 +186,7 @@ strong_search_predecessors(osi_set_t * l, setkey_t k, sh_node_pt * pa,
 	for (y = x_next;; y = y_next) {
 	    /* Shift over a sequence of marked nodes. */
 	    for (;;) {
-		READ_FIELD(y_next, y->next[i]);
+		READ_NODE(ptst, y_next, y->next[i]);
 		if (!is_marked_ref(y_next))
 		    break;
 		y = get_unmarked_ref(y_next);
@@ -209,8 +221,8 @@ strong_search_predecessors(osi_set_t * l, setkey_t k, sh_node_pt * pa,
 
 /* This function does not remove marked nodes. Use it optimistically. */
 static sh_node_pt
-weak_search_predecessors(osi_set_t * l, setkey_t k, sh_node_pt * pa,
-			 sh_node_pt * na)
+weak_search_predecessors(ptst_t * ptst, osi_set_t * l, setkey_t k,
+			 sh_node_pt * pa, sh_node_pt * na)
 {
     sh_node_pt x, x_next;
     setkey_t x_next_k;
@@ -219,7 +231,7 @@ weak_search_predecessors(osi_set_t * l, setkey_t k, sh_node_pt * pa,
     x = &l->head;
     for (i = NUM_LEVELS - 1; i >= 0; i--) {
 	for (;;) {
-	    READ_FIELD(x_next, x->next[i]);
+	    READ_NODE(ptst, x_next, x->next[i]);
 	    x_next = get_unmarked_ref(x_next);
 
 	    if (x_next == l->tail) break;
@@ -278,7 +290,7 @@ do_full_delete(ptst_t * ptst, osi_set_t * l, sh_node_pt x, int level)
     sh_node_pt preds[NUM_LEVELS];
     int i = level;
   retry:
-    (void)strong_search_predecessors(l, k, preds, NULL);
+    (void)strong_search_predecessors(ptst, l, k, preds, NULL);
     /*
      * Above level 1, references to @x can disappear if a node is inserted
      * immediately before and we see an old value for its forward pointer. This
@@ -299,7 +311,7 @@ do_full_delete(ptst_t * ptst, osi_set_t * l, sh_node_pt x, int level)
 	i--;			/* don't need to check this level again, even if we retry. */
     }
 #else
-    (void)strong_search_predecessors(l, k, NULL, NULL);
+    (void)strong_search_predecessors(ptst, l, k, NULL, NULL);
 #endif
     free_node(ptst, x);
 }
@@ -310,41 +322,25 @@ do_full_delete(ptst_t * ptst, osi_set_t * l, sh_node_pt x, int level)
  */
 
 /*
- * Called once before any set operations, including set_alloc
+ * Called once before any set operations, including set_alloc.
+ * Nodes come from the GC's size classes, so there is nothing to register.
  */
 void
 _init_osi_cas_skip_subsystem(gc_global_t *gc_global)
 {
-    int i;
-    int *gc_id, *a;
-
-    if (gc_global->gc_id) return;
-    gc_id = malloc(sizeof *gc_id * NUM_LEVELS);
-    memset(gc_id, 0, sizeof *gc_id * NUM_LEVELS);
-    a = 0;
-    a = CASPO(&gc_global->gc_id, a, gc_id);
-    if (a) {
-	free(gc_id);
-	return;
-    }
-
-    for (i = 0; i < NUM_LEVELS; i++) {
-		gc_id[i] = gc_add_allocator(gc_global, sizeof(node_t) + i * sizeof(node_t *),
-			"cas_skip_level");
-    }
 }
 
 
-osi_set_t *
-osi_cas_skip_alloc(osi_set_cmp_func cmpf)
+/* Bytes for a set: its head node, then its tail node. */
+#define SET_BYTES (2 * (sizeof(osi_set_t) + (NUM_LEVELS - 1) * sizeof(node_t *)))
+
+static osi_set_t *
+skip_init(char *cp, osi_set_cmp_func cmpf, gc_global_t *domain)
 {
     osi_set_t *l;
     node_t *n;
-    char *cp;
     int i;
 
-    cp = malloc(sizeof(*l) + (NUM_LEVELS - 1) * sizeof(node_t *)
-		+ sizeof(*n) + (NUM_LEVELS - 1) * sizeof(node_t *));
     n = (node_t *) (cp + sizeof(*l) + (NUM_LEVELS - 1) * sizeof(node_t *));
     l = (osi_set_t *) (cp);
     memset(n, 0, sizeof(*n) + (NUM_LEVELS - 1) * sizeof(node_t *));
@@ -359,6 +355,7 @@ osi_cas_skip_alloc(osi_set_cmp_func cmpf)
 
     l->tail = n;
     l->cmpf = cmpf;
+    l->domain = domain;
     l->head.k = SENTINEL_KEYMIN;
     l->head.level = NUM_LEVELS;
     for (i = 0; i < NUM_LEVELS; i++) {
@@ -369,6 +366,24 @@ osi_cas_skip_alloc(osi_set_cmp_func cmpf)
 }
 
 
+osi_set_t *
+osi_cas_skip_alloc(osi_set_cmp_func cmpf)
+{
+    return (skip_init(malloc(SET_BYTES), cmpf, NULL));
+}
+
+
+osi_set_t *
+osi_cas_skip_alloc_in(gc_global_t *gc_global, osi_set_cmp_func cmpf)
+{
+    char *cp = gc_shared_alloc(gc_global, SET_BYTES);
+
+    if (cp == NULL)
+	return (NULL);
+    return (skip_init(cp, cmpf, gc_global));
+}
+
+
 void
 osi_cas_skip_free_critical(ptst_t *ptst, osi_set_t *l)
 {
@@ -379,7 +394,10 @@ osi_cas_skip_free_critical(ptst_t *ptst, osi_set_t *l)
     int i, level;
 
     gc_t *gc = ptst->gc;
-    while ((n = l->head.next[0]) != l->tail) {
+    for (;;) {
+	READ_NODE(ptst, n, l->head.next[0]);
+	if (n == l->tail)
+	    break;
 	READ_FIELD(level, n->level);
 	level = level & LEVEL_MASK;
 
@@ -419,8 +437,10 @@ osi_cas_skip_free(gc_global_t *gc_global, osi_set_t *l)
     critical_exit(ptst);
     ptst = critical_enter(gc_global);
     critical_exit(ptst);
-    memset(l, 0x67, sizeof *l);
-    free(l);
+    if (l->domain == NULL) {
+	memset(l, 0x67, sizeof *l);
+	free(l);
+    }
 }
 
 
@@ -433,7 +453,7 @@ osi_cas_skip_update_critical(ptst_t *ptst, osi_set_t * l, setkey_t k, setval_t v
     sh_node_pt pred, succ, new = NULL, new_next, old_next;
     int i, level;
 
-    succ = weak_search_predecessors(l, k, preds, succs);
+    succ = weak_search_predecessors(ptst, l, k, preds, succs);
 
   retry:
     ov = NULL;
@@ -449,7 +469,7 @@ osi_cas_skip_update_critical(ptst_t *ptst, osi_set_t * l, setkey_t k, setval_t v
 		/* Finish deleting the node, then retry. */
 		READ_FIELD(level, succ->level);
 		mark_deleted(succ, level & LEVEL_MASK);
-		succ = strong_search_predecessors(l, k, preds, succs);
+		succ = strong_search_predecessors(ptst, l, k, preds, succs);
 		goto retry;
 	    }
 	} while (overwrite && ((new_ov = CASPO(&succ->v, ov, v)) != ov));
@@ -484,7 +504,7 @@ osi_cas_skip_update_critical(ptst_t *ptst, osi_set_t * l, setkey_t k, setval_t v
     WMB_NEAR_CAS();		/* make sure node fully initialised before inserting */
     old_next = CASPO(&preds[0]->next[0], succ, new);
     if (old_next != succ) {
-	succ = strong_search_predecessors(l, k, preds, succs);
+	succ = strong_search_predecessors(ptst, l, k, preds, succs);
 	goto retry;
     }
 
@@ -521,7 +541,7 @@ osi_cas_skip_update_critical(ptst_t *ptst, osi_set_t * l, setkey_t k, setval_t v
 	if (old_next != succ) {
 	  new_world_view:
 	    RMB();		/* get up-to-date view of the world. */
-	    (void)strong_search_predecessors(l, k, preds, succs);
+	    (void)strong_search_predecessors(ptst, l, k, preds, succs);
 	    continue;
 	}
 
@@ -558,7 +578,7 @@ osi_cas_skip_remove_critical(ptst_t *ptst, osi_set_t * l, setkey_t k)
     sh_node_pt preds[NUM_LEVELS], x;
     int level, i;
 
-    x = weak_search_predecessors(l, k, preds, NULL);
+    x = weak_search_predecessors(ptst, l, k, preds, NULL);
     if (x == l->tail || compare_keys(l, x->k, k) > 0)
 	goto out;
 
@@ -617,7 +637,7 @@ osi_cas_skip_lookup_critical(ptst_t *ptst, osi_set_t * l, setkey_t k)
     setval_t v = NULL;
     sh_node_pt x;
 
-    x = weak_search_predecessors(l, k, NULL, NULL);
+    x = weak_search_predecessors(ptst, l, k, NULL, NULL);
     if (x != l->tail && compare_keys(l, x->k, k) == 0)
 	READ_FIELD(v, x->v);
 
@@ -653,7 +673,7 @@ osi_cas_skip_for_each_critical(ptst_t *ptst, osi_set_t * l, osi_set_each_func ea
     x = &l->head;
     y = x;
     for (;;) {
-	READ_FIELD(x_next, y->next[0]);
+	READ_NODE(ptst, x_next, y->next[0]);
 	x_next = get_unmarked_ref(x_next);
 
 	READ_FIELD(x_next_k, x_next->k);
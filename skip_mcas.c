@@ -39,22 +39,20 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <assert.h>
 #include "portable_defns.h"
+#include "random.h"
+#include "gc.h"
 #include "ptst.h"
+#include "osi_mcas.h"
 #include "set.h"
 
-#define MCAS_MARK(_v) ((unsigned long)(_v) & 3)
-
 #define PROCESS(_v, _pv)                        \
-  while ( MCAS_MARK(_v) ) {                     \
+  while ( MCAS_IS_OWNED(_v) ) {                 \
     mcas_fixup((void **)(_pv), _v);             \
     (_v) = *(_pv);                              \
   }
 
 #define WALK_THRU(_v, _pv)                      \
-  if ( MCAS_MARK(_v) ) (_v) = read_barrier_lite((void **)(_pv));
-
-/* Pull in the MCAS implementation. */
-#include "mcas.c"
+  if ( MCAS_IS_OWNED(_v) ) (_v) = mcas_read((void **)(_pv));
 
 /*
  * SKIP LIST
@@ -78,6 +76,8 @@ struct set_st
 };
 
 static int gc_id[NUM_LEVELS];
+static gc_global_t *gc_global;
+static mcas_domain_t *mcas_domain;
 
 /*
  * PRIVATE FUNCTIONS
@@ -159,8 +159,7 @@ static sh_node_pt search_predecessors(
 
 static setval_t finish_delete(sh_node_pt x, sh_node_pt *preds)
 {
-    per_thread_state_t *mcas_ptst = get_ptst();
-    CasDescriptor_t *cd;
+    mcas_entry_t e[(NUM_LEVELS << 1) + 1];
     int level, i, ret = FALSE;
     sh_node_pt x_next;
     setkey_t x_next_k;
@@ -168,17 +167,13 @@ static setval_t finish_delete(sh_node_pt x, sh_node_pt *preds)
 
     READ_FIELD(level, x->level);
 
-    cd = new_descriptor(mcas_ptst, (level << 1) + 1);
-    cd->status = STATUS_IN_PROGRESS;
-    cd->length = (level << 1) + 1;
-
     /* First, the deleted node's value field. */
     READ_FIELD(v, x->v);
     PROCESS(v, &x->v);
     if ( v == NULL ) goto fail;
-    cd->entries[0].ptr = (void **)&x->v;
-    cd->entries[0].old = v;
-    cd->entries[0].new = NULL;
+    e[0].ptr    = (void **)&x->v;
+    e[0].oldval = v;
+    e[0].newval = NULL;
 
     for ( i = 0; i < level; i++ )
     {
@@ -186,19 +181,18 @@ static setval_t finish_delete(sh_node_pt x, sh_node_pt *preds)
         PROCESS(x_next, &x->next[i]);
         READ_FIELD(x_next_k, x_next->k);
         if ( x->k > x_next_k ) { v = NULL; goto fail; }
-        cd->entries[i      +1].ptr = (void **)&x->next[i];
-        cd->entries[i      +1].old = x_next;
-        cd->entries[i      +1].new = preds[i];
-        cd->entries[i+level+1].ptr = (void **)&preds[i]->next[i];
-        cd->entries[i+level+1].old = x;
-        cd->entries[i+level+1].new = x_next;
+        e[i      +1].ptr    = (void **)&x->next[i];
+        e[i      +1].oldval = x_next;
+        e[i      +1].newval = preds[i];
+        e[i+level+1].ptr    = (void **)&preds[i]->next[i];
+        e[i+level+1].oldval = x;
+        e[i+level+1].newval = x_next;
     }
 
-    ret = mcas0(mcas_ptst, cd);
+    ret = mcas_n(mcas_domain, (level << 1) + 1, e, 0);
     if ( ret == 0 ) v = NULL;
 
  fail:
-    rc_down_descriptor(cd);
     return v;
 }
 
@@ -213,9 +207,6 @@ set_t *set_alloc(void)
     node_t *n;
     int i;
 
-    static int mcas_inited = 0;
-    if ( !CASIO(&mcas_inited, 0, 1) ) mcas_init();
-
     n = malloc(sizeof(*n) + (NUM_LEVELS-1)*sizeof(node_t *));
     memset(n, 0, sizeof(*n) + (NUM_LEVELS-1)*sizeof(node_t *));
     n->k = SENTINEL_KEYMAX;
@@ -246,12 +237,11 @@ setval_t set_update(set_t *l, setkey_t k, setval_t v, int overwrite)
     sh_node_pt preds[NUM_LEVELS], succs[NUM_LEVELS];
     sh_node_pt succ, new = NULL;
     int        i, ret;
-    per_thread_state_t *mcas_ptst = NULL;
-    CasDescriptor_t *cd;
+    mcas_entry_t e[NUM_LEVELS];
 
     k = CALLER_TO_INTERNAL_KEY(k);
 
-    ptst = critical_enter();
+    ptst = critical_enter(gc_global);
 
     do {
     retry:
@@ -296,18 +286,13 @@ setval_t set_update(set_t *l, setkey_t k, setval_t v, int overwrite)
             new->next[i] = succs[i];
         }
 
-        if ( !mcas_ptst ) mcas_ptst = get_ptst();
-        cd = new_descriptor(mcas_ptst, new->level);
-        cd->status = STATUS_IN_PROGRESS;
-        cd->length = new->level;
         for ( i = 0; i < new->level; i++ )
         {
-            cd->entries[i].ptr = (void **)&preds[i]->next[i];
-            cd->entries[i].old = succs[i];
-            cd->entries[i].new = new;
+            e[i].ptr    = (void **)&preds[i]->next[i];
+            e[i].oldval = succs[i];
+            e[i].newval = new;
         }
-        ret = mcas0(mcas_ptst, cd);
-        rc_down_descriptor(cd);
+        ret = mcas_n(mcas_domain, new->level, e, 0);
     }
     while ( !ret );
 
@@ -325,7 +310,7 @@ setval_t set_remove(set_t *l, setkey_t k)
 
     k = CALLER_TO_INTERNAL_KEY(k);
 
-    ptst = critical_enter();
+    ptst = critical_enter(gc_global);
 
     do {
         x = search_predecessors(l, k, preds, NULL);
@@ -348,7 +333,7 @@ setval_t set_lookup(set_t *l, setkey_t k)
 
     k = CALLER_TO_INTERNAL_KEY(k);
 
-    ptst = critical_enter();
+    ptst = critical_enter(gc_global);
 
     x = search_predecessors(l, k, NULL, NULL);
     if ( x->k == k )
@@ -362,13 +347,18 @@ setval_t set_lookup(set_t *l, setkey_t k)
 }
 
 
-void _init_set_subsystem(void)
+void _init_set_subsystem(gc_global_t *g)
 {
     int i;
 
+    gc_global   = g;
+    mcas_domain = mcas_init();
+
     for ( i = 0; i < NUM_LEVELS; i++ )
     {
-        gc_id[i] = gc_add_allocator(sizeof(node_t) + i*sizeof(node_t *));
+        gc_id[i] = gc_add_allocator(gc_global,
+                                    sizeof(node_t) + i*sizeof(node_t *),
+                                    "skip_mcas_level");
     }
 
 }